@@ -0,0 +1,187 @@
+/*
+ * Read/write scaling benchmark
+ *
+ * test_snfs_bench_rw.c
+ *
+ * Runs 1, 2, 4, ... up to 'max_clients' client processes against the
+ * server and reports the throughput of two workloads:
+ * - shared read: every client reads the same file
+ * - private write: every client writes its own file
+ *
+ * usage: test_snfs_bench_rw [max_clients] [ops_per_client]
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <snfs_api.h>
+
+#define CLI_SOCKET_BASE "/tmp/client_bench_%d.socket"
+#define SRV_SOCKET "/tmp/server.socket"
+#define SHARED_FILE "bench_shared"
+#define FILE_SIZE 4096
+#define IO_SIZE 1024
+
+enum { BENCH_READ, BENCH_WRITE };
+
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+// Corpo de cada processo cliente
+static int client_run(int id, int mode, int ops)
+{
+    char cli_sock[64];
+    char buffer[IO_SIZE];
+    snfs_fhandle_t root, file;
+    unsigned fsize;
+
+    snprintf(cli_sock, sizeof(cli_sock), CLI_SOCKET_BASE, getpid());
+    if (snfs_init(cli_sock, SRV_SOCKET) < 0) {
+        fprintf(stderr, "[Cliente %d] Erro ao inicializar o cliente.\n", id);
+        return 1;
+    }
+
+    if (mode == BENCH_READ) {
+        if (snfs_lookup("/" SHARED_FILE, &file, &fsize) != STAT_OK) {
+            fprintf(stderr, "[Cliente %d] Erro ao procurar ficheiro.\n", id);
+            snfs_finish();
+            return 1;
+        }
+    } else {
+        char name[MAX_FILE_NAME_SIZE];
+        snprintf(name, sizeof(name), "bw_%d", getpid() % 100000);
+        if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+            snfs_create(root, name, &file) != STAT_OK) {
+            fprintf(stderr, "[Cliente %d] Erro ao criar ficheiro.\n", id);
+            snfs_finish();
+            return 1;
+        }
+        memset(buffer, 'a' + id % 26, sizeof(buffer));
+    }
+
+    for (int i = 0; i < ops; i++) {
+        unsigned offset = (i * IO_SIZE) % FILE_SIZE;
+        int nread;
+        snfs_call_status_t status = (mode == BENCH_READ) ?
+            snfs_read(file, offset, IO_SIZE, buffer, &nread) :
+            snfs_write(file, offset, IO_SIZE, buffer, &fsize);
+        if (status != STAT_OK) {
+            fprintf(stderr, "[Cliente %d] Erro na operacao %d.\n", id, i);
+            snfs_finish();
+            return 1;
+        }
+    }
+
+    snfs_finish();
+    return 0;
+}
+
+
+// Lança 'nclients' processos e devolve as operações por segundo
+static double bench_run(int nclients, int mode, int ops)
+{
+    double start = now();
+    for (int i = 0; i < nclients; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            exit(client_run(i, mode, ops));
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < nclients; i++) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    double elapsed = now() - start;
+
+    if (failed) {
+        return -1;
+    }
+    return nclients * ops / elapsed;
+}
+
+
+// Cria e preenche o ficheiro lido por todos os clientes
+static int bench_setup()
+{
+    char cli_sock[64];
+    char buffer[IO_SIZE];
+    snfs_fhandle_t root, file;
+    unsigned fsize;
+
+    snprintf(cli_sock, sizeof(cli_sock), CLI_SOCKET_BASE, getpid());
+    if (snfs_init(cli_sock, SRV_SOCKET) < 0) {
+        fprintf(stderr, "[Main] Erro ao inicializar o cliente.\n");
+        return -1;
+    }
+
+    if (snfs_lookup("/" SHARED_FILE, &file, &fsize) != STAT_OK) {
+        if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+            snfs_create(root, SHARED_FILE, &file) != STAT_OK) {
+            fprintf(stderr, "[Main] Erro ao criar ficheiro.\n");
+            snfs_finish();
+            return -1;
+        }
+    }
+
+    memset(buffer, 'r', sizeof(buffer));
+    for (unsigned offset = 0; offset < FILE_SIZE; offset += IO_SIZE) {
+        if (snfs_write(file, offset, IO_SIZE, buffer, &fsize) != STAT_OK) {
+            fprintf(stderr, "[Main] Erro ao escrever.\n");
+            snfs_finish();
+            return -1;
+        }
+    }
+
+    snfs_finish();
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    int max_clients = (argc > 1) ? atoi(argv[1]) : 8;
+    int ops = (argc > 2) ? atoi(argv[2]) : 200;
+
+    if (max_clients < 1 || ops < 1) {
+        fprintf(stderr, "usage: %s [max_clients] [ops_per_client]\n", argv[0]);
+        return 1;
+    }
+
+    if (bench_setup() < 0) {
+        return 1;
+    }
+
+    printf("clients   shared read (ops/s)   private write (ops/s)\n");
+    for (int n = 1; n <= max_clients; n *= 2) {
+        double rd = bench_run(n, BENCH_READ, ops);
+        double wr = bench_run(n, BENCH_WRITE, ops);
+        if (rd < 0 || wr < 0) {
+            fprintf(stderr, "[Main] Falha com %d clientes.\n", n);
+            return 1;
+        }
+        printf("%7d   %19.0f   %21.0f\n", n, rd, wr);
+    }
+
+    return 0;
+}
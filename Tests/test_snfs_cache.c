@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_cache_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define FILE_SIZE 4096
+#define CHUNK 1024
+
+int main() {
+    snfs_fhandle_t root, file;
+    snfs_cache_t def, big, small, now;
+    unsigned fsize;
+    int nread;
+    char data[FILE_SIZE], buf[FILE_SIZE];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_cache(root, 0, 0, &def) != STAT_OK) {
+        printf("Cache query failed\n");
+        return 1;
+    }
+    printf("Cache: %u bytes (%u%% metadata), %u blocks, %u directory pages\n",
+           def.budget, def.meta_pct, def.blocks, def.dirpages);
+
+    // aumentar a cache
+    if (snfs_cache(root, 4 * def.budget, def.meta_pct, &big) != STAT_OK ||
+        big.budget != 4 * def.budget || big.blocks <= def.blocks) {
+        printf("Cache grow failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < FILE_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    if (snfs_create(root, "cached", &file) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+    for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+        if (snfs_write(file, off, CHUNK, &data[off], &fsize) != STAT_OK) {
+            printf("Write failed\n");
+            return 1;
+        }
+    }
+
+    // encolher a cache: os blocos dirty que saem são escritos no disco
+    if (snfs_cache(root, def.budget / 4, 50, &small) != STAT_OK ||
+        small.blocks >= def.blocks) {
+        printf("Cache shrink failed\n");
+        return 1;
+    }
+    for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+        if (snfs_read(file, off, CHUNK, &buf[off], &nread) != STAT_OK ||
+            nread != CHUNK) {
+            printf("Read failed\n");
+            return 1;
+        }
+    }
+    if (memcmp(buf, data, FILE_SIZE) != 0) {
+        printf("Wrong file contents after shrinking the cache\n");
+        return 1;
+    }
+
+    // um orçamento inválido não muda a cache
+    if (snfs_cache(root, def.budget, 101, &now) == STAT_OK ||
+        snfs_cache(root, 0, 0, &now) != STAT_OK || now.budget != small.budget) {
+        printf("Invalid budget accepted\n");
+        return 1;
+    }
+
+    if (snfs_cache(root, def.budget, def.meta_pct, &now) != STAT_OK) {
+        printf("Cache restore failed\n");
+        return 1;
+    }
+    printf("Cache success\n");
+
+    snfs_finish();
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_dedup_client.socket"
+#define SRV "/tmp/server.socket"
+
+// o servidor tem de ser lancado com: ./server -dedup
+#define FILE_SIZE 4096
+#define CHUNK 1024
+#define NUM_COPIES 4
+
+int main() {
+    snfs_fhandle_t root, file[NUM_COPIES];
+    snfs_statfs_t before, after;
+    unsigned fsize;
+    int nread;
+    char name[16], data[FILE_SIZE], buf[CHUNK];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_statfs(root, &before) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    // varios ficheiros com o mesmo conteudo
+    for (int i = 0; i < FILE_SIZE; i++) {
+        data[i] = 'a' + (i * 7) % 26;
+    }
+    for (int f = 0; f < NUM_COPIES; f++) {
+        sprintf(name, "dup%d", f);
+        if (snfs_create(root, name, &file[f]) != STAT_OK) {
+            printf("Create failed\n");
+            return 1;
+        }
+        for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+            if (snfs_write(file[f], off, CHUNK, &data[off], &fsize) != STAT_OK) {
+                printf("Write failed\n");
+                return 1;
+            }
+        }
+    }
+
+    // os blocos das copias sao libertados em segundo plano
+    int used = 0;
+    for (int i = 0; i < 100; i++) {
+        if (snfs_statfs(root, &after) != STAT_OK) {
+            printf("Statfs failed\n");
+            return 1;
+        }
+        used = before.bfree - after.bfree;
+        if (used == FILE_SIZE / before.bsize) {
+            break;
+        }
+    }
+    printf("%d copies of %d bytes use %d blocks\n", NUM_COPIES, FILE_SIZE, used);
+    if (used != FILE_SIZE / before.bsize) {
+        printf("Duplicate blocks were not shared\n");
+        return 1;
+    }
+
+    // alterar uma copia nao muda as outras
+    memset(buf, 'x', CHUNK);
+    if (snfs_write(file[0], 0, CHUNK, buf, &fsize) != STAT_OK ||
+        snfs_read(file[1], 0, CHUNK, buf, &nread) != STAT_OK ||
+        nread != CHUNK || memcmp(buf, data, CHUNK) != 0) {
+        printf("Copy on write failed\n");
+        return 1;
+    }
+    printf("Dedup success\n");
+
+    snfs_finish();
+    return 0;
+}
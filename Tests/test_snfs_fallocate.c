@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_fallocate_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define FILE_SIZE 4096
+#define CHUNK 1024
+
+int main() {
+    snfs_fhandle_t root, file;
+    snfs_statfs_t before, reserved, written;
+    unsigned fsize;
+    int nread;
+    char data[FILE_SIZE], buf[FILE_SIZE];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_create(root, "prealloc", &file) != STAT_OK ||
+        snfs_statfs(file, &before) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+
+    // reservar o ficheiro inteiro antes de o escrever
+    if (snfs_fallocate(file, 0, FILE_SIZE) != STAT_OK ||
+        snfs_statfs(file, &reserved) != STAT_OK) {
+        printf("Fallocate failed\n");
+        return 1;
+    }
+    if (snfs_lookup("/prealloc", &file, &fsize) != STAT_OK || fsize != 0) {
+        printf("Fallocate should not change the file size\n");
+        return 1;
+    }
+    printf("free blocks: %u -> %u\n", before.bfree, reserved.bfree);
+    if (before.bfree - reserved.bfree != FILE_SIZE / before.bsize) {
+        printf("Wrong number of reserved blocks\n");
+        return 1;
+    }
+
+    // as escritas usam os blocos reservados
+    for (int i = 0; i < FILE_SIZE; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+        if (snfs_write(file, off, CHUNK, &data[off], &fsize) != STAT_OK) {
+            printf("Write failed\n");
+            return 1;
+        }
+    }
+    if (snfs_statfs(file, &written) != STAT_OK || written.bfree != reserved.bfree) {
+        printf("Writes allocated blocks outside the reservation\n");
+        return 1;
+    }
+
+    for (int off = 0; off < FILE_SIZE; off += CHUNK) {
+        if (snfs_read(file, off, CHUNK, &buf[off], &nread) != STAT_OK ||
+            nread != CHUNK) {
+            printf("Read failed\n");
+            return 1;
+        }
+    }
+    if (memcmp(buf, data, FILE_SIZE) != 0) {
+        printf("Wrong file contents\n");
+        return 1;
+    }
+    printf("Fallocate success\n");
+
+    snfs_finish();
+    return 0;
+}
@@ -8,7 +8,7 @@
 int main() {
     snfs_fhandle_t root, newdir;
     snfs_dir_entry_t entries[10];
-    unsigned fsize, count;
+    unsigned fsize, count, cookie = 0;
 
     snfs_init(CLI, SRV);
 
@@ -22,7 +22,7 @@ int main() {
         return 1;
     }
 
-    if (snfs_readdir(root, 10, entries, &count) != STAT_OK) {
+    if (snfs_readdir(root, &cookie, 10, entries, &count) != STAT_OK) {
         printf("readdir failed\n");
         return 1;
     }
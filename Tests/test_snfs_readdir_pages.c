@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_readdir_pages_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define NUM_FILES 40
+#define PAGE_SIZE 8
+
+int main() {
+    snfs_fhandle_t root, dir, file;
+    snfs_dir_entry_t entries[PAGE_SIZE];
+    unsigned fsize, count, cookie = 0;
+    char name[MAX_FILE_NAME_SIZE];
+    int total = 0, pages = 0;
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    if (snfs_mkdir(root, "pages", &dir) != STAT_OK) {
+        printf("mkdir failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "p%02d", i);
+        if (snfs_create(dir, name, &file) != STAT_OK) {
+            printf("Create %s failed\n", name);
+            return 1;
+        }
+    }
+
+    // each page resumes at the cookie returned by the previous one
+    while (cookie != READDIR_COOKIE_END) {
+        if (snfs_readdir(dir, &cookie, PAGE_SIZE, entries, &count) != STAT_OK) {
+            printf("readdir failed\n");
+            return 1;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            snprintf(name, sizeof(name), "p%02d", total + i);
+            if (strcmp(entries[i].name, name) != 0) {
+                printf("Unexpected entry %s (expected %s)\n", entries[i].name, name);
+                return 1;
+            }
+        }
+        total += count;
+        pages++;
+        if (count == 0) {
+            break;
+        }
+    }
+
+    if (total != NUM_FILES) {
+        printf("Listed %d entries, expected %d\n", total, NUM_FILES);
+        return 1;
+    }
+    printf("Readdir success: %d entries in %d pages\n", total, pages);
+
+    snfs_finish();
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_readdir_unlink_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define NUM_FILES 40
+#define PAGE_SIZE 8
+
+int main() {
+    snfs_fhandle_t root, dir, file;
+    snfs_dir_entry_t entries[PAGE_SIZE];
+    unsigned fsize, count, cookie = 0;
+    char name[MAX_FILE_NAME_SIZE];
+    int seen[NUM_FILES] = {0};
+    int first = 1;
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    if (snfs_mkdir(root, "unlinked", &dir) != STAT_OK) {
+        printf("mkdir failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "u%02d", i);
+        if (snfs_create(dir, name, &file) != STAT_OK) {
+            printf("Create %s failed\n", name);
+            return 1;
+        }
+    }
+
+    // the entries listed in each page are removed before the next page;
+    // the cookie must still resume right after them
+    while (cookie != READDIR_COOKIE_END) {
+        if (snfs_readdir(dir, &cookie, PAGE_SIZE, entries, &count) != STAT_OK) {
+            printf("readdir failed\n");
+            return 1;
+        }
+        for (unsigned i = 0; i < count; i++) {
+            int k;
+            if (sscanf(entries[i].name, "u%d", &k) != 1 || k < 0 || k >= NUM_FILES) {
+                printf("Unexpected entry %s\n", entries[i].name);
+                return 1;
+            }
+            seen[k]++;
+            if (snfs_unlink(dir, entries[i].name) != STAT_OK) {
+                printf("Unlink %s failed\n", entries[i].name);
+                return 1;
+            }
+        }
+        // the last entry is removed before it is listed
+        if (first) {
+            snprintf(name, sizeof(name), "u%02d", NUM_FILES - 1);
+            if (snfs_unlink(dir, name) != STAT_OK) {
+                printf("Unlink %s failed\n", name);
+                return 1;
+            }
+            first = 0;
+        }
+        if (count == 0) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        if (seen[i] != (i < NUM_FILES - 1)) {
+            printf("Entry u%02d listed %d times\n", i, seen[i]);
+            return 1;
+        }
+    }
+
+    if (snfs_rmdir(root, "unlinked") != STAT_OK) {
+        printf("rmdir of the emptied directory failed\n");
+        return 1;
+    }
+    printf("Readdir with unlinks success\n");
+
+    snfs_finish();
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_readdirplus_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define NUM_FILES 5
+
+int main() {
+    snfs_fhandle_t root, dir, files[NUM_FILES];
+    snfs_dir_entry_plus_t entries[MAX_READDIRPLUS_ENTRIES];
+    unsigned fsize, count, cookie = 0;
+    char name[MAX_FILE_NAME_SIZE];
+    char data[300];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    if (snfs_mkdir(root, "plus", &dir) != STAT_OK) {
+        printf("mkdir failed\n");
+        return 1;
+    }
+
+    // file i has i*50 bytes
+    memset(data, 'x', sizeof(data));
+    for (int i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        if (snfs_create(dir, name, &files[i]) != STAT_OK ||
+            snfs_write(files[i], 0, i * 50, data, &fsize) != STAT_OK) {
+            printf("Create %s failed\n", name);
+            return 1;
+        }
+    }
+
+    if (snfs_readdirplus(dir, &cookie, MAX_READDIRPLUS_ENTRIES, entries, &count) != STAT_OK) {
+        printf("readdirplus failed\n");
+        return 1;
+    }
+
+    if (count != NUM_FILES || cookie != READDIR_COOKIE_END) {
+        printf("Unexpected number of entries: %u\n", count);
+        return 1;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        printf("  %s handle=%d size=%u\n", entries[i].name, entries[i].file, entries[i].fsize);
+        if (entries[i].type != SNFS_FILE || entries[i].file != files[i] ||
+            entries[i].fsize != i * 50) {
+            printf("Wrong attributes for %s\n", entries[i].name);
+            return 1;
+        }
+    }
+    printf("Readdirplus success\n");
+
+    snfs_finish();
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_sparse_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define HOLE_END 4000
+
+int main() {
+    snfs_fhandle_t root, file;
+    snfs_statfs_t before, after;
+    unsigned fsize;
+    int nread;
+    char buf[MAX_READ_DATA], zeros[MAX_READ_DATA];
+
+    snfs_init(CLI, SRV);
+    memset(zeros, 0, sizeof(zeros));
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_create(root, "sparse", &file) != STAT_OK ||
+        snfs_statfs(file, &before) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+
+    // escrever longe do fim: so o bloco tocado e alocado
+    if (snfs_write(file, HOLE_END, 5, "sparse", &fsize) != STAT_OK ||
+        fsize != HOLE_END + 5 || snfs_statfs(file, &after) != STAT_OK) {
+        printf("Write past the end failed\n");
+        return 1;
+    }
+    printf("file size %u, blocks used %u\n", fsize, before.bfree - after.bfree);
+    if (before.bfree - after.bfree != 1) {
+        printf("The hole should not use blocks\n");
+        return 1;
+    }
+
+    // o buraco e lido como zeros
+    for (unsigned off = 0; off < HOLE_END; off += MAX_READ_DATA) {
+        unsigned count = (HOLE_END - off < MAX_READ_DATA) ? HOLE_END - off : MAX_READ_DATA;
+        if (snfs_read(file, off, count, buf, &nread) != STAT_OK ||
+            nread != count || memcmp(buf, zeros, count) != 0) {
+            printf("Hole at %u is not zero\n", off);
+            return 1;
+        }
+    }
+    if (snfs_read(file, HOLE_END, MAX_READ_DATA, buf, &nread) != STAT_OK ||
+        nread != 5 || memcmp(buf, "spars", 5) != 0) {
+        printf("Read of the data failed\n");
+        return 1;
+    }
+    printf("Sparse success\n");
+
+    snfs_finish();
+    return 0;
+}
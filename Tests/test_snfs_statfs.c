@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_statfs_client.socket"
+#define SRV "/tmp/server.socket"
+
+int main() {
+    snfs_fhandle_t root, file;
+    snfs_statfs_t before, after;
+    unsigned fsize;
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    if (snfs_statfs(root, &before) != STAT_OK) {
+        printf("Statfs failed\n");
+        return 1;
+    }
+    printf("Block size: %u\n", before.bsize);
+    printf("Blocks: %u total, %u free\n", before.blocks, before.bfree);
+    printf("Inodes: %u total, %u free\n", before.files, before.ffree);
+
+    if (snfs_create(root, "statfs.txt", &file) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+
+    if (snfs_statfs(root, &after) != STAT_OK) {
+        printf("Statfs failed\n");
+        return 1;
+    }
+
+    if (after.ffree != before.ffree - 1) {
+        printf("Free inode count not updated (%u -> %u)\n", before.ffree, after.ffree);
+        return 1;
+    }
+    printf("Statfs success: %u free inodes after create\n", after.ffree);
+
+    snfs_finish();
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_tiered_crash_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define NUM_FILES 20
+
+// 1. lancar o servidor com: ./server -image vol.img -ram 64 -mkfs
+// 2. correr: ./test_snfs_tiered_crash write
+// 3. matar o servidor sem o terminar (kill -9) e relancar com:
+//    ./server -image vol.img -ram 64
+// 4. correr: ./test_snfs_tiered_crash check
+// os ficheiros escritos antes do kill tem de continuar no volume
+
+int main(int argc, char** argv) {
+    snfs_fhandle_t root, file;
+    unsigned fsize;
+    int nread;
+    char name[MAX_FILE_NAME_SIZE], data[32], buf[32];
+
+    if (argc != 2 || (strcmp(argv[1], "write") != 0 && strcmp(argv[1], "check") != 0)) {
+        printf("usage: %s write|check\n", argv[0]);
+        return 1;
+    }
+    int check = strcmp(argv[1], "check") == 0;
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+
+    for (int i = 0; i < NUM_FILES; i++) {
+        snprintf(name, sizeof(name), "crash%d", i);
+        snprintf(data, sizeof(data), "contents %d", i);
+        if (!check) {
+            if (snfs_create(root, name, &file) != STAT_OK ||
+                snfs_write(file, 0, strlen(data), data, &fsize) != STAT_OK) {
+                printf("Create/write of %s failed\n", name);
+                return 1;
+            }
+            continue;
+        }
+
+        char path[MAX_FILE_NAME_SIZE + 1];
+        snprintf(path, sizeof(path), "/%s", name);
+        memset(buf, 0, sizeof(buf));
+        if (snfs_lookup(path, &file, &fsize) != STAT_OK ||
+            fsize != strlen(data) ||
+            snfs_read(file, 0, sizeof(buf), buf, &nread) != STAT_OK ||
+            nread != strlen(data) || strcmp(buf, data) != 0) {
+            printf("File %s lost after the crash\n", name);
+            return 1;
+        }
+    }
+    printf("Tiered crash %s success\n", check ? "check" : "write");
+
+    snfs_finish();
+    return 0;
+}
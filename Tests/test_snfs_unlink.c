@@ -0,0 +1,91 @@
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_unlink_client.socket"
+#define SRV "/tmp/server.socket"
+
+#define DATA_SIZE 2048
+
+int main() {
+    snfs_fhandle_t root, dir, file;
+    snfs_statfs_t before, after;
+    unsigned fsize;
+    int nread;
+    char data[DATA_SIZE], buf[DATA_SIZE];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_statfs(root, &before) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+    if (snfs_mkdir(root, "rmme", &dir) != STAT_OK) {
+        printf("mkdir failed\n");
+        return 1;
+    }
+
+    memset(data, 'u', sizeof(data));
+    if (snfs_create(dir, "f", &file) != STAT_OK ||
+        snfs_write(file, 0, DATA_SIZE, data, &fsize) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+
+    // truncate: os dados para la do novo tamanho desaparecem
+    if (snfs_truncate(file, 100) != STAT_OK ||
+        snfs_lookup("/rmme/f", &file, &fsize) != STAT_OK || fsize != 100 ||
+        snfs_read(file, 0, MAX_READ_DATA, buf, &nread) != STAT_OK || nread != 100) {
+        printf("Truncate failed\n");
+        return 1;
+    }
+    // aumentar o ficheiro cria um buraco lido como zeros
+    if (snfs_truncate(file, 200) != STAT_OK ||
+        snfs_read(file, 0, MAX_READ_DATA, buf, &nread) != STAT_OK || nread != 200 ||
+        memcmp(buf, data, 100) != 0 || buf[100] != 0 || buf[199] != 0) {
+        printf("Truncate past the end failed\n");
+        return 1;
+    }
+
+    // uma directoria com ficheiros nao pode ser removida
+    if (snfs_rmdir(root, "rmme") == STAT_OK) {
+        printf("Rmdir of a non-empty directory should fail\n");
+        return 1;
+    }
+    if (snfs_unlink(dir, "f") != STAT_OK ||
+        snfs_lookup("/rmme/f", &file, &fsize) == STAT_OK) {
+        printf("Unlink failed\n");
+        return 1;
+    }
+    if (snfs_rmdir(root, "rmme") != STAT_OK ||
+        snfs_lookup("/rmme", &dir, &fsize) == STAT_OK) {
+        printf("Rmdir failed\n");
+        return 1;
+    }
+
+    // os blocos sao libertados em segundo plano
+    for (int i = 0; i < 50; i++) {
+        if (snfs_statfs(root, &after) != STAT_OK) {
+            printf("statfs failed\n");
+            return 1;
+        }
+        if (after.bfree >= before.bfree) {
+            break;
+        }
+        usleep(100000);
+    }
+    printf("free blocks: %u -> %u, free inodes: %u -> %u\n",
+           before.bfree, after.bfree, before.ffree, after.ffree);
+    if (after.bfree < before.bfree || after.ffree < before.ffree) {
+        printf("Space was not reclaimed\n");
+        return 1;
+    }
+    printf("Unlink success\n");
+
+    snfs_finish();
+    return 0;
+}
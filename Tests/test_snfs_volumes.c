@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <string.h>
+#include <snfs_api.h>
+
+#define CLI "/tmp/test_volumes_client.socket"
+#define SRV "/tmp/server.socket"
+
+// o servidor tem de ser lancado com: ./server -volume vol1
+#define VOLUME "vol1"
+
+int main() {
+    snfs_fhandle_t root, vroot, file, vfile;
+    snfs_statfs_t before, vbefore, after, vafter;
+    unsigned fsize;
+    int nread;
+    char buf[16];
+
+    snfs_init(CLI, SRV);
+
+    if (snfs_lookup("/", &root, &fsize) != STAT_OK ||
+        snfs_lookup(VOLUME ":/", &vroot, &fsize) != STAT_OK) {
+        printf("Lookup root failed\n");
+        return 1;
+    }
+    if (root == vroot) {
+        printf("Both volumes have the same root handle\n");
+        return 1;
+    }
+    if (snfs_lookup("novolume:/", &file, &fsize) == STAT_OK) {
+        printf("Lookup of an unknown volume should fail\n");
+        return 1;
+    }
+
+    if (snfs_statfs(root, &before) != STAT_OK ||
+        snfs_statfs(vroot, &vbefore) != STAT_OK) {
+        printf("Statfs failed\n");
+        return 1;
+    }
+
+    // o mesmo nome nos dois volumes sao ficheiros diferentes
+    if (snfs_create(root, "samename", &file) != STAT_OK ||
+        snfs_create(vroot, "samename", &vfile) != STAT_OK) {
+        printf("Create failed\n");
+        return 1;
+    }
+    if (snfs_write(file, 0, 7, "default", &fsize) != STAT_OK ||
+        snfs_write(vfile, 0, 4, VOLUME, &fsize) != STAT_OK) {
+        printf("Write failed\n");
+        return 1;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    if (snfs_lookup(VOLUME ":/samename", &vfile, &fsize) != STAT_OK ||
+        fsize != 4 || snfs_read(vfile, 0, sizeof(buf), buf, &nread) != STAT_OK ||
+        nread != 4 || strcmp(buf, VOLUME) != 0) {
+        printf("Wrong contents in volume " VOLUME "\n");
+        return 1;
+    }
+    memset(buf, 0, sizeof(buf));
+    if (snfs_lookup("/samename", &file, &fsize) != STAT_OK ||
+        fsize != 7 || snfs_read(file, 0, sizeof(buf), buf, &nread) != STAT_OK ||
+        nread != 7 || strcmp(buf, "default") != 0) {
+        printf("Wrong contents in the default volume\n");
+        return 1;
+    }
+
+    // cada volume conta apenas os seus inodes
+    if (snfs_statfs(root, &after) != STAT_OK ||
+        snfs_statfs(vroot, &vafter) != STAT_OK ||
+        before.ffree - after.ffree != 1 || vbefore.ffree - vafter.ffree != 1) {
+        printf("Wrong per volume usage\n");
+        return 1;
+    }
+
+    // a copia entre volumes nao e suportada
+    if (snfs_copy("/samename", VOLUME ":/copied") == STAT_OK) {
+        printf("Copy across volumes should fail\n");
+        return 1;
+    }
+    printf("Volumes success\n");
+
+    snfs_finish();
+    return 0;
+}
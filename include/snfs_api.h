@@ -46,7 +46,8 @@ snfs_call_status_t snfs_ping(char* inmsg, int insize, char* outmsg,
 
 /*
  * lookup: obtains file handle of file 'name'
- * - name - pathname of the file
+ * - name - pathname of the file; "volume:/path" names a file of another
+ *   volume of the server
  * - file - the file handle [out]
  * - fsize - the file size [out]
  *   returns: status
@@ -103,24 +104,98 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
 
 
 /*
- * readdir: read the contents of directory 'dir'
+ * readdir: read a page of the contents of directory 'dir'
  * - dir - file handle of the directory to read
+ * - cookie - position where to start reading (0 for the first entry);
+ *   set to the position of the next page, or to READDIR_COOKIE_END
+ *   when the whole directory was read [in/out]
  * - cmax - maximum number of entries that can be read
  * - list - the list of directory entries [out]
  * - count - the number of entries read [out]
  *   returns: status
  */
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, 
-   snfs_dir_entry_t* list, unsigned* count);
+snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned* cookie,
+   unsigned cmax, snfs_dir_entry_t* list, unsigned* count);
+
+/*
+ * readdirplus: read a page of the contents of directory 'dir' together
+ * with the handle, type and size of each file
+ * - dir - file handle of the directory to read
+ * - cookie - position where to start reading (0 for the first entry);
+ *   set to the position of the next page, or to READDIR_COOKIE_END
+ *   when the whole directory was read [in/out]
+ * - cmax - maximum number of entries that can be read
+ * - list - the list of directory entries [out]
+ * - count - the number of entries read [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_readdirplus(snfs_fhandle_t dir, unsigned* cookie,
+   unsigned cmax, snfs_dir_entry_plus_t* list, unsigned* count);
 
 /*
  * copy: copies file 'srcfile' to a new file 
  * - srcpath - pathname of the original file
- * - tgtpath - pathname of the targer file
+ * - tgtpath - pathname of the targer file; both files must be in the
+ *   same volume
  *   returns: status
  */
 snfs_call_status_t snfs_copy(char *srcpath, char *tgtpath);
 
+/*
+ * statfs: get the capacity and usage of a remote volume
+ * - file - handle of any file or directory of the volume
+ * - stats - block size, total/free blocks and total/free inodes [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_statfs(snfs_fhandle_t file, snfs_statfs_t* stats);
+
+/*
+ * unlink: remove file 'name' from directory 'dir'
+ * - dir - file handle of the directory
+ * - name - name of the file to remove
+ *   returns: status
+ */
+snfs_call_status_t snfs_unlink(snfs_fhandle_t dir, char* name);
+
+/*
+ * rmdir: remove the empty subdirectory 'name' from directory 'dir'
+ * - dir - file handle of the directory
+ * - name - name of the subdirectory to remove
+ *   returns: status
+ */
+snfs_call_status_t snfs_rmdir(snfs_fhandle_t dir, char* name);
+
+/*
+ * truncate: change the size of file 'fhandle' to 'size' bytes; growing
+ * a file adds a hole that reads as zeros
+ * - fhandle - handle of the file
+ * - size - new size of the file
+ *   returns: status
+ */
+snfs_call_status_t snfs_truncate(snfs_fhandle_t fhandle, unsigned size);
+
+/*
+ * fallocate: reserve the blocks of 'len' bytes of file 'fhandle' starting
+ * at 'offset' before writing them; the file size does not change
+ * - fhandle - handle of the file
+ * - offset - start of the range
+ * - len - size of the range
+ *   returns: status
+ */
+snfs_call_status_t snfs_fallocate(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len);
+
+/*
+ * cache: resize the caches of a remote volume while it is in use
+ * - file - handle of any file or directory of the volume
+ * - budget - bytes that the caches may use, or 0 to only read their size
+ * - meta_pct - share of the budget for directory pages (0 to 100)
+ * - cache - the size of the caches after the call [out]
+ *   returns: status
+ */
+snfs_call_status_t snfs_cache(snfs_fhandle_t file, unsigned budget,
+   unsigned meta_pct, snfs_cache_t* cache);
+
 /*
  * snfs_finish: internal finalization of the SNFS API
  */
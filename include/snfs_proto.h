@@ -39,10 +39,28 @@
 // maximum amount of directory entries sent in one single message
 #define MAX_READDIR_ENTRIES 64
 
+// readdir cookie returned after the last entry of a directory
+#define READDIR_COOKIE_END ((unsigned)-1)
+
+// maximum amount of directory entries with attributes sent in one message
+#define MAX_READDIRPLUS_ENTRIES 48
+
 
 // file handle describing a remote directory/file
 typedef int snfs_fhandle_t;
 
+// a file handle holds the id of the volume in the upper bits and the
+// inode of the file in the lower bits; handles of the default volume
+// (id 0) are plain inode numbers
+#define SNFS_FHANDLE_VOLUME_SHIFT 16
+#define SNFS_FHANDLE(vol,inode) (((vol) << SNFS_FHANDLE_VOLUME_SHIFT) | (inode))
+#define SNFS_FHANDLE_VOLUME(fh) ((unsigned)(fh) >> SNFS_FHANDLE_VOLUME_SHIFT)
+#define SNFS_FHANDLE_INODE(fh) ((fh) & ((1 << SNFS_FHANDLE_VOLUME_SHIFT) - 1))
+
+// separates the volume name from the path ("name:/dir/file"); paths
+// without a volume name refer to the default volume
+#define SNFS_VOLUME_SEP ':'
+
 
 // file type in a directory entry
 typedef enum {SNFS_DIR = 1, SNFS_FILE = 2} snfs_dir_entry_type_t;
@@ -56,6 +74,35 @@ typedef struct {
 } snfs_dir_entry_t;
 
 
+// directory entry with the attributes of the file (readdirplus)
+typedef struct {
+   char name[MAX_FILE_NAME_SIZE];
+   int len;
+   snfs_dir_entry_type_t type;
+   snfs_fhandle_t file;
+   unsigned fsize;
+} snfs_dir_entry_plus_t;
+
+
+// capacity and usage of the file system
+typedef struct {
+   unsigned bsize;     // block size in bytes
+   unsigned blocks;    // total number of blocks
+   unsigned bfree;     // number of free blocks
+   unsigned files;     // total number of inodes
+   unsigned ffree;     // number of free inodes
+} snfs_statfs_t;
+
+
+// size of the caches of a volume
+typedef struct {
+   unsigned budget;    // bytes that the caches may use
+   unsigned meta_pct;  // share of the budget for directory pages (%)
+   unsigned blocks;    // number of cached data blocks
+   unsigned dirpages;  // number of cached directory pages
+} snfs_cache_t;
+
+
 /*
  * SNFS Message Codes
  *  - message identifier - snfs_msg_type_t
@@ -71,7 +118,14 @@ typedef enum {
    REQ_CREATE = 5,
    REQ_MKDIR = 6,
    REQ_READDIR = 7,
-   REQ_COPY = 8
+   REQ_COPY = 8,
+   REQ_STATFS = 9,
+   REQ_READDIRPLUS = 10,
+   REQ_UNLINK = 11,
+   REQ_RMDIR = 12,
+   REQ_TRUNCATE = 13,
+   REQ_FALLOCATE = 14,
+   REQ_CACHE = 15
 } snfs_msg_type_t;
 
 typedef int snfs_req_serial_num_t;
@@ -204,11 +258,13 @@ typedef struct {
 typedef struct {
    snfs_fhandle_t dir;
    unsigned cmax;
+   unsigned cookie;    // position of the first entry (0 to start)
 } snfs_msg_req_readdir_t;
 
 
 typedef struct {
    unsigned count;
+   unsigned cookie;    // position of the next entry or READDIR_COOKIE_END
    snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
 } snfs_msg_res_readdir_t;
 
@@ -231,6 +287,136 @@ typedef struct {
 } snfs_msg_res_copy_t;
 
 
+/*
+ * SNFS Statfs
+ *   - request message: snfs_msg_req_statfs_t
+ *   - response message: snfs_msg_res_statfs_t
+ */
+
+
+typedef struct {
+  snfs_fhandle_t file;    // any file of the volume
+} snfs_msg_req_statfs_t;
+
+
+typedef struct {
+  snfs_statfs_t stats;
+} snfs_msg_res_statfs_t;
+
+
+/*
+ * SNFS Readdirplus
+ *   - request message: snfs_msg_req_readdirplus_t
+ *   - response message: snfs_msg_res_readdirplus_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t dir;
+   unsigned cmax;
+   unsigned cookie;    // position of the first entry (0 to start)
+} snfs_msg_req_readdirplus_t;
+
+
+typedef struct {
+   unsigned count;
+   unsigned cookie;    // position of the next entry or READDIR_COOKIE_END
+   snfs_dir_entry_plus_t list[MAX_READDIRPLUS_ENTRIES];
+} snfs_msg_res_readdirplus_t;
+
+
+/*
+ * SNFS Unlink
+ *   - request message: snfs_msg_req_unlink_t
+ *   - response message: snfs_msg_res_unlink_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t dir;
+   char name[MAX_FILE_NAME_SIZE];
+} snfs_msg_req_unlink_t;
+
+
+typedef struct {
+  /* intentionally empty */
+} snfs_msg_res_unlink_t;
+
+
+/*
+ * SNFS Rmdir
+ *   - request message: snfs_msg_req_rmdir_t
+ *   - response message: snfs_msg_res_rmdir_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t dir;
+   char name[MAX_FILE_NAME_SIZE];
+} snfs_msg_req_rmdir_t;
+
+
+typedef struct {
+  /* intentionally empty */
+} snfs_msg_res_rmdir_t;
+
+
+/*
+ * SNFS Truncate
+ *   - request message: snfs_msg_req_truncate_t
+ *   - response message: snfs_msg_res_truncate_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned size;
+} snfs_msg_req_truncate_t;
+
+
+typedef struct {
+  /* intentionally empty */
+} snfs_msg_res_truncate_t;
+
+
+/*
+ * SNFS Fallocate
+ *   - request message: snfs_msg_req_fallocate_t
+ *   - response message: snfs_msg_res_fallocate_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t fhandle;
+   unsigned offset;
+   unsigned len;
+} snfs_msg_req_fallocate_t;
+
+
+typedef struct {
+  /* intentionally empty */
+} snfs_msg_res_fallocate_t;
+
+
+/*
+ * SNFS Cache
+ *   - request message: snfs_msg_req_cache_t
+ *   - response message: snfs_msg_res_cache_t
+ */
+
+
+typedef struct {
+   snfs_fhandle_t file;    // any file of the volume
+   unsigned budget;        // new size of the caches in bytes, 0 to keep it
+   unsigned meta_pct;      // share of the budget for directory pages (%)
+} snfs_msg_req_cache_t;
+
+
+typedef struct {
+  snfs_cache_t cache;
+} snfs_msg_res_cache_t;
+
+
 /*
  * SNFS Messages
  *
@@ -256,6 +442,13 @@ typedef struct {
     snfs_msg_req_mkdir_t mkdir;
     snfs_msg_req_readdir_t readdir;
     snfs_msg_req_copy_t copy;
+    snfs_msg_req_statfs_t statfs;
+    snfs_msg_req_readdirplus_t readdirplus;
+    snfs_msg_req_unlink_t unlink;
+    snfs_msg_req_rmdir_t rmdir;
+    snfs_msg_req_truncate_t truncate;
+    snfs_msg_req_fallocate_t fallocate;
+    snfs_msg_req_cache_t cache;
   } body;
 } snfs_msg_req_t;
 
@@ -272,6 +465,13 @@ typedef struct {
       snfs_msg_res_mkdir_t mkdir;
       snfs_msg_res_readdir_t readdir;
       snfs_msg_res_copy_t copy;
+      snfs_msg_res_statfs_t statfs;
+      snfs_msg_res_readdirplus_t readdirplus;
+      snfs_msg_res_unlink_t unlink;
+      snfs_msg_res_rmdir_t rmdir;
+      snfs_msg_res_truncate_t truncate;
+      snfs_msg_res_fallocate_t fallocate;
+      snfs_msg_res_cache_t cache;
    } body;
 } snfs_msg_res_t;
 
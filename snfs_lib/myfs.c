@@ -274,21 +274,39 @@ int my_listdir(char* path, char **filenames, int* numFiles)
 	
 	snfs_dir_entry_t list[MAX_READDIR_ENTRIES];
 	unsigned nFiles;
-	char* fnames;
-	
-	if (snfs_readdir(dir, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
-		printf("[my_listdir] Error reading directory in server.\n");
-		return -1;
-	}
-	
-	*numFiles = (int)nFiles;
-	
-	*filenames = fnames = (char*) malloc(sizeof(char)*((MAX_FILE_NAME_SIZE+1)*(*numFiles)));
-	for (int i = 0; i < *numFiles; i++) {
-		strcpy(fnames, list[i].name);
-		fnames += strlen(fnames)+1;
+	unsigned cookie = 0;
+	char* fnames = NULL;
+	int used = 0;
+	
+	// read the directory page by page, each request resumes where the
+	// previous one stopped
+	*numFiles = 0;
+	while (cookie != READDIR_COOKIE_END) {
+		if (snfs_readdir(dir, &cookie, MAX_READDIR_ENTRIES, list, &nFiles) != STAT_OK) {
+			printf("[my_listdir] Error reading directory in server.\n");
+			free(fnames);
+			return -1;
+		}
+		if (nFiles == 0) {
+			break;
+		}
+		
+		char* more = (char*) realloc(fnames, used + (MAX_FILE_NAME_SIZE+1)*nFiles);
+		if (more == NULL) {
+			printf("[my_listdir] Out of memory.\n");
+			free(fnames);
+			return -1;
+		}
+		fnames = more;
+		for (int i = 0; i < nFiles; i++) {
+			strncpy(&fnames[used], list[i].name, MAX_FILE_NAME_SIZE);
+			fnames[used + MAX_FILE_NAME_SIZE] = '\0';
+			used += strlen(&fnames[used])+1;
+		}
+		*numFiles += (int)nFiles;
 	}
 	
+	*filenames = fnames;
 	return 0;
 }
 
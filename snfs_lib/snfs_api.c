@@ -312,8 +312,8 @@ snfs_call_status_t snfs_mkdir(snfs_fhandle_t dir, char* name,
 }
 
 
-snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax, 
-   snfs_dir_entry_t* list, unsigned* count)
+snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned* cookie,
+   unsigned cmax, snfs_dir_entry_t* list, unsigned* count)
 {
 	snfs_msg_req_t req;
 	snfs_msg_res_t res;
@@ -325,6 +325,7 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax,
 	req.type = REQ_READDIR;
 	req.body.readdir.dir = dir;
 	req.body.readdir.cmax = cmax;
+	req.body.readdir.cookie = *cookie;
 	
 	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.readdir), 
 				  &res, sizeof(res), 0);
@@ -335,10 +336,40 @@ snfs_call_status_t snfs_readdir(snfs_fhandle_t dir, unsigned cmax,
 	}
 	
 	*count = res.body.readdir.count;
+	*cookie = res.body.readdir.cookie;
 	memcpy(list, res.body.readdir.list, sizeof(snfs_dir_entry_t)*(*count));
 	return STAT_OK;
 }
 
+snfs_call_status_t snfs_readdirplus(snfs_fhandle_t dir, unsigned* cookie,
+   unsigned cmax, snfs_dir_entry_plus_t* list, unsigned* count)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_READDIRPLUS;
+	req.body.readdirplus.dir = dir;
+	req.body.readdirplus.cmax = cmax;
+	req.body.readdirplus.cookie = *cookie;
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.readdirplus), 
+				  &res, sizeof(res), 0);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	*count = res.body.readdirplus.count;
+	*cookie = res.body.readdirplus.cookie;
+	memcpy(list, res.body.readdirplus.list, sizeof(snfs_dir_entry_plus_t)*(*count));
+	return STAT_OK;
+}
+
 snfs_call_status_t snfs_copy(char *srcpath, char *tgtpath)
 {
 
@@ -364,6 +395,156 @@ snfs_call_status_t snfs_copy(char *srcpath, char *tgtpath)
 	return STAT_OK;
 }
 
+snfs_call_status_t snfs_statfs(snfs_fhandle_t file, snfs_statfs_t* stats)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_STATFS;
+	req.body.statfs.file = file;
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.statfs), 
+				  &res, sizeof(res), 0);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	*stats = res.body.statfs.stats;
+	return STAT_OK;
+}
+
+snfs_call_status_t snfs_unlink(snfs_fhandle_t dir, char* name)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_UNLINK;
+	req.body.unlink.dir = dir;
+	strncpy(req.body.unlink.name, name, MAX_FILE_NAME_SIZE - 1);
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.unlink), 
+				  &res, sizeof(res), 1);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	return STAT_OK;
+}
+
+snfs_call_status_t snfs_rmdir(snfs_fhandle_t dir, char* name)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_RMDIR;
+	req.body.rmdir.dir = dir;
+	strncpy(req.body.rmdir.name, name, MAX_FILE_NAME_SIZE - 1);
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.rmdir), 
+				  &res, sizeof(res), 1);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	return STAT_OK;
+}
+
+snfs_call_status_t snfs_truncate(snfs_fhandle_t fhandle, unsigned size)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_TRUNCATE;
+	req.body.truncate.fhandle = fhandle;
+	req.body.truncate.size = size;
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.truncate), 
+				  &res, sizeof(res), 1);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	return STAT_OK;
+}
+
+snfs_call_status_t snfs_fallocate(snfs_fhandle_t fhandle, unsigned offset,
+   unsigned len)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_FALLOCATE;
+	req.body.fallocate.fhandle = fhandle;
+	req.body.fallocate.offset = offset;
+	req.body.fallocate.len = len;
+	
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.fallocate), 
+				  &res, sizeof(res), 1);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	return STAT_OK;
+}
+
+snfs_call_status_t snfs_cache(snfs_fhandle_t file, unsigned budget,
+   unsigned meta_pct, snfs_cache_t* cache)
+{
+	snfs_msg_req_t req;
+	snfs_msg_res_t res;
+	
+	memset(&req,0,sizeof(req));
+	memset(&res,0,sizeof(res));
+	
+	// format request
+	req.type = REQ_CACHE;
+	req.body.cache.file = file;
+	req.body.cache.budget = budget;
+	req.body.cache.meta_pct = meta_pct;
+	
+	// only a resize has to reach every server
+	int status = remote_call(&req, sizeof(req.sn) + sizeof(req.type) + sizeof(req.body.cache), 
+				  &res, sizeof(res), budget != 0);
+
+	// format response
+	if (status < 0 || res.status != RES_OK) {
+		return STAT_ERROR;
+	}
+	
+	*cache = res.body.cache.cache;
+	return STAT_OK;
+}
+
 void snfs_finish()
 {
    close(Cli_sock);
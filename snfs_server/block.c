@@ -4,10 +4,15 @@
  * block.c
  *
  * Storage layer which offers the abstraction of a sequence of 
- * blocks of fixed size. Blocks are kept in memory.
+ * blocks of fixed size. Blocks are kept in memory or, for images
+ * opened with block_open, read and written directly in the image file.
+ * Images opened with block_open_tiered keep their most used blocks in
+ * a RAM tier in front of the file.
  * 
  */
 
+#define _XOPEN_SOURCE 600  // for pread/pwrite/fsync with -std=c99
+
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,6 +20,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "block.h"
 
@@ -30,10 +36,60 @@ void io_delay_write_block();
 #endif
 
 
+// image file header (the same used by block_load/block_store)
+#define BLOCK_HDR_SIZE (2 * sizeof(unsigned))
+
+
+/*
+ * RAM tier (block_open_tiered)
+ * - every block has an access count: the blocks in memory in 'count',
+ *   the blocks in the file in 'uses'; all the counts are halved every
+ *   'num_blocks' accesses, so that they follow the recent accesses
+ * - when a block of the file is used, the least used of
+ *   BLOCK_TIER_SAMPLE blocks in memory (taken in turn) is the candidate
+ *   for demotion; the block is promoted only if it was used more often
+ *   than the candidate, so blocks used only once (e.g. a sequential
+ *   scan) do not push the hot blocks out
+ * - the tier is write-through: every write goes to the file before the
+ *   copy in memory is updated, so the slots are never newer than the
+ *   file; the file is as up to date as without the tier (the order of
+ *   the writes, e.g. the journal before the blocks it describes, is
+ *   kept) and nothing is lost if the process is killed
+ * - the tier mutex only covers the counts, the slots and the copies to and
+ *   from memory; the file is read and written without it, holding the
+ *   lock of the block (one of BLOCK_TIER_LOCKS, by block number) until
+ *   the slot is updated, so that a block is never promoted with contents
+ *   older than a write that is going on
+ */
+
+#define BLOCK_TIER_SAMPLE 8
+
+#define BLOCK_TIER_LOCKS 64
+
+#define BLOCK_TIER_MAX_COUNT 255
+
+typedef struct {
+   unsigned num_slots;      // blocks that fit in memory
+   unsigned used;           // slots in use
+   unsigned hand;           // first slot of the next sample
+   unsigned accesses;       // accesses since the counts were last halved
+   int* slot_of;            // slot of each block, -1 if it is in the file
+   unsigned char* uses;     // access count of each block of the file
+   unsigned* block_of;      // block kept in each slot
+   unsigned char* count;    // access count of each slot
+   char* data;              // contents of the slots
+   pthread_mutex_t mutex;
+   pthread_mutex_t lock[BLOCK_TIER_LOCKS]; // file I/O of the blocks
+   block_tier_info_t info;
+} block_tier_t;
+
+
 // internal implementation of 'blocks_t' 
 struct blocks_ {
    unsigned block_size;
    unsigned num_blocks;
+   int fd;              // image file, -1 if the blocks are in memory
+   block_tier_t* tier;  // RAM tier in front of the file, or NULL
    char blocks[0];
 };
 
@@ -47,13 +103,295 @@ blocks_t* block_new(unsigned num_blocks, unsigned block_sz)
       malloc(sizeof(blocks_t) + num_blocks * block_sz);
    bks->block_size = block_sz;
    bks->num_blocks = num_blocks;
+   bks->fd = -1;
+   bks->tier = NULL;
    memset(&bks->blocks[0], 0, num_blocks * block_sz);
    return bks;
 }
 
 
+blocks_t* block_open(char* file, unsigned num_blocks, unsigned block_sz)
+{
+   if (file == NULL) {
+      return NULL;
+   }
+
+   int fd = open(file, O_RDWR);
+   unsigned hdr[2];
+   if (fd >= 0) {
+      // existing image: the geometry comes from its header
+      if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+          hdr[0] * hdr[1] == 0) {
+         close(fd);
+         return NULL;
+      }
+   } else {
+      if (num_blocks * block_sz == 0) {
+         return NULL;
+      }
+      fd = open(file, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+      if (fd < 0) {
+         return NULL;
+      }
+      // new image: write the header and extend the file (without
+      // writing the blocks, which read as zeros)
+      hdr[0] = block_sz;
+      hdr[1] = num_blocks;
+      if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+          ftruncate(fd, BLOCK_HDR_SIZE + (off_t)num_blocks * block_sz) < 0) {
+         close(fd);
+         unlink(file);
+         return NULL;
+      }
+   }
+
+   blocks_t* bks = (blocks_t*)malloc(sizeof(blocks_t));
+   if (bks == NULL) {
+      close(fd);
+      return NULL;
+   }
+   bks->block_size = hdr[0];
+   bks->num_blocks = hdr[1];
+   bks->fd = fd;
+   bks->tier = NULL;
+   return bks;
+}
+
+
+static void block_tier_free(block_tier_t* tier)
+{
+   free(tier->slot_of);
+   free(tier->uses);
+   free(tier->block_of);
+   free(tier->count);
+   free(tier->data);
+   pthread_mutex_destroy(&tier->mutex);
+   for (int i = 0; i < BLOCK_TIER_LOCKS; i++) {
+      pthread_mutex_destroy(&tier->lock[i]);
+   }
+   free(tier);
+}
+
+
+blocks_t* block_open_tiered(char* file, unsigned num_blocks, unsigned block_sz,
+   unsigned ram_blocks)
+{
+   if (ram_blocks == 0) {
+      return NULL;
+   }
+   blocks_t* bks = block_open(file, num_blocks, block_sz);
+   if (bks == NULL) {
+      return NULL;
+   }
+   if (ram_blocks > bks->num_blocks) {
+      ram_blocks = bks->num_blocks;
+   }
+
+   block_tier_t* tier = (block_tier_t*)calloc(1, sizeof(block_tier_t));
+   if (tier == NULL) {
+      block_free(bks);
+      return NULL;
+   }
+   pthread_mutex_init(&tier->mutex, NULL);
+   for (int i = 0; i < BLOCK_TIER_LOCKS; i++) {
+      pthread_mutex_init(&tier->lock[i], NULL);
+   }
+   tier->num_slots = ram_blocks;
+   tier->slot_of = (int*)malloc(bks->num_blocks * sizeof(int));
+   tier->uses = (unsigned char*)calloc(bks->num_blocks, 1);
+   tier->block_of = (unsigned*)malloc(ram_blocks * sizeof(unsigned));
+   tier->count = (unsigned char*)calloc(ram_blocks, 1);
+   tier->data = (char*)malloc((size_t)ram_blocks * bks->block_size);
+   if (!tier->slot_of || !tier->uses || !tier->block_of || !tier->count ||
+       !tier->data) {
+      block_tier_free(tier);
+      block_free(bks);
+      return NULL;
+   }
+   for (unsigned i = 0; i < bks->num_blocks; i++) {
+      tier->slot_of[i] = -1;
+   }
+   tier->info.ram_blocks = ram_blocks;
+   bks->tier = tier;
+   return bks;
+}
+
+
+static int block_file_read(blocks_t* bks, unsigned block_no, char* block)
+{
+#ifdef SIMULATE_IO_DELAY
+ #ifdef NOT_FS_INITIALIZER   
+   io_delay_read_block();
+ #endif  
+#endif
+   off_t pos = BLOCK_HDR_SIZE + (off_t)block_no * bks->block_size;
+   return (pread(bks->fd, block, bks->block_size, pos) == bks->block_size) ? 0 : -1;
+}
+
+
+static int block_file_write(blocks_t* bks, unsigned block_no, char* block)
+{
+#ifdef SIMULATE_IO_DELAY
+ #ifdef NOT_FS_INITIALIZER
+   io_delay_write_block();
+ #endif  
+#endif
+   off_t pos = BLOCK_HDR_SIZE + (off_t)block_no * bks->block_size;
+   return (pwrite(bks->fd, block, bks->block_size, pos) == bks->block_size) ? 0 : -1;
+}
+
+
+// halves the access counts of all the blocks (called with the tier mutex)
+static void block_tier_age(blocks_t* bks)
+{
+   block_tier_t* tier = bks->tier;
+   for (unsigned i = 0; i < bks->num_blocks; i++) {
+      tier->uses[i] /= 2;
+   }
+   for (unsigned slot = 0; slot < tier->used; slot++) {
+      tier->count[slot] /= 2;
+   }
+   tier->accesses = 0;
+}
+
+
+// least used slot of the next sample (called with the tier mutex and
+// with the tier full)
+static unsigned block_tier_candidate(block_tier_t* tier)
+{
+   unsigned best = tier->hand;
+   for (unsigned i = 1; i < BLOCK_TIER_SAMPLE && i < tier->num_slots; i++) {
+      unsigned slot = (tier->hand + i) % tier->num_slots;
+      if (tier->count[slot] < tier->count[best]) {
+         best = slot;
+      }
+   }
+   tier->hand = (tier->hand + BLOCK_TIER_SAMPLE) % tier->num_slots;
+   return best;
+}
+
+
+// frees the slot (called with the tier mutex); the file already has the
+// contents of the block
+static void block_tier_demote(blocks_t* bks, unsigned slot)
+{
+   block_tier_t* tier = bks->tier;
+   unsigned old = tier->block_of[slot];
+   tier->slot_of[old] = -1;
+   tier->uses[old] = tier->count[slot];
+   tier->info.demotions++;
+}
+
+
+// reads or writes a block of a tiered instance; writes always go to the
+// file. The file is accessed with only the lock of the block held; the
+// tier mutex is taken before (read hits) and after it (slot update)
+static int block_tier_access(blocks_t* bks, unsigned block_no, char* block,
+   int write)
+{
+   block_tier_t* tier = bks->tier;
+   unsigned size = bks->block_size;
+   int slot;
+
+   // 1. A read of a block in memory needs no I/O
+   pthread_mutex_lock(&tier->mutex);
+   if (++tier->accesses >= bks->num_blocks) {
+      block_tier_age(bks);
+   }
+   if (!write && (slot = tier->slot_of[block_no]) >= 0) {
+      tier->info.hits++;
+      if (tier->count[slot] < BLOCK_TIER_MAX_COUNT) {
+         tier->count[slot]++;
+      }
+      memcpy(block, &tier->data[slot * size], size);
+      pthread_mutex_unlock(&tier->mutex);
+      return 0;
+   }
+   pthread_mutex_unlock(&tier->mutex);
+
+   // 2. File I/O with the lock of the block (other blocks go on in
+   //    parallel); a read brings the block into the caller's buffer
+   pthread_mutex_t* lock = &tier->lock[block_no % BLOCK_TIER_LOCKS];
+   pthread_mutex_lock(lock);
+   int res = write ? block_file_write(bks, block_no, block) :
+                     block_file_read(bks, block_no, block);
+   if (res < 0) {
+      pthread_mutex_unlock(lock);
+      return -1;
+   }
+
+   // 3. Update the copy in memory, or promote the block if there is room
+   //    or if it is used more often than the candidate for demotion
+   pthread_mutex_lock(&tier->mutex);
+   slot = tier->slot_of[block_no];
+   if (slot >= 0) {
+      tier->info.hits++;
+      if (tier->count[slot] < BLOCK_TIER_MAX_COUNT) {
+         tier->count[slot]++;
+      }
+      memcpy(&tier->data[slot * size], block, size);
+   } else {
+      tier->info.misses++;
+      if (tier->uses[block_no] < BLOCK_TIER_MAX_COUNT) {
+         tier->uses[block_no]++;
+      }
+      int promote = (tier->used < tier->num_slots);
+      if (promote) {
+         slot = tier->used;
+      } else {
+         slot = block_tier_candidate(tier);
+         promote = (tier->uses[block_no] > tier->count[slot]);
+      }
+      if (promote) {
+         if (slot < tier->used) {
+            block_tier_demote(bks, slot);
+         } else {
+            tier->used++;
+         }
+         memcpy(&tier->data[slot * size], block, size);
+         tier->slot_of[block_no] = slot;
+         tier->block_of[slot] = block_no;
+         tier->count[slot] = tier->uses[block_no];
+         tier->info.promotions++;
+         tier->info.resident = tier->used;
+      }
+   }
+   pthread_mutex_unlock(&tier->mutex);
+   pthread_mutex_unlock(lock);
+   return 0;
+}
+
+
+int block_tier_info(blocks_t* bks, block_tier_info_t* info)
+{
+   if (bks == NULL || bks->tier == NULL || info == NULL) {
+      return -1;
+   }
+   pthread_mutex_lock(&bks->tier->mutex);
+   *info = bks->tier->info;
+   pthread_mutex_unlock(&bks->tier->mutex);
+   return 0;
+}
+
+
+int block_sync(blocks_t* bks)
+{
+   if (bks->fd < 0) {
+      return 0;
+   }
+   // the RAM tier is write-through: the file has all the blocks
+   return fsync(bks->fd);
+}
+
+
 void block_free(blocks_t* bks)
 {
+   if (bks->tier != NULL) {
+      block_tier_free(bks->tier);
+   }
+   if (bks->fd >= 0) {
+      close(bks->fd);
+   }
    free(bks);
 }
 
@@ -76,6 +414,13 @@ int block_read(blocks_t* bks, unsigned block_no, char* block)
 	  return -1;
    }
 
+   if (bks->tier != NULL) {
+      return block_tier_access(bks, block_no, block, 0);
+   }
+   if (bks->fd >= 0) {
+      return block_file_read(bks, block_no, block);
+   }
+
 #ifdef SIMULATE_IO_DELAY
  #ifdef NOT_FS_INITIALIZER   
    io_delay_read_block();
@@ -93,12 +438,18 @@ int block_write(blocks_t* bks, unsigned block_no, char* block)
 	  return -1;
    }
 
+   if (bks->tier != NULL) {
+      return block_tier_access(bks, block_no, block, 1);
+   }
+   if (bks->fd >= 0) {
+      return block_file_write(bks, block_no, block);
+   }
+
 #ifdef SIMULATE_IO_DELAY
  #ifdef NOT_FS_INITIALIZER
    io_delay_write_block();
  #endif  
 #endif
-
    char* ptr = &bks->blocks[block_no * bks->block_size]; 
    memcpy(ptr,block,bks->block_size);
    return 0;
@@ -142,13 +493,16 @@ blocks_t* block_load(char* file)
    }
    bks->block_size = block_size;
    bks->num_blocks = num_blocks;
+   bks->fd = -1;
+   bks->tier = NULL;
+   close(fd);
    return bks;
 }
 
 
 int block_store(blocks_t* bks, char* file)
 {
-   if (bks == NULL && file == NULL) {
+   if (bks == NULL || file == NULL || bks->fd >= 0) {
       return -1;
    }
 
@@ -157,10 +511,11 @@ int block_store(blocks_t* bks, char* file)
       return -1;
    }
 
-   unsigned size = sizeof(blocks_t) + bks->block_size * bks->num_blocks;
+   unsigned hdr[2] = {bks->block_size, bks->num_blocks};
+   unsigned size = bks->block_size * bks->num_blocks;
 
-   int status = write(fd, (char*)bks, size);
-   if (status != size) {
+   if (write(fd, hdr, BLOCK_HDR_SIZE) != BLOCK_HDR_SIZE ||
+       write(fd, bks->blocks, size) != size) {
       close(fd);
       return -1;
    }
@@ -175,4 +530,11 @@ void block_dump(blocks_t* bks)
    printf("Blocks:\n");
    printf("- Block size: %u\n", bks->block_size);
    printf("- Num blocks: %u\n", bks->num_blocks);
+
+   block_tier_info_t info;
+   if (block_tier_info(bks, &info) == 0) {
+      printf("- RAM tier: %u of %u blocks, %u hits, %u misses, %u promoted, "
+         "%u demoted\n", info.resident, info.ram_blocks, info.hits, info.misses,
+         info.promotions, info.demotions);
+   }
 }
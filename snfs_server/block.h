@@ -28,6 +28,62 @@ typedef struct blocks_ blocks_t;
 blocks_t* block_new(unsigned block_sz, unsigned num_blocks);
 
 
+/*
+ * block_open: open an image file of blocks; the blocks are read and
+ * written in the file on demand instead of being kept in memory
+ * - file: the name of the file
+ * - num_blocks: number of blocks, if the file has to be created
+ * - block_sz: the size of blocks, if the file has to be created
+ *   returns: the blocks instance (with the geometry stored in the
+ *   image if the file already exists) or NULL if error
+ */
+blocks_t* block_open(char* file, unsigned num_blocks, unsigned block_sz);
+
+
+/*
+ * block_open_tiered: open an image file of blocks with a RAM tier; the
+ * most frequently used blocks are kept in memory (up to 'ram_blocks' of
+ * them) and the others are read and written in the file; a block of the
+ * file is promoted to memory when it is used again, and the least used
+ * block in memory is demoted to make room for it
+ * - file: the name of the file
+ * - num_blocks: number of blocks, if the file has to be created
+ * - block_sz: the size of blocks, if the file has to be created
+ * - ram_blocks: number of blocks of the RAM tier
+ *   returns: the blocks instance or NULL if error
+ */
+blocks_t* block_open_tiered(char* file, unsigned num_blocks, unsigned block_sz,
+   unsigned ram_blocks);
+
+
+// usage of the RAM tier of a tiered blocks instance
+typedef struct {
+   unsigned ram_blocks;    // size of the RAM tier in blocks
+   unsigned resident;      // blocks kept in the RAM tier
+   unsigned hits;          // accesses served by the RAM tier
+   unsigned misses;        // accesses served by the file
+   unsigned promotions;    // blocks moved from the file to the RAM tier
+   unsigned demotions;     // blocks dropped from the RAM tier
+} block_tier_info_t;
+
+
+/*
+ * block_tier_info: get the usage of the RAM tier
+ * - bks - the blocks instance
+ * - info - the usage of the RAM tier [out]
+ *   returns: 0 if sucessful, -1 if the blocks have no RAM tier
+ */
+int block_tier_info(blocks_t* bks, block_tier_info_t* info);
+
+
+/*
+ * block_sync: force the blocks written so far to stable storage
+ * - bks - the blocks instance
+ *   returns: 0 if sucessful, -1 if not
+ */
+int block_sync(blocks_t* bks);
+
+
 /*
  * block_free: free the blocks
  * - bks - the blocks to free
@@ -76,7 +132,7 @@ blocks_t* block_load(char* file);
 
 
 /*
- * block_store: store an image of blocks to a file
+ * block_store: store an image of blocks kept in memory to a file
  * - bks - the blocks instance
  * - file: the name of the file
  *   returns: 0 if sucessful, -1 if not
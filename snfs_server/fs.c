@@ -10,21 +10,38 @@
  */
 
 
+ #define _XOPEN_SOURCE 600  // Para pthread_rwlock_* com -std=c99
+ 
  #include <string.h>
  #include <stdlib.h>
  #include <stdio.h>
  #include <unistd.h>
+ #include <stddef.h>
  #include "fs.h"
+ #include "journal.h"
  #include <time.h>          // Para time_t
  #include <pthread.h>       // Para pthread_mutex_*
  #include <string.h>        // Para memcpy, memset
  #include <stdlib.h>        // Para malloc, free
+ #if defined(__AVX2__)
+ #include <immintrin.h>     // Para _mm256_* (procura nas páginas de directório)
+ #elif defined(__SSE2__)
+ #include <emmintrin.h>     // Para _mm_* (procura nas páginas de directório)
+ #endif
  
  /* Novas directivas */
  #define BLOCK_CACHE_SIZE 10
- #define INODE_CACHE_SIZE 4
  #define DIR_CACHE_SIZE 4
-
+ 
+ // default cache budget: BLOCK_CACHE_SIZE data blocks and DIR_CACHE_SIZE
+ // directory pages, FS_CACHE_META_PCT % of it for the directory pages
+ #define FS_CACHE_BUDGET (BLOCK_CACHE_SIZE * sizeof(block_cache_entry_t) + \
+                          DIR_CACHE_SIZE * sizeof(dir_cache_entry_t))
+ #define FS_CACHE_META_PCT 30
+ 
+ // smallest budget: one entry in each cache
+ #define FS_CACHE_MIN_BUDGET (sizeof(block_cache_entry_t) + sizeof(dir_cache_entry_t))
+ 
  #define FS_UNKNOWN -1
  
  
@@ -36,27 +53,35 @@
  
  #define EXT_INODE_NUM_BLKS (BLOCK_SIZE / sizeof(unsigned int))
  
+ #define FS_INLINE_SIZE 192
+ 
  typedef struct fs_inode {
      fs_itype_t type;
      unsigned int size;
      unsigned int blocks[INODE_NUM_BLKS];
      unsigned int reserved[4]; // reserved[0] -> extending table block number
+                               // reserved[1] -> inode flags (FS_IFLAG_*)
+                               // reserved[2] -> allocation group + 1 (0: none)
+                              // reserved[3] -> free slots of a directory
+     char idata[FS_INLINE_SIZE]; // file data of small files (FS_IFLAG_INLINE)
   } fs_inode_t;
  
+ // the file data is kept in 'idata' instead of data blocks
+ #define FS_IFLAG_INLINE 0x1
+ 
+ #define FS_INODE_IS_INLINE(inode) ((inode)->reserved[1] & FS_IFLAG_INLINE)
+ 
+ // size of the inode without the inline data
+ #define FS_INODE_HDR_SIZE offsetof(fs_inode_t, idata)
+ 
  typedef struct {
      unsigned int block_num;
      char data[BLOCK_SIZE];
      int dirty;
+     unsigned int valid_from; // os bytes antes deste ainda não foram lidos do disco
      time_t last_access;
  } block_cache_entry_t;
  
- typedef struct {
-     inodeid_t inode_num;
-     fs_inode_t inode;
-     int dirty;
-     time_t last_access;
- } inode_cache_entry_t;
- 
  #define DIR_PAGE_ENTRIES (BLOCK_SIZE / sizeof(fs_dentry_t))
  
  typedef struct dentry {
@@ -73,8 +98,10 @@
  
  /*
   * Inode
-  * - inode size = 64 bytes
+  * - inode size = 256 bytes
   * - num of direct block refs = 10 blocks
+  * - files up to 192 bytes are stored inline in the inode, without data
+  *   blocks; they move to data blocks when they grow larger
   */
  
  typedef unsigned int fs_inode_ext_t;
@@ -89,34 +116,255 @@
  
  /*
   * File syste structure
-  * - inode table size = 64 entries (8 blocks)
+  * - inode table size = 64 entries (32 blocks)
   * 
-  * Internal organization 
-  *   - block 0        - free block bitmap
-  *   - block 1        - free inode bitmap
-  *   - block 2-9      - inode table (8 blocks)
-  *   - block 10-(N-1) - data blocks, where N is the number of blocks
+  * Internal organization (N is the number of blocks)
+  *   - 1 block        - superblock (identifies the volume and its layout)
+  *   - B blocks       - free block bitmap (1 bit per block, B = 4 for 16K blocks)
+  *   - 1 block        - free inode bitmap
+  *   - 32 blocks      - inode table
+  *   - 64 blocks      - metadata journal (header + 63 log blocks)
+  *   - R blocks       - block reference counts (1 byte per block, R = N/512)
+  *   - remaining      - data blocks
+  *
+  * The data blocks are divided in allocation groups of FS_AG_BLOCKS blocks
+  * (the blocks described by one bitmap block); the number of free blocks
+  * of each group is kept in memory so that allocation skips full groups
+  * and fails at once when the volume is full.
+  *
+  * Blocks are placed near the blocks they are read with (as the block
+  * groups of ext2): new directories are spread over the groups with at
+  * least the average number of free blocks, files get the group of their
+  * directory, and each block of a file is allocated after the previous
+  * block of the same file. Blocks with no such goal are searched from
+  * the own group of each thread, so concurrent writers claim bits of
+  * different bitmap blocks.
+  *
+  * Mounting an existing volume only reads the superblock and the bitmaps;
+  * each block of the inode table and of the reference counts is read
+  * the first time one of its entries is used.
   */
  
- #define ITAB_NUM_BLKS 8
+ #define ITAB_NUM_BLKS 32
  
  #define ITAB_SIZE (ITAB_NUM_BLKS*BLOCK_SIZE / sizeof(fs_inode_t))
  
+ #define JRNL_NUM_BLKS 64
+ 
+ #define FS_AG_BLOCKS (BLOCK_SIZE * 8)
+ 
+ #define FS_MAGIC 0x53464e53     // "SNFS"
+ 
+ #define FS_VERSION 1
+ 
+ #define SUPER_BLK 0
+ 
+ #define BMAP_START 1
+ 
+ typedef struct {
+     unsigned int magic;
+     unsigned int version;
+     unsigned int block_size;
+     unsigned int num_blocks;
+     unsigned int itab_num_blks;
+     unsigned int jrnl_num_blks;
+     unsigned int data_start;
+ } fs_super_t;
+ 
+ // maximum number of extra owners of a shared block
+ #define REFC_MAX 255
+ 
  struct fs_ {
      /* Componentes originais (sem duplicação) */
      blocks_t* blocks;               // Ponteiro para os blocos do dispositivo
      char inode_bmap[BLOCK_SIZE];    // Bitmap de inodes livres
-     char blk_bmap[BLOCK_SIZE];      // Bitmap de blocos livres
+     char* blk_bmap;                 // Bitmap de blocos livres (bmap_num_blks blocos)
      fs_inode_t inode_tab[ITAB_SIZE]; // Tabela de inodes
+ 
+     /* Atributos quentes dos inodes em vectores densos (cópia dos campos
+        de inode_tab, actualizada dentro do seqlock): percorrer os tipos e
+        tamanhos de muitos inodes não traz os inodes inteiros para a cache
+        do processador */
+     unsigned char inode_type[ITAB_SIZE];  // Tipo (fs_itype_t)
+     unsigned char inode_flags[ITAB_SIZE]; // Flags (FS_IFLAG_*)
+     unsigned int inode_size[ITAB_SIZE];   // Tamanho
+ 
+     /* Organização do volume (depende do número de blocos) */
+     unsigned int bmap_num_blks;     // Blocos ocupados pelo bitmap de blocos
+     unsigned int ibmap_start;       // Bloco do bitmap de inodes
+     unsigned int itab_start;        // Primeiro bloco da tabela de inodes
+     unsigned int jrnl_start;        // Primeiro bloco do journal
+     unsigned int refc_start;        // Primeiro bloco da tabela de referências
+     unsigned int data_start;        // Primeiro bloco de dados
+ 
+     /* Contadores de espaço livre (alterados com operações atómicas) */
+     unsigned int ag_count;          // Número de grupos de alocação
+     volatile unsigned int* ag_free; // Blocos livres de cada grupo
+     unsigned int ag_dir_next;       // Onde começa a escolha do grupo de um directório
+     volatile unsigned int free_blocks; // Total de blocos livres
+     volatile unsigned int free_inodes; // Total de inodes livres
   
      /* Novos campos para o sistema de cache */
-     block_cache_entry_t block_cache[BLOCK_CACHE_SIZE];  // Cache de blocos
-     inode_cache_entry_t inode_cache[INODE_CACHE_SIZE];  // Cache de inodes
-     dir_cache_entry_t dir_cache[DIR_CACHE_SIZE];        // Cache de diretórios
-     pthread_mutex_t cache_mutex;    // Mutex para sincronização
+     block_cache_entry_t* block_cache; // Cache de blocos (dados)
+     unsigned int block_cache_len;   // Entradas da cache de blocos
+     dir_cache_entry_t* dir_cache;   // Cache de diretórios (metadados)
+     unsigned int dir_cache_len;     // Entradas da cache de diretórios
+     unsigned int cache_budget;      // Bytes que as duas caches podem usar
+     unsigned int cache_meta_pct;    // Parte do orçamento para os diretórios (%)
+     pthread_mutex_t cache_mutex;    // Mutex das caches de blocos e diretórios
+     unsigned int cache_wb_seq;      // Número de entradas dirty já escritas no disco
+ 
+     pthread_rwlock_t inode_lock[ITAB_SIZE]; // Trinco leitores/escritor de cada inode
+     volatile unsigned int inode_seq[ITAB_SIZE]; // Contador de sequência dos atributos
+     pthread_mutex_t alloc_mutex;    // Mutex das referências dos blocos e do checkpoint
+ 
+     journal_t* journal;             // Journal dos metadados
+ 
+     unsigned char* blk_refs;        // Donos adicionais de cada bloco (copy-on-write)
+     unsigned int refc_num_blks;     // Blocos ocupados pela tabela de referências
+ 
+     /* Cópia dos metadados das transacções já duráveis no journal (só
+        alterada por fsi_tx_durable, com o papel de escritor do journal):
+        é a que o checkpoint escreve, nunca o estado de uma transacção a
+        meio */
+     char ckpt_inode_bmap[BLOCK_SIZE]; // Bitmap de inodes
+     char* ckpt_blk_bmap;            // Bitmap de blocos
+     fs_inode_t ckpt_inode_tab[ITAB_SIZE]; // Tabela de inodes
+     unsigned char* ckpt_blk_refs;   // Referências dos blocos
+ 
+     /* Deduplicação dos blocos de dados (protegida por alloc_mutex) */
+     unsigned int* dedup_tab;        // Índice: hash do conteúdo -> bloco, ou NULL
+     unsigned int* dedup_hash;       // Hash de cada bloco indexado (0 se não está)
+     unsigned int dedup_mask;        // Número de entradas do índice - 1
+ 
+     /* Libertação adiada de blocos (unlink, rmdir, truncate) */
+     unsigned int* reclaim_q;        // Blocos à espera de serem libertados
+     unsigned int reclaim_len;       // Número de blocos na fila
+     unsigned int reclaim_cap;       // Capacidade da fila
+     pthread_mutex_t reclaim_mutex;  // Mutex da fila
+     pthread_cond_t reclaim_cond;    // Acorda o reclaimer
+     pthread_t reclaimer;            // Fio que liberta os blocos em lotes
+ 
+     /* Carregamento a pedido dos metadados (volumes montados) */
+     volatile unsigned char itab_loaded[ITAB_NUM_BLKS]; // Blocos da tabela de inodes já lidos
+     volatile unsigned char* refc_loaded; // Blocos da tabela de referências já lidos
+     pthread_mutex_t load_mutex;     // Serializa as leituras a pedido
+ 
+     /* Lista de aquecimento das caches (fs_warmup_start) */
+     char* warm_path;                // Ficheiro da lista, ou NULL
+     unsigned int warm_period;       // Segundos entre gravações da lista
+     pthread_t warmer;               // Fio que pré-carrega e guarda a lista
+     pthread_mutex_t warm_mutex;     // Serializa as gravações da lista
+ 
+     /* Desfragmentação em segundo plano (fs_defrag_start) */
+     unsigned int defrag_rate;       // Blocos que podem ser mudados por segundo
+     unsigned int defrag_next;       // Próximo inode a examinar
+     unsigned int defrag_files;      // Ficheiros já mudados
+     unsigned int defrag_blocks;     // Blocos já mudados
+     pthread_t defragger;            // Fio que muda os ficheiros fragmentados
+ 
+     /* Escrita em log (fs_log_start) */
+     int log_mode;                   // Os blocos de dados são escritos na cabeça do log
+     unsigned int log_seg;           // Segmento da cabeça do log + 1 (0: nenhum)
+     unsigned int log_head;          // Próximo bloco a tentar no segmento da cabeça
+     unsigned int log_cleaning;      // Segmento a ser limpo + 1 (não recebe a cabeça)
+     unsigned int log_clean_rate;    // Blocos que o cleaner pode mudar por segundo
+     unsigned int log_blocks;        // Blocos escritos no log
+     unsigned int log_opened;        // Segmentos por onde a cabeça já passou
+     unsigned int log_cleaned;       // Segmentos limpos
+     unsigned int log_moved;         // Blocos mudados pelo cleaner
+     pthread_mutex_t log_mutex;      // Mutex da cabeça do log
+     pthread_t log_cleaner;          // Fio que limpa os segmentos
+ 
+     /* Paragem dos fios em segundo plano (fs_stop) */
+     int stopping;                   // Os fios devem terminar
+     pthread_mutex_t stop_mutex;     // Mutex de 'stopping'
+     pthread_cond_t stop_cond;       // Acorda os fios que esperam entre passagens
   };
  
+ 
+ /*
+  * Metadata journal records
+  * - a transaction is a sequence of records (header + payload) that is
+  *   committed to the journal as a whole
+  * - in-place metadata is only written when the journal is checkpointed
+  * - a BLK_CLR record also revokes the DENTRY records of the same block
+  *   that come before it in the journal: a freed directory page can be
+  *   reused for file data before the next checkpoint, and replaying its
+  *   old entries would overwrite that data
+  */
+ 
+ typedef enum {
+     FS_JREC_BLK_SET = 1,   // arg: block number
+     FS_JREC_BLK_CLR = 2,   // arg: block number
+     FS_JREC_INO_SET = 3,   // arg: inode number
+     FS_JREC_INO_CLR = 4,   // arg: inode number
+     FS_JREC_INODE = 5,     // arg: inode number, payload: fs_inode_t prefix
+     FS_JREC_DENTRY = 6,    // arg: block number, payload: fs_jdentry_t
+     FS_JREC_REFCNT = 7     // arg: block number, payload: unsigned char
+ } fs_jrec_type_t;
+ 
+ typedef struct {
+     unsigned short type;
+     unsigned short len;    // size of the payload
+     unsigned int arg;
+ } fs_jrec_t;
+ 
+ typedef struct {
+     unsigned int slot;     // entry index in the directory page
+     fs_dentry_t dentry;
+ } fs_jdentry_t;
+ 
+ // flag of 'slot': the entry is the first one of a newly allocated page
+ #define FS_JDENTRY_NEW_PAGE 0x80000000
+ 
+ // must not exceed journal_max_tx()
+ #define FS_TX_MAX (BLOCK_SIZE - 16)
+ 
+ typedef struct {
+     unsigned int len;
+     int overflow;
+     char buf[FS_TX_MAX];
+ } fs_tx_t;
+ 
+ 
+ /*
+  * Locking
+  * - each inode has a reader-writer lock that protects the inode and the
+  *   contents of the file or directory; the bit of an inode in the inode
+  *   bitmap only changes while its write lock is held (or before the
+  *   inode becomes reachable)
+  * - the free block/inode bitmaps and the free counters are changed with
+  *   atomic operations and need no lock (see "Free space accounting")
+  * - 'alloc_mutex' protects the block reference counts and the
+  *   deduplication index, and keeps the reclaimer out of a checkpoint
+  * - 'cache_mutex' protects the block and directory caches and their
+  *   sizes (the caches are resized while it is held)
+  * - 'reclaim_mutex' protects the queue of blocks waiting to be freed by
+  *   the reclaimer thread; it is taken after 'alloc_mutex'
+  * - 'log_mutex' protects the head of the log; it is taken after
+  *   'alloc_mutex'
+  * - lock order: a directory before its entries, otherwise the lowest
+  *   inode number first; inode locks before 'alloc_mutex' before
+  *   'cache_mutex'
+  * - transactions are committed while the inode locks are held (so the
+  *   journal keeps the order of the changes to each inode) but never
+  *   while holding 'alloc_mutex' or 'cache_mutex'
+  * - the attributes of an inode (type, size) are also guarded by a
+  *   sequence counter so that fs_get_attrs reads them without locks
+  */
+ 
  #define NOT_FS_INITIALIZER  1
+ 
+ /*
+  * Bitmap management macros
+  */
+ 
+ #define BMAP_SET(bmap,num) ((bmap)[(num)/8]|=(0x1<<((num)%8)))
+ 
+ #define BMAP_CLR(bmap,num) ((bmap)[(num)/8]&=~((0x1<<((num)%8))))
+ 
+ #define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))
                                 
  /*
   * Internal functions for loading/storing file system metadata do the blocks
@@ -125,7 +373,7 @@
  /* Funções auxiliares da cache */
  // Funções para encontrar/inserir em cada cache
  static block_cache_entry_t* find_block_in_cache(fs_t* fs, unsigned int block_num) {
-     for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+     for (int i = 0; i < fs->block_cache_len; i++) {
          if (fs->block_cache[i].block_num == block_num) {
              fs->block_cache[i].last_access = time(NULL);
              return &fs->block_cache[i];
@@ -134,13 +382,37 @@
      return NULL;
  }
  
+ // Completa uma entrada só parcialmente válida com o início do bloco no
+ // disco (chamada com 'cache_mutex')
+ static int complete_cached_block(fs_t* fs, block_cache_entry_t* entry) {
+     if (entry->valid_from == 0) {
+         return 0;
+     }
+     char disk_data[BLOCK_SIZE];
+     if (block_read(fs->blocks, entry->block_num, disk_data)) {
+         return -1;
+     }
+     memcpy(entry->data, disk_data, entry->valid_from);
+     entry->valid_from = 0;
+     return 0;
+ }
+ 
+ // Escreve no disco uma entrada dirty da cache (chamada com 'cache_mutex')
+ static void write_back_cached_block(fs_t* fs, block_cache_entry_t* entry) {
+     if (complete_cached_block(fs, entry) == 0) {
+         block_write(fs->blocks, entry->block_num, entry->data);
+     }
+     entry->dirty = 0;
+     fs->cache_wb_seq++;
+ }
+ 
  // Adiciona um bloco à cache usando política LRU
  static void add_block_to_cache(fs_t* fs, unsigned int block_num, char* data, int dirty) {
      // Encontrar entrada LRU
      int lru_index = 0;
      time_t lru_time = fs->block_cache[0].last_access;
      
-     for (int i = 1; i < BLOCK_CACHE_SIZE; i++) {
+     for (int i = 1; i < fs->block_cache_len; i++) {
          if (fs->block_cache[i].last_access < lru_time) {
              lru_index = i;
              lru_time = fs->block_cache[i].last_access;
@@ -149,50 +421,72 @@
      
      // Se a entrada LRU estiver dirty, escrever de volta
      if (fs->block_cache[lru_index].dirty) {
-         block_write(fs->blocks, fs->block_cache[lru_index].block_num, 
-                    fs->block_cache[lru_index].data);
+         write_back_cached_block(fs, &fs->block_cache[lru_index]);
      }
      
      // Adicionar novo bloco à cache
      fs->block_cache[lru_index].block_num = block_num;
      memcpy(fs->block_cache[lru_index].data, data, BLOCK_SIZE);
      fs->block_cache[lru_index].dirty = dirty;
+     fs->block_cache[lru_index].valid_from = 0;
      fs->block_cache[lru_index].last_access = time(NULL);
  }
  
  
- // Funções similares para inode_cache e dir_cache
+ // Funções similares para a dir_cache
  
  // Substituir chamadas diretas a block_read/block_write por funções que usam cache
  
- static int __attribute__((unused)) cached_block_read(fs_t* fs, unsigned int block_num, char* buffer) {
+ static int cached_block_read(fs_t* fs, unsigned int block_num, char* buffer) {
      pthread_mutex_lock(&fs->cache_mutex);
      
      // Verificar se está na cache
      block_cache_entry_t* cached = find_block_in_cache(fs, block_num);
      if (cached) {
+         int res = complete_cached_block(fs, cached);
          memcpy(buffer, cached->data, BLOCK_SIZE);
          pthread_mutex_unlock(&fs->cache_mutex);
-         return 0;
+         return res;
      }
+     pthread_mutex_unlock(&fs->cache_mutex);
      
-     // Se não estiver na cache, ler do disco
+     // Se não estiver na cache, ler do disco (sem o mutex, para que as
+     // leituras de blocos diferentes decorram em paralelo)
      int res = block_read(fs->blocks, block_num, buffer);
+     if (res) {
+         return res;
+     }
      
-     // Adicionar à cache
-     add_block_to_cache(fs, block_num, buffer, 0);
-     
+     // Adicionar à cache, a não ser que outro fio já o tenha feito
+     pthread_mutex_lock(&fs->cache_mutex);
+     cached = find_block_in_cache(fs, block_num);
+     if (cached) {
+         if (cached->valid_from > 0) {
+             memcpy(cached->data, buffer, cached->valid_from);
+             cached->valid_from = 0;
+         }
+         memcpy(buffer, cached->data, BLOCK_SIZE);
+     } else {
+         add_block_to_cache(fs, block_num, buffer, 0);
+     }
      pthread_mutex_unlock(&fs->cache_mutex);
-     return res;
+     return 0;
  }
  
- static int __attribute__((unused)) cached_block_write(fs_t* fs, unsigned int block_num, char* data) {
+ // Escreve os bytes do bloco a partir de 'from'; os anteriores ficam como
+ // estão (se o bloco não estiver na cache, só são lidos do disco quando
+ // forem precisos)
+ static int cached_block_write_from(fs_t* fs, unsigned int block_num, char* data,
+    unsigned int from) {
      pthread_mutex_lock(&fs->cache_mutex);
      
      // Atualizar cache se o bloco estiver lá
      block_cache_entry_t* cached = find_block_in_cache(fs, block_num);
      if (cached) {
-         memcpy(cached->data, data, BLOCK_SIZE);
+         memcpy(&cached->data[from], &data[from], BLOCK_SIZE - from);
+         if (from < cached->valid_from) {
+             cached->valid_from = from;
+         }
          cached->dirty = 1;
          cached->last_access = time(NULL);
          pthread_mutex_unlock(&fs->cache_mutex);
@@ -201,25 +495,143 @@
      
      // Se não estiver na cache, adicionar
      add_block_to_cache(fs, block_num, data, 1);
+     find_block_in_cache(fs, block_num)->valid_from = from;
      
      pthread_mutex_unlock(&fs->cache_mutex);
      return 0;
- }                          
-                                 
+ }
+ 
+ static int cached_block_write(fs_t* fs, unsigned int block_num, char* data) {
+     return cached_block_write_from(fs, block_num, data, 0);
+ }
+ 
+ // Escreve já no disco o bloco 'block_num', se estiver dirty na cache
+ static void fsi_cache_flush_block(fs_t* fs, unsigned int block_num)
+ {
+     pthread_mutex_lock(&fs->cache_mutex);
+     block_cache_entry_t* cached = find_block_in_cache(fs, block_num);
+     if (cached && cached->dirty) {
+         write_back_cached_block(fs, cached);
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+ }
+ 
+ /*
+  * Cache memory manager
+  * - the block cache (file data) and the directory cache (metadata) share
+  *   a budget in bytes; 'cache_meta_pct' % of it goes to directory pages
+  *   and the rest to data blocks
+  * - the budget can be changed while the file system is in use; when the
+  *   caches shrink the most recently used entries are kept
+  * - when memory runs out the budget is halved
+  */
+ 
+ // Ordena as entradas da mais recente para a mais antiga
+ static int fsi_cache_cmp_block(const void* a, const void* b) {
+     time_t ta = ((const block_cache_entry_t*)a)->last_access;
+     time_t tb = ((const block_cache_entry_t*)b)->last_access;
+     return (ta < tb) - (ta > tb);
+ }
+ 
+ static int fsi_cache_cmp_dir(const void* a, const void* b) {
+     time_t ta = ((const dir_cache_entry_t*)a)->last_access;
+     time_t tb = ((const dir_cache_entry_t*)b)->last_access;
+     return (ta < tb) - (ta > tb);
+ }
+ 
+ // Número de entradas de cada cache para o orçamento 'budget'
+ static void fsi_cache_split(unsigned int budget, unsigned int meta_pct,
+    unsigned int* nblk, unsigned int* ndir) {
+     unsigned long long meta = (unsigned long long)budget * meta_pct / 100;
+     *ndir = meta / sizeof(dir_cache_entry_t);
+     if (*ndir == 0) {
+         *ndir = 1;
+     }
+     unsigned long long used = *ndir * sizeof(dir_cache_entry_t);
+     *nblk = (budget > used) ? (budget - used) / sizeof(block_cache_entry_t) : 0;
+     if (*nblk == 0) {
+         *nblk = 1;
+     }
+ }
+ 
+ // Muda o tamanho das caches (chamada com 'cache_mutex'); as entradas dirty
+ // que deixam de caber são escritas no disco. Se faltar memória as caches
+ // ficam como estavam
+ static int fsi_cache_resize(fs_t* fs, unsigned int budget, unsigned int meta_pct) {
+     unsigned int nblk, ndir;
+     fsi_cache_split(budget, meta_pct, &nblk, &ndir);
+ 
+     // 1. Reservar os dois vectores novos antes de mudar qualquer das caches
+     block_cache_entry_t* bc = (block_cache_entry_t*)calloc(nblk, sizeof(block_cache_entry_t));
+     dir_cache_entry_t* dc = (dir_cache_entry_t*)calloc(ndir, sizeof(dir_cache_entry_t));
+     if (bc == NULL || dc == NULL) {
+         free(bc);
+         free(dc);
+         return -1;
+     }
+ 
+     // 2. Ficam as entradas usadas mais recentemente
+     if (fs->block_cache_len > 1) {
+         qsort(fs->block_cache, fs->block_cache_len, sizeof(block_cache_entry_t),
+               fsi_cache_cmp_block);
+     }
+     for (unsigned int i = nblk; i < fs->block_cache_len; i++) {
+         if (fs->block_cache[i].dirty) {
+             write_back_cached_block(fs, &fs->block_cache[i]);
+         }
+     }
+     if (fs->dir_cache_len > 1) {
+         qsort(fs->dir_cache, fs->dir_cache_len, sizeof(dir_cache_entry_t),
+               fsi_cache_cmp_dir);
+     }
+ 
+     // 3. Passar as entradas que ficam para os vectores novos
+     unsigned int keep_blk = (nblk < fs->block_cache_len) ? nblk : fs->block_cache_len;
+     unsigned int keep_dir = (ndir < fs->dir_cache_len) ? ndir : fs->dir_cache_len;
+     memcpy(bc, fs->block_cache, keep_blk * sizeof(block_cache_entry_t));
+     memcpy(dc, fs->dir_cache, keep_dir * sizeof(dir_cache_entry_t));
+     free(fs->block_cache);
+     free(fs->dir_cache);
+     fs->block_cache = bc;
+     fs->block_cache_len = nblk;
+     fs->dir_cache = dc;
+     fs->dir_cache_len = ndir;
+ 
+     fs->cache_budget = budget;
+     fs->cache_meta_pct = meta_pct;
+     return 0;
+ }
+ 
+ // Falta de memória: reduz o orçamento das caches para metade
+ static int fsi_cache_shrink(fs_t* fs) {
+     pthread_mutex_lock(&fs->cache_mutex);
+     int res = -1;
+     if (fs->cache_budget / 2 >= FS_CACHE_MIN_BUDGET) {
+         res = fsi_cache_resize(fs, fs->cache_budget / 2, fs->cache_meta_pct);
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+     return res;
+ }
+ 
  static void fsi_load_fsdata(fs_t* fs)
  {
     blocks_t* bks = fs->blocks;
     
-    // load free block bitmap from block 0
-    block_read(bks,0,fs->blk_bmap);
+    // load free block bitmap
+    for (int i = 0; i < fs->bmap_num_blks; i++) {
+       block_read(bks,BMAP_START+i,&fs->blk_bmap[i*BLOCK_SIZE]);
+    }
  
-    // load free inode bitmap from block 1
-    block_read(bks,1,fs->inode_bmap);
+    // load free inode bitmap
+    block_read(bks,fs->ibmap_start,fs->inode_bmap);
+ 
+    // the checkpoint copy starts as the metadata on disk
+    memcpy(fs->ckpt_blk_bmap,fs->blk_bmap,fs->bmap_num_blks*BLOCK_SIZE);
+    memcpy(fs->ckpt_inode_bmap,fs->inode_bmap,BLOCK_SIZE);
     
-    // load inode table from blocks 2-9
-    for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-       block_read(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
-    }
+    // the inode table and the block reference counts are loaded on demand
+    memset((char*)fs->itab_loaded,0,ITAB_NUM_BLKS);
+    memset((char*)fs->refc_loaded,0,fs->refc_num_blks);
  #define NOT_FS_INITIALIZER  1  //file system is already initialized, subsequent block acess will be delayed using a sleep function.
  }
  
@@ -228,34 +640,329 @@
  {
     blocks_t* bks = fs->blocks;
   
-    // store free block bitmap to block 0
-    block_write(bks,0,fs->blk_bmap);
+    // only the committed copy is stored: the live tables may hold changes
+    // of transactions that are not in the journal yet
+ 
+    // store free block bitmap
+    for (int i = 0; i < fs->bmap_num_blks; i++) {
+       block_write(bks,BMAP_START+i,&fs->ckpt_blk_bmap[i*BLOCK_SIZE]);
+    }
  
-    // store free inode bitmap to block 1
-    block_write(bks,1,fs->inode_bmap);
+    // store free inode bitmap
+    block_write(bks,fs->ibmap_start,fs->ckpt_inode_bmap);
     
-    // store inode table to blocks 2-9
+    // store inode table (blocks never loaded are unchanged)
     for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-       block_write(bks,i+2,&((char*)fs->inode_tab)[i*BLOCK_SIZE]);
+       if (fs->itab_loaded[i]) {
+          block_write(bks,fs->itab_start+i,&((char*)fs->ckpt_inode_tab)[i*BLOCK_SIZE]);
+       }
+    }
+ 
+    // store block reference counts
+    for (int i = 0; i < fs->refc_num_blks; i++) {
+       if (fs->refc_loaded[i]) {
+          block_write(bks,fs->refc_start+i,(char*)&fs->ckpt_blk_refs[i*BLOCK_SIZE]);
+       }
     }
  }
  
  
+ // Copia os atributos quentes do inode 'id' para os vectores densos
+ static void fsi_inode_hot_sync(fs_t* fs, inodeid_t id)
+ {
+     fs->inode_type[id] = fs->inode_tab[id].type;
+     fs->inode_flags[id] = fs->inode_tab[id].reserved[1];
+     fs->inode_size[id] = fs->inode_tab[id].size;
+ }
+ 
+ // Actualiza os atributos quentes dos inodes do bloco 'i' da tabela
+ static void fsi_itab_block_loaded(fs_t* fs, unsigned int i)
+ {
+     unsigned int per_block = BLOCK_SIZE / sizeof(fs_inode_t);
+     for (unsigned int id = i * per_block; id < (i + 1) * per_block; id++) {
+         // um inode livre pode ter ficado no disco com o tipo do último
+         // ficheiro que o usou
+         if (!BMAP_ISSET(fs->inode_bmap, id)) {
+             fs->inode_tab[id].type = 0;
+         }
+         fsi_inode_hot_sync(fs, id);
+     }
+ }
+ 
+ // Lê o bloco 'i' de uma tabela de metadados na primeira vez que é usado,
+ // para a tabela e para a sua cópia do checkpoint; 'loaded_fn' (se
+ // existir) é chamada antes de o bloco ficar disponível
+ static void fsi_meta_load(fs_t* fs, volatile unsigned char* loaded,
+    unsigned int i, unsigned int block_num, char* table_block,
+    char* ckpt_block, void (*loaded_fn)(fs_t*, unsigned int))
+ {
+     if (loaded[i]) {
+         __sync_synchronize();
+         return;
+     }
+     pthread_mutex_lock(&fs->load_mutex);
+     if (!loaded[i]) {
+         block_read(fs->blocks, block_num, table_block);
+         memcpy(ckpt_block, table_block, BLOCK_SIZE);
+         if (loaded_fn != NULL) {
+             loaded_fn(fs, i);
+         }
+         __sync_synchronize();
+         loaded[i] = 1;
+     }
+     pthread_mutex_unlock(&fs->load_mutex);
+ }
+ 
+ // Garante que o inode 'id' está carregado na tabela de inodes
+ static void fsi_itab_load(fs_t* fs, unsigned int id)
+ {
+     unsigned int i = id * sizeof(fs_inode_t) / BLOCK_SIZE;
+     fsi_meta_load(fs, fs->itab_loaded, i, fs->itab_start + i,
+        &((char*)fs->inode_tab)[i * BLOCK_SIZE],
+        &((char*)fs->ckpt_inode_tab)[i * BLOCK_SIZE], fsi_itab_block_loaded);
+ }
+ 
+ // Garante que o contador de referências do bloco está carregado
+ static void fsi_refs_load(fs_t* fs, unsigned int block_num)
+ {
+     unsigned int i = block_num / BLOCK_SIZE;
+     fsi_meta_load(fs, fs->refc_loaded, i, fs->refc_start + i,
+        (char*)&fs->blk_refs[i * BLOCK_SIZE],
+        (char*)&fs->ckpt_blk_refs[i * BLOCK_SIZE], NULL);
+ }
+ 
  /*
-  * Bitmap management macros and functions
+  * Cache warm-up list
+  * - a file kept next to the volume (fs_warmup_start) with the inodes and
+  *   blocks that were hot in the previous run, in priority order: the
+  *   blocks of the inode table, the directory pages and then the data
+  *   blocks, the most recently used first
+  * - after mounting, a background thread reads them into the caches and
+  *   then saves the list again every 'warm_period' seconds
+  * - the list is only a hint: stale entries cost a read, nothing else
   */
  
- #define BMAP_SET(bmap,num) ((bmap)[(num)/8]|=(0x1<<((num)%8)))
+ #define FS_WARM_MAGIC 0x4d524157     // "WARM"
  
- #define BMAP_CLR(bmap,num) ((bmap)[(num)/8]&=~((0x1<<((num)%8))))
+ typedef struct {
+     unsigned int magic;
+     unsigned int num_blocks;   // size of the volume the list belongs to
+     unsigned int num_inodes;   // inode ids that follow the header
+     unsigned int num_blks;     // block numbers that follow the inode ids
+ } fs_warm_hdr_t;
+ 
+ typedef struct {
+     unsigned int block_num;
+     time_t last_access;
+ } fs_warm_entry_t;
+ 
+ static int fsi_warm_cmp(const void* a, const void* b) {
+     time_t ta = ((const fs_warm_entry_t*)a)->last_access;
+     time_t tb = ((const fs_warm_entry_t*)b)->last_access;
+     return (ta < tb) - (ta > tb);
+ }
+ 
+ // Lê um bloco para a cache sem os trincos dos inodes: só é guardado se
+ // nenhuma entrada dirty foi escrita no disco durante a leitura (senão o
+ // conteúdo lido podia já estar desactualizado)
+ static void fsi_cache_prefetch(fs_t* fs, unsigned int block_num) {
+     pthread_mutex_lock(&fs->cache_mutex);
+     unsigned int seq = fs->cache_wb_seq;
+     int cached = find_block_in_cache(fs, block_num) != NULL;
+     pthread_mutex_unlock(&fs->cache_mutex);
+     if (cached) {
+         return;
+     }
+ 
+     char buffer[BLOCK_SIZE];
+     if (block_read(fs->blocks, block_num, buffer)) {
+         return;
+     }
+ 
+     pthread_mutex_lock(&fs->cache_mutex);
+     if (fs->cache_wb_seq == seq && find_block_in_cache(fs, block_num) == NULL) {
+         add_block_to_cache(fs, block_num, buffer, 0);
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+ }
+ 
+ // Guarda a lista de aquecimento (escreve um ficheiro temporário que
+ // substitui o anterior, para nunca deixar uma lista a meio)
+ static int fsi_warmup_store(fs_t* fs) {
+     // 1. Recolher os blocos das caches, os mais recentes primeiro
+     pthread_mutex_lock(&fs->cache_mutex);
+     unsigned int ndir = 0, nblk = 0;
+     fs_warm_entry_t* dirs = (fs_warm_entry_t*)malloc(fs->dir_cache_len * sizeof(fs_warm_entry_t));
+     fs_warm_entry_t* blks = (fs_warm_entry_t*)malloc(fs->block_cache_len * sizeof(fs_warm_entry_t));
+     unsigned int* inodes = (unsigned int*)malloc(ITAB_NUM_BLKS * sizeof(unsigned int));
+     if (dirs == NULL || blks == NULL || inodes == NULL) {
+         pthread_mutex_unlock(&fs->cache_mutex);
+         free(dirs);
+         free(blks);
+         free(inodes);
+         return -1;
+     }
+     for (unsigned int i = 0; i < fs->dir_cache_len; i++) {
+         if (fs->dir_cache[i].dir_num != 0) {
+             dirs[ndir].block_num = fs->dir_cache[i].block_num;
+             dirs[ndir++].last_access = fs->dir_cache[i].last_access;
+         }
+     }
+     for (unsigned int i = 0; i < fs->block_cache_len; i++) {
+         if (fs->block_cache[i].block_num != 0) {
+             blks[nblk].block_num = fs->block_cache[i].block_num;
+             blks[nblk++].last_access = fs->block_cache[i].last_access;
+         }
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+     qsort(dirs, ndir, sizeof(fs_warm_entry_t), fsi_warm_cmp);
+     qsort(blks, nblk, sizeof(fs_warm_entry_t), fsi_warm_cmp);
+ 
+     // os inodes: um por cada bloco já carregado da tabela de inodes
+     unsigned int ninodes = 0;
+     for (unsigned int i = 0; i < ITAB_NUM_BLKS; i++) {
+         if (fs->itab_loaded[i]) {
+             inodes[ninodes++] = i * BLOCK_SIZE / sizeof(fs_inode_t);
+         }
+     }
+ 
+     // 2. Escrever a lista
+     char tmp[strlen(fs->warm_path) + 5];
+     sprintf(tmp, "%s.tmp", fs->warm_path);
+     fs_warm_hdr_t hdr;
+     hdr.magic = FS_WARM_MAGIC;
+     hdr.num_blocks = block_num_blocks(fs->blocks);
+     hdr.num_inodes = ninodes;
+     hdr.num_blks = ndir + nblk;
+     int res = -1;
+     FILE* f = fopen(tmp, "wb");
+     if (f != NULL) {
+         int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+                  fwrite(inodes, sizeof(unsigned int), ninodes, f) == ninodes;
+         for (unsigned int i = 0; ok && i < ndir; i++) {
+             ok = fwrite(&dirs[i].block_num, sizeof(unsigned int), 1, f) == 1;
+         }
+         for (unsigned int i = 0; ok && i < nblk; i++) {
+             ok = fwrite(&blks[i].block_num, sizeof(unsigned int), 1, f) == 1;
+         }
+         if (fclose(f) == 0 && ok && rename(tmp, fs->warm_path) == 0) {
+             res = 0;
+         }
+     }
+     free(dirs);
+     free(blks);
+     free(inodes);
+     return res;
+ }
+ 
+ // Pré-carrega a lista de aquecimento, pela ordem em que foi guardada
+ static void fsi_warmup_load(fs_t* fs) {
+     FILE* f = fopen(fs->warm_path, "rb");
+     if (f == NULL) {
+         return;
+     }
+     fs_warm_hdr_t hdr;
+     if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != FS_WARM_MAGIC ||
+         hdr.num_blocks != block_num_blocks(fs->blocks)) {
+         dprintf("[fs_warmup] ignoring the warm-up list of another volume.\n");
+         fclose(f);
+         return;
+     }
+ 
+     unsigned int id;
+     for (unsigned int i = 0; i < hdr.num_inodes && fread(&id, sizeof(id), 1, f) == 1; i++) {
+         if (id < ITAB_SIZE) {
+             fsi_itab_load(fs, id);
+         }
+     }
+ 
+     // não vale a pena ler mais blocos do que os que cabem na cache
+     unsigned int block_num;
+     pthread_mutex_lock(&fs->cache_mutex);
+     unsigned int max = fs->block_cache_len;
+     pthread_mutex_unlock(&fs->cache_mutex);
+     for (unsigned int i = 0; i < hdr.num_blks && i < max &&
+          fread(&block_num, sizeof(block_num), 1, f) == 1; i++) {
+         if (block_num >= fs->data_start && block_num < hdr.num_blocks) {
+             fsi_cache_prefetch(fs, block_num);
+         }
+     }
+     fclose(f);
+ }
+ 
+ // Espera 'secs' segundos ou até fs_stop; devolve 1 se o fio deve terminar
+ static int fsi_stop_wait(fs_t* fs, unsigned int secs)
+ {
+     struct timespec until = { time(NULL) + secs, 0 };
+ 
+     pthread_mutex_lock(&fs->stop_mutex);
+     while (!fs->stopping &&
+            pthread_cond_timedwait(&fs->stop_cond, &fs->stop_mutex, &until) == 0);
+     int stop = fs->stopping;
+     pthread_mutex_unlock(&fs->stop_mutex);
+     return stop;
+ }
+ 
+ // Fio de aquecimento: pré-carrega a lista e depois guarda-a periodicamente
+ static void* fsi_warmer(void* arg)
+ {
+     fs_t* fs = (fs_t*)arg;
+     fsi_warmup_load(fs);
+     while (fs->warm_period > 0 && !fsi_stop_wait(fs, fs->warm_period)) {
+         pthread_mutex_lock(&fs->warm_mutex);
+         fsi_warmup_store(fs);
+         pthread_mutex_unlock(&fs->warm_mutex);
+     }
+     return NULL;
+ }
+ 
+ 
+ 
+ /*
+  * Bitmap management functions
+  */
  
- #define BMAP_ISSET(bmap,num) ((bmap)[(num)/8]&(0x1<<((num)%8)))
  
+ // Reserva o bit 'num' com compare-and-swap do seu byte; devolve 0 se
+ // já estava reservado (por outro fio)
+ static int fsi_bmap_claim(char* bmap, unsigned int num)
+ {
+    char mask = (char)(0x1 << (num % 8));
+    char old = bmap[num / 8];
+    while (!(old & mask)) {
+       char seen = __sync_val_compare_and_swap(&bmap[num / 8], old, (char)(old | mask));
+       if (seen == old) {
+          return 1;
+       }
+       old = seen;
+    }
+    return 0;
+ }
+ 
+ 
+ static void fsi_bmap_release(char* bmap, unsigned int num)
+ {
+    __sync_fetch_and_and(&bmap[num / 8], (char)~(0x1 << (num % 8)));
+ }
+ 
+ 
+ // Lê o bit 'num' sem trincos (leitura atómica do seu byte, com barreira)
+ static int fsi_bmap_isset(char* bmap, unsigned int num)
+ {
+    return (__sync_fetch_and_or(&bmap[num / 8], 0) >> (num % 8)) & 0x1;
+ }
  
- static int fsi_bmap_find_free(char* bmap, int size, unsigned* free)
+ 
+ // Reserva o primeiro bit livre entre 'first' e 'last' (exclusive)
+ static int fsi_bmap_claim_free(char* bmap, unsigned int first,
+    unsigned int last, unsigned* free)
  {
-    for (int i = 0; i < size; i++) {
-       if (!BMAP_ISSET(bmap,i)) {
+    for (unsigned int i = first; i < last; i++) {
+       if (i % 8 == 0 && (unsigned char)bmap[i / 8] == 0xff) {
+          i += 7;        // byte cheio
+          continue;
+       }
+       if (!BMAP_ISSET(bmap,i) && fsi_bmap_claim(bmap,i)) {
           *free = i;
           return 1;
        }
@@ -287,188 +994,2191 @@
  #define OFFSET_TO_BLOCKS(pos) ((pos)/BLOCK_SIZE+(((pos)%BLOCK_SIZE>0)?1:0))
  
                                  
- static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
+ /*
+  * Free space accounting
+  * - allocation is lock-free: a thread first takes a unit of the free
+  *   counter with compare-and-swap (so it fails at once when the volume
+  *   is full) and then claims a bit of the bitmap, which is always found
+  *   because the bits are only cleared before the counter is given back
+  * - a thread searches its own allocation group first (threads are
+  *   numbered on their first allocation), so concurrent writers seldom
+  *   compete for the same bits
+  * - the per-group counters are hints used to skip full groups
+  */
+ 
+ static unsigned int fsi_worker_count;        // Fios que já alocaram blocos
+ static __thread unsigned int fsi_worker_id;  // Número deste fio (0: nenhum)
+ 
+ // Grupo de alocação onde o fio actual começa a procurar
+ static unsigned int fsi_ag_home(fs_t* fs)
  {
-    int i;
-    
-    inode->type = type;
-    inode->size = 0;
-    for (i = 0; i < INODE_NUM_BLKS; i++) {
-       inode->blocks[i] = 0;
-    }
-    
-    for (i = 0; i < 4; i++) {
-       inode->reserved[i] = 0;
-    }
+     if (fsi_worker_id == 0) {
+         fsi_worker_id = __sync_add_and_fetch(&fsi_worker_count, 1);
+     }
+     return (fsi_worker_id - 1) % fs->ag_count;
  }
  
- 
- static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
-    inodeid_t* fileid)
+ // Retira 'n' unidades do contador se houver pelo menos 'n'
+ static int fsi_counter_take(volatile unsigned int* counter, unsigned int n)
  {
-     if (fs == NULL || file == NULL || fileid == NULL) {
-         dprintf("[fsi_dir_search] malformed arguments.\n");
-         return -1;
+     unsigned int old = *counter;
+     while (old >= n) {
+         unsigned int seen = __sync_val_compare_and_swap(counter, old, old - n);
+         if (seen == old) {
+             return 1;
+         }
+         old = seen;
      }
+     return 0;
+ }
  
-     pthread_mutex_lock(&fs->cache_mutex);
-     
-     // 1. Tentar obter da cache de diretorias
-     dir_cache_entry_t* cached_dir = NULL;
-     fs_inode_t* idir = &fs->inode_tab[dir];
-     int found_in_cache = 0;
+ // Conta os blocos e inodes livres a partir dos bitmaps
+ static void fsi_count_free(fs_t* fs)
+ {
+     unsigned int num_blocks = block_num_blocks(fs->blocks);
      
-     // Procurar por todas as entradas de cache deste diretório
-     for (int i = 0; i < DIR_CACHE_SIZE; i++) {
-         if (fs->dir_cache[i].dir_num == dir) {
-             cached_dir = &fs->dir_cache[i];
-             cached_dir->last_access = time(NULL); // Atualiza LRU
-             
-             // Procurar o arquivo nas entradas em cache
-             for (int j = 0; j < DIR_PAGE_ENTRIES; j++) {
-                 if (strcmp(cached_dir->entries[j].name, file) == 0) {
-                     *fileid = cached_dir->entries[j].inodeid;
-                     pthread_mutex_unlock(&fs->cache_mutex);
-                     return 0;
-                 }
-             }
-             found_in_cache = 1;
-             break;
+     fs->free_blocks = 0;
+     for (unsigned int ag = 0; ag < fs->ag_count; ag++) {
+         unsigned int first = ag * FS_AG_BLOCKS;
+         unsigned int last = MIN(first + FS_AG_BLOCKS, num_blocks);
+         unsigned int used = 0;
+         unsigned int b = first;
+         
+         // contar 32 bits de cada vez (popcount), e o resto bit a bit
+         for (; b + 32 <= last; b += 32) {
+             unsigned int word;
+             memcpy(&word, &fs->blk_bmap[b / 8], sizeof(word));
+             used += __builtin_popcount(word);
          }
+         for (; b < last; b++) {
+             used += BMAP_ISSET(fs->blk_bmap, b) ? 1 : 0;
+         }
+         fs->ag_free[ag] = (last - first) - used;
+         fs->free_blocks += fs->ag_free[ag];
      }
      
-     pthread_mutex_unlock(&fs->cache_mutex);
+     unsigned int used = 0;
+     for (unsigned int i = 0; i < ITAB_SIZE; i++) {
+         used += BMAP_ISSET(fs->inode_bmap, i) ? 1 : 0;
+     }
+     fs->free_inodes = ITAB_SIZE - used;
+ }
  
-     // 2. Se não encontrou completo na cache, pesquisar no disco
-     fs_dentry_t page[DIR_PAGE_ENTRIES];
-     int num = idir->size / sizeof(fs_dentry_t);
-     int iblock = 0;
-     int cache_updated = 0;
+ // Grupo de um novo directório: o próximo grupo, a rodar, com pelo menos
+ // a média de blocos livres (os directórios espalham-se pelo volume)
+ static unsigned int fsi_ag_pick_dir(fs_t* fs)
+ {
+     unsigned int avg = fs->free_blocks / fs->ag_count;
+     unsigned int start = fs->ag_dir_next;
+     unsigned int ag = start % fs->ag_count;
+     for (unsigned int i = 0; i < fs->ag_count; i++) {
+         ag = (start + i) % fs->ag_count;
+         if (fs->ag_free[ag] > 0 && fs->ag_free[ag] >= avg) {
+             break;
+         }
+     }
+     // sem trinco: uma corrida só faz dois directórios partilharem o grupo
+     fs->ag_dir_next = ag + 1;
+     return ag;
+ }
+ 
+ // Grupo (+ 1) dos blocos do directório 'idir'; 0 se não tem nenhum
+ static unsigned int fsi_dir_group(fs_inode_t* idir)
+ {
+     if (idir->reserved[2] != 0) {
+         return idir->reserved[2];
+     }
+     // volumes antigos: o grupo da primeira página
+     return (idir->blocks[0] != 0) ? idir->blocks[0] / FS_AG_BLOCKS + 1 : 0;
+ }
+ 
+ // Bloco onde deve ficar o bloco 'iblock' do ficheiro: na mesma posição
+ // relativa ao último bloco anterior do ficheiro, ou no início do grupo
+ // do ficheiro; 0 se não há preferência
+ static unsigned int fsi_block_goal(fs_t* fs, fs_inode_t* ifile, int iblock)
+ {
+     for (int i = iblock - 1; i >= 0; i--) {
+         if (ifile->blocks[i] != 0) {
+             return ifile->blocks[i] + (iblock - i);
+         }
+     }
+     if (ifile->reserved[2] != 0) {
+         return MAX((ifile->reserved[2] - 1) * FS_AG_BLOCKS, fs->data_start);
+     }
+     return 0;
+ }
+ 
+ // Reserva um bloco livre: o bloco 'goal' ou o primeiro livre a seguir
+ // no seu grupo; sem 'goal' (0), começa pelo grupo do fio actual. Os
+ // grupos de alocação cheios são saltados
+ static int fsi_block_alloc(fs_t* fs, unsigned int goal, unsigned int* block_num)
+ {
+     if (!fsi_counter_take(&fs->free_blocks, 1)) {
+         return 0;
+     }
      
-     while (num > 0) {
-         unsigned int block_num = idir->blocks[iblock];
-         fs_dentry_t* current_page = NULL;
-         
-         pthread_mutex_lock(&fs->cache_mutex);
-         
-         // Verificar se este bloco específico está em cache
-         int block_cached = 0;
-         for (int i = 0; i < DIR_CACHE_SIZE; i++) {
-             if (fs->dir_cache[i].dir_num == dir && 
-                 fs->dir_cache[i].block_num == block_num) {
-                 current_page = fs->dir_cache[i].entries;
-                 fs->dir_cache[i].last_access = time(NULL);
-                 block_cached = 1;
-                 break;
+     unsigned int num_blocks = block_num_blocks(fs->blocks);
+     unsigned int home;
+     if (goal >= fs->data_start && goal < num_blocks) {
+         home = goal / FS_AG_BLOCKS;
+         if (fsi_bmap_claim_free(fs->blk_bmap, goal,
+                MIN((home + 1) * FS_AG_BLOCKS, num_blocks), block_num)) {
+             __sync_fetch_and_sub(&fs->ag_free[home], 1);
+             return 1;
+         }
+     } else {
+         home = fsi_ag_home(fs);
+     }
+     // o contador garante que há um bit livre; a segunda passagem já não
+     // salta os grupos cheios. Se também falhar, o contador não bate certo
+     // com o bitmap (é recalculado por fsi_count_free ao montar): devolver
+     // a unidade e falhar em vez de procurar para sempre
+     for (int pass = 0; pass < 2; pass++) {
+         for (unsigned int i = 0; i < fs->ag_count; i++) {
+             unsigned int ag = (home + i) % fs->ag_count;
+             if (pass == 0 && fs->ag_free[ag] == 0) {
+                 continue;
+             }
+             unsigned int first = ag * FS_AG_BLOCKS;
+             if (fsi_bmap_claim_free(fs->blk_bmap, first,
+                    MIN(first + FS_AG_BLOCKS, num_blocks), block_num)) {
+                 __sync_fetch_and_sub(&fs->ag_free[ag], 1);
+                 return 1;
              }
          }
-         
-         if (!block_cached) {
-             // Se o bloco não está em cache, ler do disco
-             pthread_mutex_unlock(&fs->cache_mutex);
-             if (block_read(fs->blocks, block_num, (char*)page)) {
-                 dprintf("[fsi_dir_search] error reading block %d\n", block_num);
-                 return -1;
+     }
+     __sync_fetch_and_add(&fs->free_blocks, 1);
+     dprintf("[fsi_block_alloc] free block count does not match the bitmap.\n");
+     return 0;
+ }
+ 
+ // Reserva os 'n' blocos a partir de 'start'; se um deles já estiver
+ // reservado, devolve os outros e falha
+ static int fsi_block_claim_run(fs_t* fs, unsigned int start, unsigned int n)
+ {
+     for (unsigned int b = start; b < start + n; b++) {
+         if (!fsi_bmap_claim(fs->blk_bmap, b)) {
+             while (b > start) {
+                 fsi_bmap_release(fs->blk_bmap, --b);
              }
-             current_page = page;
-             
-             // Adicionar à cache (substituição LRU)
-             pthread_mutex_lock(&fs->cache_mutex);
-             int lru_index = 0;
-             time_t lru_time = fs->dir_cache[0].last_access;
-             
-             for (int i = 1; i < DIR_CACHE_SIZE; i++) {
-                 if (fs->dir_cache[i].last_access < lru_time) {
-                     lru_index = i;
-                     lru_time = fs->dir_cache[i].last_access;
+             return 0;
+         }
+     }
+     return 1;
+ }
+ 
+ // Reserva 'n' blocos contíguos, de preferência a começar em 'goal'; devolve
+ // 0 se não houver nenhuma sequência livre com esse tamanho
+ static int fsi_block_alloc_range(fs_t* fs, unsigned int n, unsigned int goal,
+    unsigned int* first)
+ {
+     if (n == 0 || !fsi_counter_take(&fs->free_blocks, n)) {
+         return 0;
+     }
+     
+     unsigned int num_blocks = block_num_blocks(fs->blocks);
+     unsigned int start = num_blocks;
+     unsigned int run = 0;
+     
+     // 1. Continuar a partir do bloco pedido (normalmente a seguir ao
+     //    último bloco do ficheiro)
+     if (goal >= fs->data_start && goal + n <= num_blocks) {
+         while (run < n && !BMAP_ISSET(fs->blk_bmap, goal + run)) {
+             run++;
+         }
+         if (run == n && fsi_block_claim_run(fs, goal, n)) {
+             start = goal;
+         }
+     }
+     
+     // 2. Procurar a primeira sequência livre a partir do grupo do bloco
+     //    pedido (e depois desde o início), saltando os grupos cheios
+     unsigned int from = fs->data_start;
+     if (goal >= fs->data_start && goal < num_blocks) {
+         from = MAX(goal / FS_AG_BLOCKS * FS_AG_BLOCKS, fs->data_start);
+     }
+     for (int pass = 0; pass < 2 && start == num_blocks; pass++) {
+         unsigned int end = (pass == 0) ? num_blocks : from;
+         run = 0;
+         for (unsigned int b = (pass == 0) ? from : fs->data_start;
+              start == num_blocks && b < end; b++) {
+             if (run == 0 && fs->ag_free[b / FS_AG_BLOCKS] == 0) {
+                 b = (b / FS_AG_BLOCKS + 1) * FS_AG_BLOCKS - 1;
+                 continue;
+             }
+             run = BMAP_ISSET(fs->blk_bmap, b) ? 0 : run + 1;
+             if (run == n) {
+                 // outro fio pode ter reservado um dos blocos entretanto
+                 if (fsi_block_claim_run(fs, b + 1 - n, n)) {
+                     start = b + 1 - n;
+                 } else {
+                     run = 0;
                  }
              }
-             
-             // Atualizar cache
-             fs->dir_cache[lru_index].dir_num = dir;
-             fs->dir_cache[lru_index].block_num = block_num;
-             memcpy(fs->dir_cache[lru_index].entries, current_page, BLOCK_SIZE);
-             fs->dir_cache[lru_index].last_access = time(NULL);
-             cache_updated = 1;
          }
-         
-         // Procurar o arquivo no bloco atual
-         for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
-             if (strcmp(current_page[i].name, file) == 0) {
-                 *fileid = current_page[i].inodeid;
-                 
-                 // Se encontrou e não estava na cache completa, atualizar
-                 if (!found_in_cache && cache_updated) {
-                     pthread_mutex_unlock(&fs->cache_mutex);
-                     return 0;
+     }
+     if (start == num_blocks) {
+         __sync_fetch_and_add(&fs->free_blocks, n);
+         return 0;
+     }
+     
+     for (unsigned int b = start; b < start + n; b++) {
+         __sync_fetch_and_sub(&fs->ag_free[b / FS_AG_BLOCKS], 1);
+     }
+     *first = start;
+     return 1;
+ }
+ 
+ static void fsi_block_free(fs_t* fs, unsigned int block_num)
+ {
+     fsi_bmap_release(fs->blk_bmap, block_num);
+     __sync_fetch_and_add(&fs->ag_free[block_num / FS_AG_BLOCKS], 1);
+     __sync_fetch_and_add(&fs->free_blocks, 1);
+ }
+ 
+ // Reserva um inode livre, de preferência a seguir a 'goal' (o inode do
+ // directório), para que os inodes de um directório fiquem nos mesmos
+ // blocos da tabela
+ static int fsi_inode_alloc(fs_t* fs, unsigned int goal, unsigned* inode)
+ {
+     if (!fsi_counter_take(&fs->free_inodes, 1)) {
+         return 0;
+     }
+     // duas passagens pelo bitmap (um inode libertado entretanto pode ter
+     // ficado para trás); se não houver bit livre, o contador está errado
+     for (int pass = 0; pass < 2; pass++) {
+         if (fsi_bmap_claim_free(fs->inode_bmap, goal, ITAB_SIZE, inode) ||
+             fsi_bmap_claim_free(fs->inode_bmap, 0, goal, inode)) {
+             return 1;
+         }
+     }
+     __sync_fetch_and_add(&fs->free_inodes, 1);
+     dprintf("[fsi_inode_alloc] free inode count does not match the bitmap.\n");
+     return 0;
+ }
+ 
+ static void fsi_inode_free(fs_t* fs, unsigned inode)
+ {
+     fsi_bmap_release(fs->inode_bmap, inode);
+     __sync_fetch_and_add(&fs->free_inodes, 1);
+ }
+ 
+ 
+ /*
+  * Deferred block freeing
+  * - unlink, rmdir and truncate log the freed blocks in their transaction
+  *   and queue them; the reclaimer thread clears their bits in the
+  *   bitmap in batches, so that a large file is removed at once and the
+  *   allocator is never held for long
+  * - a queued block is only queued after its transaction is durable, and
+  *   stays allocated in memory until it is reclaimed, so it cannot be
+  *   reused by a transaction logged before the one that freed it
+  */
+ 
+ #define FS_RECLAIM_BATCH 64
+ 
+ // Liberta até 'max' blocos da fila (o chamador detém 'alloc_mutex');
+ // devolve o número de blocos libertados
+ static unsigned int fsi_reclaim_pending(fs_t* fs, unsigned int max)
+ {
+     pthread_mutex_lock(&fs->reclaim_mutex);
+     unsigned int n = MIN(fs->reclaim_len, max);
+     fs->reclaim_len -= n;
+     for (unsigned int i = 0; i < n; i++) {
+         fsi_block_free(fs, fs->reclaim_q[fs->reclaim_len + i]);
+     }
+     pthread_mutex_unlock(&fs->reclaim_mutex);
+     return n;
+ }
+ 
+ // Entrega 'n' blocos ao reclaimer
+ static void fsi_reclaim_add(fs_t* fs, unsigned int* blocks, unsigned int n)
+ {
+     if (n == 0) {
+         return;
+     }
+     pthread_mutex_lock(&fs->reclaim_mutex);
+     if (fs->reclaim_len + n > fs->reclaim_cap) {
+         unsigned int cap = MAX(2 * fs->reclaim_cap, fs->reclaim_len + n);
+         unsigned int* q = (unsigned int*)realloc(fs->reclaim_q, cap * sizeof(unsigned int));
+         if (q == NULL) {
+             // sem memória: libertar já e devolver memória das caches
+             pthread_mutex_unlock(&fs->reclaim_mutex);
+             pthread_mutex_lock(&fs->alloc_mutex);
+             for (unsigned int i = 0; i < n; i++) {
+                 fsi_block_free(fs, blocks[i]);
+             }
+             pthread_mutex_unlock(&fs->alloc_mutex);
+             fsi_cache_shrink(fs);
+             return;
+         }
+         fs->reclaim_q = q;
+         fs->reclaim_cap = cap;
+     }
+     memcpy(&fs->reclaim_q[fs->reclaim_len], blocks, n * sizeof(unsigned int));
+     fs->reclaim_len += n;
+     pthread_cond_signal(&fs->reclaim_cond);
+     pthread_mutex_unlock(&fs->reclaim_mutex);
+ }
+ 
+ // Fio reclaimer: liberta os blocos da fila, um lote de cada vez, até
+ // fs_stop (o que ficar na fila é libertado no checkpoint)
+ static void* fsi_reclaimer(void* arg)
+ {
+     fs_t* fs = (fs_t*)arg;
+     for (;;) {
+         pthread_mutex_lock(&fs->reclaim_mutex);
+         while (fs->reclaim_len == 0 && !fs->stopping) {
+             pthread_cond_wait(&fs->reclaim_cond, &fs->reclaim_mutex);
+         }
+         int stop = fs->stopping;
+         pthread_mutex_unlock(&fs->reclaim_mutex);
+         if (stop) {
+             break;
+         }
+ 
+         pthread_mutex_lock(&fs->alloc_mutex);
+         fsi_reclaim_pending(fs, FS_RECLAIM_BATCH);
+         pthread_mutex_unlock(&fs->alloc_mutex);
+     }
+     return NULL;
+ }
+ 
+ 
+ static void fsi_inode_init(fs_inode_t* inode, fs_itype_t type)
+ {
+    int i;
+    
+    inode->type = type;
+    inode->size = 0;
+    for (i = 0; i < INODE_NUM_BLKS; i++) {
+       inode->blocks[i] = 0;
+    }
+    
+    for (i = 0; i < 4; i++) {
+       inode->reserved[i] = 0;
+    }
+ 
+    // new files start with their data inline
+    if (type == FS_FILE) {
+       inode->reserved[1] = FS_IFLAG_INLINE;
+    }
+    memset(inode->idata, 0, FS_INLINE_SIZE);
+ }
+ 
+ 
+ /*
+  * Metadata journal functions
+  */
+ 
+ static void fsi_tx_init(fs_tx_t* tx)
+ {
+     tx->len = 0;
+     tx->overflow = 0;
+ }
+ 
+ // Acrescenta um registo à transacção
+ static void fsi_tx_log(fs_tx_t* tx, fs_jrec_type_t type, unsigned int arg,
+    void* data, unsigned short len)
+ {
+     if (tx->len + sizeof(fs_jrec_t) + len > FS_TX_MAX) {
+         tx->overflow = 1;
+         return;
+     }
+     fs_jrec_t rec;
+     rec.type = type;
+     rec.len = len;
+     rec.arg = arg;
+     memcpy(&tx->buf[tx->len], &rec, sizeof(rec));
+     if (len > 0) {
+         memcpy(&tx->buf[tx->len + sizeof(rec)], data, len);
+     }
+     tx->len += sizeof(rec) + len;
+ }
+ 
+ // Regista o inode; a parte não usada dos dados inline não vai para o journal
+ static void fsi_tx_log_inode(fs_tx_t* tx, inodeid_t id, fs_inode_t* inode)
+ {
+     unsigned short len = FS_INODE_HDR_SIZE;
+     if (FS_INODE_IS_INLINE(inode)) {
+         len += MIN(inode->size, FS_INLINE_SIZE);
+     }
+     fsi_tx_log(tx, FS_JREC_INODE, id, inode, len);
+ }
+ 
+ // Torna a transacção persistente (group commit no journal)
+ static int fsi_tx_commit(fs_t* fs, fs_tx_t* tx)
+ {
+     if (tx->len == 0) {
+         return 0;
+     }
+     if (tx->overflow) {
+         dprintf("[fsi_tx_commit] transaction too large.\n");
+         return -1;
+     }
+     if (journal_commit(fs->journal, tx->buf, tx->len) < 0) {
+         dprintf("[fsi_tx_commit] error writing the journal.\n");
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Aplica o registo 'rec' à cópia dos metadados que o checkpoint escreve
+ // (as páginas de directório não têm cópia: ficam na cache de blocos)
+ static void fsi_tx_ckpt_rec(fs_t* fs, fs_jrec_t* rec, char* data)
+ {
+     switch (rec->type) {
+         case FS_JREC_BLK_SET:
+             if (rec->arg < block_num_blocks(fs->blocks)) {
+                 BMAP_SET(fs->ckpt_blk_bmap, rec->arg);
+             }
+             break;
+         case FS_JREC_BLK_CLR:
+             if (rec->arg < block_num_blocks(fs->blocks)) {
+                 BMAP_CLR(fs->ckpt_blk_bmap, rec->arg);
+             }
+             break;
+         case FS_JREC_INO_SET:
+             if (rec->arg < ITAB_SIZE) {
+                 BMAP_SET(fs->ckpt_inode_bmap, rec->arg);
+             }
+             break;
+         case FS_JREC_INO_CLR:
+             if (rec->arg < ITAB_SIZE) {
+                 BMAP_CLR(fs->ckpt_inode_bmap, rec->arg);
+                 fsi_itab_load(fs, rec->arg);
+                 fs->ckpt_inode_tab[rec->arg].type = 0;
+             }
+             break;
+         case FS_JREC_INODE:
+             if (rec->arg < ITAB_SIZE) {
+                 fsi_itab_load(fs, rec->arg);
+                 memset(&fs->ckpt_inode_tab[rec->arg], 0, sizeof(fs_inode_t));
+                 memcpy(&fs->ckpt_inode_tab[rec->arg], data,
+                    MIN(rec->len, sizeof(fs_inode_t)));
+             }
+             break;
+         case FS_JREC_REFCNT:
+             if (rec->arg < block_num_blocks(fs->blocks) && rec->len == 1) {
+                 fsi_refs_load(fs, rec->arg);
+                 fs->ckpt_blk_refs[rec->arg] = (unsigned char)data[0];
+             }
+             break;
+         default:
+             break;
+     }
+ }
+ 
+ // Estado da reposição do journal (fs_mount)
+ typedef struct {
+     fs_t* fs;
+     unsigned int rec;          // número do registo actual (a partir de 1)
+     unsigned int* last_clr;    // último registo BLK_CLR de cada bloco, ou 0
+ } fs_replay_t;
+ 
+ // Primeira passagem da reposição: regista o último BLK_CLR de cada bloco
+ static void fsi_tx_scan(void* arg, char* buf, unsigned len)
+ {
+     fs_replay_t* rp = (fs_replay_t*)arg;
+     unsigned off = 0;
+ 
+     while (off + sizeof(fs_jrec_t) <= len) {
+         fs_jrec_t rec;
+         memcpy(&rec, &buf[off], sizeof(rec));
+         if (off + sizeof(rec) + rec.len > len) {
+             break;
+         }
+         rp->rec++;
+         if (rec.type == FS_JREC_BLK_CLR &&
+             rec.arg < block_num_blocks(rp->fs->blocks)) {
+             rp->last_clr[rec.arg] = rp->rec;
+         }
+         off += sizeof(rec) + rec.len;
+     }
+ }
+ 
+ // Reaplica uma transacção do journal aos metadados (recuperação)
+ static void fsi_tx_apply(void* arg, char* buf, unsigned len)
+ {
+     fs_replay_t* rp = (fs_replay_t*)arg;
+     fs_t* fs = rp->fs;
+     unsigned off = 0;
+ 
+     while (off + sizeof(fs_jrec_t) <= len) {
+         fs_jrec_t rec;
+         memcpy(&rec, &buf[off], sizeof(rec));
+         char* data = &buf[off + sizeof(rec)];
+         if (off + sizeof(rec) + rec.len > len) {
+             break;
+         }
+         rp->rec++;
+ 
+         switch (rec.type) {
+             case FS_JREC_BLK_SET:
+                 if (rec.arg < block_num_blocks(fs->blocks)) {
+                     BMAP_SET(fs->blk_bmap, rec.arg);
+                 }
+                 break;
+             case FS_JREC_BLK_CLR:
+                 if (rec.arg < block_num_blocks(fs->blocks)) {
+                     BMAP_CLR(fs->blk_bmap, rec.arg);
+                 }
+                 break;
+             case FS_JREC_INO_SET:
+                 if (rec.arg < ITAB_SIZE) {
+                     BMAP_SET(fs->inode_bmap, rec.arg);
+                 }
+                 break;
+             case FS_JREC_INO_CLR:
+                 if (rec.arg < ITAB_SIZE) {
+                     BMAP_CLR(fs->inode_bmap, rec.arg);
+                     fsi_itab_load(fs, rec.arg);
+                     fs->inode_tab[rec.arg].type = 0;
+                     fsi_inode_hot_sync(fs, rec.arg);
+                 }
+                 break;
+             case FS_JREC_INODE:
+                 if (rec.arg < ITAB_SIZE) {
+                     fsi_itab_load(fs, rec.arg);
+                     memset(&fs->inode_tab[rec.arg], 0, sizeof(fs_inode_t));
+                     memcpy(&fs->inode_tab[rec.arg], data,
+                        MIN(rec.len, sizeof(fs_inode_t)));
+                     fsi_inode_hot_sync(fs, rec.arg);
+                 }
+                 break;
+             case FS_JREC_DENTRY: {
+                 fs_jdentry_t jd;
+                 fs_dentry_t page[DIR_PAGE_ENTRIES];
+                 memcpy(&jd, data, sizeof(jd));
+                 int new_page = (jd.slot & FS_JDENTRY_NEW_PAGE) != 0;
+                 jd.slot &= ~FS_JDENTRY_NEW_PAGE;
+                 if (new_page) {
+                     // página nova: o bloco no disco pode não estar inicializado
+                     memset(page, 0, sizeof(page));
+                 }
+                 // a página foi libertada mais à frente no journal: o bloco
+                 // pode já ter outro conteúdo
+                 if (rec.arg < block_num_blocks(fs->blocks) &&
+                     rp->last_clr[rec.arg] > rp->rec) {
+                     break;
+                 }
+                 if (jd.slot < DIR_PAGE_ENTRIES &&
+                     (new_page || block_read(fs->blocks, rec.arg, (char*)page) == 0)) {
+                     page[jd.slot] = jd.dentry;
+                     block_write(fs->blocks, rec.arg, (char*)page);
+                 }
+                 break;
+             }
+             case FS_JREC_REFCNT:
+                 if (rec.arg < block_num_blocks(fs->blocks) && rec.len == 1) {
+                     fsi_refs_load(fs, rec.arg);
+                     fs->blk_refs[rec.arg] = (unsigned char)data[0];
                  }
-                 
-                 // Se estava parcialmente em cache, garantir consistência
-                 if (found_in_cache) {
-                     // Adicionar esta entrada à cache existente
-                     for (int j = 0; j < DIR_PAGE_ENTRIES; j++) {
-                         if (cached_dir->entries[j].name[0] == '\0') {
-                             memcpy(&cached_dir->entries[j], &current_page[i], sizeof(fs_dentry_t));
-                             break;
-                         }
+                 break;
+             default:
+                 dprintf("[fsi_tx_apply] unknown journal record %d.\n", rec.type);
+                 break;
+         }
+         fsi_tx_ckpt_rec(fs, &rec, data);
+         off += sizeof(rec) + rec.len;
+     }
+ }
+ 
+ // Chamada pelo journal quando a transacção é durável (e antes de um
+ // checkpoint a poder largar do log): passa-a para a cópia dos metadados
+ // do checkpoint e as entradas de directório para a cache; quem fez o
+ // commit ainda detém os trincos dos inodes alterados
+ static void fsi_tx_durable(void* arg, char* buf, unsigned len)
+ {
+     fs_t* fs = (fs_t*)arg;
+     unsigned off = 0;
+ 
+     while (off + sizeof(fs_jrec_t) <= len) {
+         fs_jrec_t rec;
+         memcpy(&rec, &buf[off], sizeof(rec));
+         char* data = &buf[off + sizeof(rec)];
+         if (off + sizeof(rec) + rec.len > len) {
+             break;
+         }
+ 
+         if (rec.type == FS_JREC_DENTRY) {
+             fs_jdentry_t jd;
+             fs_dentry_t page[DIR_PAGE_ENTRIES];
+             memcpy(&jd, data, sizeof(jd));
+             int new_page = (jd.slot & FS_JDENTRY_NEW_PAGE) != 0;
+             jd.slot &= ~FS_JDENTRY_NEW_PAGE;
+             if (new_page) {
+                 memset(page, 0, sizeof(page));
+             }
+             if (jd.slot < DIR_PAGE_ENTRIES &&
+                 (new_page || cached_block_read(fs, rec.arg, (char*)page) == 0)) {
+                 page[jd.slot] = jd.dentry;
+                 cached_block_write(fs, rec.arg, (char*)page);
+ 
+                 // manter a cache de directórios coerente com a página
+                 pthread_mutex_lock(&fs->cache_mutex);
+                 for (int i = 0; i < fs->dir_cache_len; i++) {
+                     if (fs->dir_cache[i].block_num == rec.arg) {
+                         memcpy(fs->dir_cache[i].entries, page, sizeof(page));
                      }
                  }
-                 
                  pthread_mutex_unlock(&fs->cache_mutex);
-                 return 0;
              }
+         } else {
+             fsi_tx_ckpt_rec(fs, &rec, data);
          }
-         
-         pthread_mutex_unlock(&fs->cache_mutex);
-         iblock++;
+         off += sizeof(rec) + rec.len;
      }
-     
-     return -1; // Arquivo não encontrado
+ }
+ 
+ // Checkpoint: escreve no local os metadados já registados no journal
+ static void fsi_checkpoint(void* arg)
+ {
+     fs_t* fs = (fs_t*)arg;
+ 
+     pthread_mutex_lock(&fs->cache_mutex);
+     for (int i = 0; i < fs->block_cache_len; i++) {
+         if (fs->block_cache[i].dirty) {
+             write_back_cached_block(fs, &fs->block_cache[i]);
+         }
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+ 
+     // os blocos pendentes já foram libertados no journal: o checkpoint
+     // aproveita para os devolver ao alocador, se o reclaimer estiver
+     // atrasado (o bitmap escrito é a cópia do checkpoint)
+     pthread_mutex_lock(&fs->alloc_mutex);
+     while (fsi_reclaim_pending(fs, FS_RECLAIM_BATCH) > 0);
+     pthread_mutex_unlock(&fs->alloc_mutex);
+ 
+     fsi_store_fsdata(fs);
+ }
+ 
+ 
+ /*
+  * Copy-on-write block sharing
+  * - blk_refs[b] counts the owners of block 'b' besides the first one;
+  *   shared blocks are only copied when one of the owners writes them
+  */
+ 
+ static void fsi_ref_set(fs_t* fs, unsigned int block_num, unsigned char refs,
+    fs_tx_t* tx)
+ {
+     fs->blk_refs[block_num] = refs;
+     fsi_tx_log(tx, FS_JREC_REFCNT, block_num, &refs, sizeof(refs));
+ }
+ 
+ 
+ /*
+  * Log-structured writes (fs_log_start)
+  * - the blocks of the volume are divided in segments of FS_LOG_SEG_BLOCKS
+  *   blocks (8 bytes of the block bitmap); the segments with metadata
+  *   blocks and the last partial segment are not used by the log
+  * - new data blocks of the files are taken in order from the segment at
+  *   the head of the log; when it is used up the head moves to the next
+  *   free segment (or, if there is none, to the one with most free blocks)
+  * - a write to a block that already has data does not change it in
+  *   place: the block is rewritten at the head of the log (as a shared
+  *   block is copied on write) and the old one is freed through the
+  *   reclaimer, so the small overwrites and appends of all the files
+  *   become one sequential stream of block writes
+  * - the block map of each inode is the map to the current place of its
+  *   blocks; it is changed through the metadata journal, which is already
+  *   written sequentially, as are the directory pages (that are not moved)
+  * - as for new blocks, the data written to the log reaches the disk when
+  *   the block cache writes it back; the journal only orders the metadata
+  * - the layout of the volume does not change: a volume can be mounted
+  *   with the mode on or off
+  */
+ 
+ #define FS_LOG_SEG_BLOCKS 64
+ 
+ // Primeiro segmento usado pelo log (o primeiro sem metadados)
+ static unsigned int fsi_log_first_seg(fs_t* fs)
+ {
+     return (fs->data_start + FS_LOG_SEG_BLOCKS - 1) / FS_LOG_SEG_BLOCKS;
+ }
+ 
+ // Número de segmentos usados pelo log
+ static unsigned int fsi_log_num_segs(fs_t* fs)
+ {
+     unsigned int last = block_num_blocks(fs->blocks) / FS_LOG_SEG_BLOCKS;
+     unsigned int first = fsi_log_first_seg(fs);
+     return (last > first) ? last - first : 0;
+ }
+ 
+ // Blocos em uso do segmento 'seg' (os 64 bits do bitmap de uma vez)
+ static unsigned int fsi_log_seg_used(fs_t* fs, unsigned int seg)
+ {
+     unsigned long long word;
+     memcpy(&word, &fs->blk_bmap[seg * FS_LOG_SEG_BLOCKS / 8], sizeof(word));
+     return __builtin_popcountll(word);
+ }
+ 
+ // Próximo segmento da cabeça do log (chamada com 'log_mutex'): o primeiro
+ // livre a seguir ao actual ou, se não houver, o que tem mais blocos
+ // livres; o segmento a ser limpo é saltado. Devolve o segmento + 1, ou 0
+ // se nenhum segmento tem blocos livres
+ static unsigned int fsi_log_next_seg(fs_t* fs)
+ {
+     unsigned int first = fsi_log_first_seg(fs);
+     unsigned int nsegs = fsi_log_num_segs(fs);
+     unsigned int cur = (fs->log_seg != 0) ? fs->log_seg - 1 - first : nsegs - 1;
+     unsigned int best = 0, best_used = FS_LOG_SEG_BLOCKS;
+ 
+     for (unsigned int i = 1; i <= nsegs; i++) {
+         unsigned int seg = first + (cur + i) % nsegs;
+         if (seg + 1 == fs->log_cleaning) {
+             continue;
+         }
+         unsigned int used = fsi_log_seg_used(fs, seg);
+         if (used < best_used) {
+             best = seg + 1;
+             best_used = used;
+             if (used == 0) {
+                 break;
+             }
+         }
+     }
+     return best;
+ }
+ 
+ // Reserva o próximo bloco livre da cabeça do log; fora dos segmentos
+ // (volume sem segmentos, ou todos cheios) usa o alocador normal
+ static int fsi_log_alloc(fs_t* fs, unsigned int* block_num)
+ {
+     if (fsi_log_num_segs(fs) == 0) {
+         return fsi_block_alloc(fs, 0, block_num);
+     }
+     if (!fsi_counter_take(&fs->free_blocks, 1)) {
+         return 0;
+     }
+ 
+     pthread_mutex_lock(&fs->log_mutex);
+     for (;;) {
+         // outros fios também reservam blocos do segmento: procurar a partir
+         // da cabeça até ao fim do segmento
+         if (fs->log_seg != 0 && fsi_bmap_claim_free(fs->blk_bmap, fs->log_head,
+                fs->log_seg * FS_LOG_SEG_BLOCKS, block_num)) {
+             break;
+         }
+         unsigned int seg = fsi_log_next_seg(fs);
+         if (seg == 0) {
+             pthread_mutex_unlock(&fs->log_mutex);
+             __sync_fetch_and_add(&fs->free_blocks, 1);
+             return fsi_block_alloc(fs, 0, block_num);
+         }
+         fs->log_seg = seg;
+         fs->log_head = (seg - 1) * FS_LOG_SEG_BLOCKS;
+         fs->log_opened++;
+     }
+     fs->log_head = *block_num + 1;
+     fs->log_blocks++;
+     pthread_mutex_unlock(&fs->log_mutex);
+ 
+     __sync_fetch_and_sub(&fs->ag_free[*block_num / FS_AG_BLOCKS], 1);
+     return 1;
+ }
+ 
+ // Reserva um bloco de dados para o bloco 'iblock' do ficheiro: na cabeça
+ // do log, no modo de escrita em log, ou perto dos blocos do ficheiro
+ static int fsi_data_block_alloc(fs_t* fs, fs_inode_t* ifile, int iblock,
+    unsigned int* block_num)
+ {
+     if (fs->log_mode) {
+         return fsi_log_alloc(fs, block_num);
+     }
+     return fsi_block_alloc(fs, fsi_block_goal(fs, ifile, iblock), block_num);
+ }
+ 
+ // Modo de escrita em log: o bloco 'iblock' do ficheiro (que não é
+ // partilhado) passa para a cabeça do log, onde o chamador escreve o novo
+ // conteúdo; o bloco antigo mantém o conteúdo anterior e é devolvido em
+ // 'freed' para ser libertado depois do commit. Devolve 1, ou -1 se não
+ // há blocos livres
+ static int fsi_log_redirect(fs_t* fs, fs_inode_t* ifile, int iblock,
+    fs_tx_t* tx, unsigned int* freed)
+ {
+     unsigned int new_block;
+     if (!fsi_log_alloc(fs, &new_block)) {
+         return -1;
+     }
+     fsi_tx_log(tx, FS_JREC_BLK_SET, new_block, NULL, 0);
+     fsi_tx_log(tx, FS_JREC_BLK_CLR, ifile->blocks[iblock], NULL, 0);
+     *freed = ifile->blocks[iblock];
+     ifile->blocks[iblock] = new_block;
+     return 1;
+ }
+ 
+ 
+ /*
+  * Inline data
+  */
+ 
+ // Passa os dados inline do ficheiro para o seu primeiro bloco de dados
+ static int fsi_inline_spill(fs_t* fs, fs_inode_t* ifile, fs_tx_t* tx)
+ {
+     if (ifile->size > 0) {
+         unsigned int block_num;
+         if (!fsi_data_block_alloc(fs, ifile, 0, &block_num)) {
+             dprintf("[fsi_inline_spill] there are no free blocks.\n");
+             return -1;
+         }
+ 
+         char block_data[BLOCK_SIZE];
+         memset(block_data, 0, BLOCK_SIZE);
+         memcpy(block_data, ifile->idata, ifile->size);
+         cached_block_write(fs, block_num, block_data);
+         // o bloco tem de estar no disco antes de o inode deixar de ter
+         // os dados inline no journal
+         fsi_cache_flush_block(fs, block_num);
+         ifile->blocks[0] = block_num;
+         fsi_tx_log(tx, FS_JREC_BLK_SET, block_num, NULL, 0);
+     }
+     ifile->reserved[1] &= ~FS_IFLAG_INLINE;
+     memset(ifile->idata, 0, FS_INLINE_SIZE);
+     fsi_inode_hot_sync(fs, ifile - fs->inode_tab);
+     return 0;
+ }
+ 
+ 
+ /*
+  * Copy-on-write
+  */
+ 
+ // Se o bloco 'iblock' do ficheiro for partilhado com outro ficheiro, o
+ // ficheiro passa a usar um bloco novo, onde o chamador escreve o conteúdo;
+ // devolve 1 se o bloco mudou, 0 se não era partilhado, -1 se não há blocos
+ static int fsi_block_unshare(fs_t* fs, fs_inode_t* ifile, int iblock, fs_tx_t* tx)
+ {
+     unsigned int block_num = ifile->blocks[iblock];
+     int res = 0;
+ 
+     pthread_mutex_lock(&fs->alloc_mutex);
+     fsi_refs_load(fs, block_num);
+     if (fs->blk_refs[block_num] == 0 && fs->dedup_hash != NULL) {
+         // o bloco vai ser alterado no local: deixa de poder ser partilhado
+         fs->dedup_hash[block_num] = 0;
+     }
+     if (fs->blk_refs[block_num] > 0) {
+         unsigned int new_block;
+         if (fsi_data_block_alloc(fs, ifile, iblock, &new_block)) {
+             fsi_tx_log(tx, FS_JREC_BLK_SET, new_block, NULL, 0);
+             fsi_ref_set(fs, block_num, fs->blk_refs[block_num] - 1, tx);
+             dprintf("[fsi_block_unshare] shared block %d copied to %d.\n", block_num, new_block);
+             ifile->blocks[iblock] = new_block;
+             res = 1;
+         } else {
+             res = -1;
+         }
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     return res;
+ }
+ 
+ /*
+  * Block deduplication (fs_dedup_enable)
+  * - every block fully written by fs_write is hashed; if the index has a
+  *   block with the same hash and the same contents, the file shares that
+  *   block (copy-on-write, as fs_copy does) and its own block is freed
+  * - 'dedup_tab' maps a hash to the last block indexed with it and
+  *   'dedup_hash' keeps the hash of each indexed block; a block leaves the
+  *   index (dedup_hash = 0) when it is changed in place or freed, both
+  *   under 'alloc_mutex', so a stale index entry is never shared
+  */
+ 
+ // room left in the transaction for sharing a block (reference count,
+ // freed block and the inode)
+ #define FS_DEDUP_TX_ROOM (3 * sizeof(fs_jrec_t) + 1 + FS_INODE_HDR_SIZE)
+ 
+ // Hash do conteúdo de um bloco: quatro somas independentes de palavras de
+ // 64 bits (multiplicação e xorshift), para o processador as calcular em
+ // paralelo, combinadas no fim; nunca devolve 0
+ static unsigned int fsi_block_hash(char* data)
+ {
+     unsigned long long h[4] = {
+         0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+         0x165667b19e3779f9ULL, 0x27d4eb2f165667c5ULL
+     };
+     for (int i = 0; i < BLOCK_SIZE; i += 4 * sizeof(unsigned long long)) {
+         for (int l = 0; l < 4; l++) {
+             unsigned long long w;
+             memcpy(&w, &data[i + l * sizeof(w)], sizeof(w));
+             h[l] = (h[l] ^ w) * 0xff51afd7ed558ccdULL;
+             h[l] ^= h[l] >> 29;
+         }
+     }
+     unsigned long long r = h[0] ^ (h[1] * 3) ^ (h[2] * 5) ^ (h[3] * 7);
+     r ^= r >> 32;
+     return (unsigned int)r ? (unsigned int)r : 1;
+ }
+ 
+ // Escreve o bloco 'iblock' do ficheiro com o conteúdo 'data'; se já
+ // existir um bloco igual, o ficheiro passa a partilhá-lo e o bloco
+ // antigo é devolvido em 'freed' (libertado depois do commit); devolve
+ // 1 nesse caso, 0 se o bloco foi escrito na cache
+ static int fsi_block_write_dedup(fs_t* fs, fs_inode_t* ifile, int iblock,
+    char* data, fs_tx_t* tx, unsigned int* freed)
+ {
+     unsigned int block_num = ifile->blocks[iblock];
+     if (fs->dedup_tab == NULL || tx->len + FS_DEDUP_TX_ROOM > FS_TX_MAX) {
+         cached_block_write(fs, block_num, data);
+         return 0;
+     }
+     unsigned int hash = fsi_block_hash(data);
+ 
+     // 1. Procurar um bloco com o mesmo hash e comparar o conteúdo (sem
+     //    'alloc_mutex'; a comparação é confirmada em baixo)
+     pthread_mutex_lock(&fs->alloc_mutex);
+     unsigned int cand = fs->dedup_tab[hash & fs->dedup_mask];
+     int found = cand != 0 && cand != block_num && fs->dedup_hash[cand] == hash;
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     char cand_data[BLOCK_SIZE];
+     if (found) {
+         found = cached_block_read(fs, cand, cand_data) == 0 &&
+                 memcmp(cand_data, data, BLOCK_SIZE) == 0;
+     }
+ 
+     // 2. Partilhar o bloco encontrado, se continuar indexado (não foi
+     //    alterado nem libertado entretanto)
+     pthread_mutex_lock(&fs->alloc_mutex);
+     if (found) {
+         fsi_refs_load(fs, cand);
+         if (fs->dedup_hash[cand] == hash && fs->blk_refs[cand] < REFC_MAX) {
+             fsi_ref_set(fs, cand, fs->blk_refs[cand] + 1, tx);
+             fsi_tx_log(tx, FS_JREC_BLK_CLR, block_num, NULL, 0);
+             ifile->blocks[iblock] = cand;
+             *freed = block_num;
+             pthread_mutex_unlock(&fs->alloc_mutex);
+             return 1;
+         }
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+ 
+     // 3. Bloco novo: escrever e indexar
+     cached_block_write(fs, block_num, data);
+     pthread_mutex_lock(&fs->alloc_mutex);
+     fs->dedup_tab[hash & fs->dedup_mask] = block_num;
+     fs->dedup_hash[block_num] = hash;
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     return 0;
+ }
+ 
+ 
+ /*
+  * Inode locking
+  */
+ 
+ // Obtém o inode 'id' com o trinco de leitura (write == 0) ou de escrita;
+ // devolve NULL se o inode não estiver em uso
+ static fs_inode_t* fsi_inode_lock(fs_t* fs, inodeid_t id, int write)
+ {
+     if (write) {
+         pthread_rwlock_wrlock(&fs->inode_lock[id]);
+     } else {
+         pthread_rwlock_rdlock(&fs->inode_lock[id]);
+     }
+     if (!fsi_bmap_isset(fs->inode_bmap, id)) {
+         pthread_rwlock_unlock(&fs->inode_lock[id]);
+         return NULL;
+     }
+     fsi_itab_load(fs, id);
+     // inode acabado de reservar por fs_create/fs_mkdir, ainda por iniciar
+     if (fs->inode_tab[id].type != FS_DIR && fs->inode_tab[id].type != FS_FILE) {
+         pthread_rwlock_unlock(&fs->inode_lock[id]);
+         return NULL;
+     }
+     return &fs->inode_tab[id];
+ }
+ 
+ static void fsi_inode_unlock(fs_t* fs, inodeid_t id)
+ {
+     pthread_rwlock_unlock(&fs->inode_lock[id]);
+ }
+ 
+ // Seqlock dos atributos: o contador é ímpar enquanto um escritor (que
+ // detém o trinco de escrita do inode) altera o tipo ou o tamanho
+ static void fsi_inode_write_begin(fs_t* fs, inodeid_t id)
+ {
+     fs->inode_seq[id]++;
+     __sync_synchronize();
+ }
+ 
+ static void fsi_inode_write_end(fs_t* fs, inodeid_t id)
+ {
+     fsi_inode_hot_sync(fs, id);
+     __sync_synchronize();
+     fs->inode_seq[id]++;
+ }
+ 
+ // Liberta o inode 'id' (o chamador detém o trinco de escrita); o tipo
+ // volta a 0 dentro do seqlock para que, quando o inode for reservado de
+ // novo, os leitores sem trincos não vejam o ficheiro antigo
+ static void fsi_inode_release(fs_t* fs, inodeid_t id)
+ {
+     fsi_inode_write_begin(fs, id);
+     fs->inode_tab[id].type = 0;
+     fs->inode_tab[id].size = 0;
+     fsi_inode_free(fs, id);
+     fsi_inode_write_end(fs, id);
+ }
+ 
+ // Lê os atributos sem trincos: repete se um escritor estava a alterar o
+ // inode ou o alterou entretanto; um inode com o bit no bitmap mas ainda
+ // sem tipo (reservado e por iniciar) não está em uso
+ static void fsi_inode_read_attrs(fs_t* fs, inodeid_t id, int* used,
+    fs_itype_t* type, unsigned int* size)
+ {
+     unsigned int seq;
+     fsi_itab_load(fs, id);
+     do {
+         seq = fs->inode_seq[id];
+         __sync_synchronize();
+         *used = BMAP_ISSET(fs->inode_bmap, id) != 0;
+         *type = fs->inode_type[id];
+         *size = fs->inode_size[id];
+         __sync_synchronize();
+     } while ((seq & 1) || seq != fs->inode_seq[id]);
+     if (*type != FS_DIR && *type != FS_FILE) {
+         *used = 0;
+     }
+ }
+ 
+ 
+ /*
+  * Directory page scanning: a directory entry is 16 bytes, the name
+  * padded with zeros followed by the inode id, so a page is searched by
+  * comparing whole entries against a key built once from the target name.
+  * With SSE2 each entry takes a single compare; with AVX2 two entries are
+  * compared per instruction.
+  */
+ 
+ // o varrimento assume entradas de 16 bytes (um registo SSE2)
+ typedef char fsi_dentry_size_check[sizeof(fs_dentry_t) == 16 ? 1 : -1];
+ 
+ // bytes do nome numa entrada (os restantes são o número do inode)
+ #define DENTRY_NAME_MASK ((1u << FS_MAX_FNAME_SZ) - 1)
+ 
+ // Prepara a chave de procura de 'name': o nome com os zeros de
+ // preenchimento com que é guardado nas entradas
+ static void fsi_dentry_key(fs_dentry_t* key, const char* name)
+ {
+     size_t len = strlen(name);
+     memset(key, 0, sizeof(fs_dentry_t));
+     // um nome comprido demais não pode coincidir com nenhuma entrada
+     memcpy(key->name, name, (len < FS_MAX_FNAME_SZ) ? len : FS_MAX_FNAME_SZ);
+ }
+ 
+ 
+ // Devolve a posição da primeira das 'count' entradas de 'page' com o
+ // nome de 'key', ou -1 se nenhuma tiver esse nome
+ static int fsi_dentry_match(const fs_dentry_t* page, int count,
+    const fs_dentry_t* key)
+ {
+     int i = 0;
+ #if defined(__AVX2__) || defined(__SSE2__)
+     __m128i k = _mm_loadu_si128((const __m128i*)key);
+ #endif
+ #if defined(__AVX2__)
+     __m256i k2 = _mm256_broadcastsi128_si256(k);
+     for (; i + 1 < count; i += 2) {
+         __m256i e = _mm256_loadu_si256((const __m256i*)&page[i]);
+         unsigned int m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(e, k2));
+         if ((m & DENTRY_NAME_MASK) == DENTRY_NAME_MASK) {
+             return i;
+         }
+         if (((m >> 16) & DENTRY_NAME_MASK) == DENTRY_NAME_MASK) {
+             return i + 1;
+         }
+     }
+ #endif
+ #if defined(__AVX2__) || defined(__SSE2__)
+     for (; i < count; i++) {
+         __m128i e = _mm_loadu_si128((const __m128i*)&page[i]);
+         unsigned int m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(e, k));
+         if ((m & DENTRY_NAME_MASK) == DENTRY_NAME_MASK) {
+             return i;
+         }
+     }
+ #else
+     for (; i < count; i++) {
+         if (memcmp(page[i].name, key->name, FS_MAX_FNAME_SZ) == 0) {
+             return i;
+         }
+     }
+ #endif
+     return -1;
+ }
+ 
+ 
+ // Procura 'file' no directório 'dir' (o chamador detém o trinco de 'dir')
+ static int fsi_dir_search(fs_t* fs, inodeid_t dir, char* file, 
+    inodeid_t* fileid)
+ {
+     if (fs == NULL || file == NULL || fileid == NULL) {
+         dprintf("[fsi_dir_search] malformed arguments.\n");
+         return -1;
+     }
+ 
+     fs_dentry_t key;
+     fsi_dentry_key(&key, file);
+ 
+     pthread_mutex_lock(&fs->cache_mutex);
+     
+     // 1. Tentar obter da cache de diretorias
+     dir_cache_entry_t* cached_dir = NULL;
+     fs_inode_t* idir = &fs->inode_tab[dir];
+     
+     // Procurar por todas as entradas de cache deste diretório
+     for (int i = 0; i < fs->dir_cache_len; i++) {
+         if (fs->dir_cache[i].dir_num == dir) {
+             cached_dir = &fs->dir_cache[i];
+             cached_dir->last_access = time(NULL); // Atualiza LRU
+             
+             // Procurar o arquivo nas entradas em cache
+             int j = fsi_dentry_match(cached_dir->entries, DIR_PAGE_ENTRIES, &key);
+             if (j >= 0) {
+                 *fileid = cached_dir->entries[j].inodeid;
+                 pthread_mutex_unlock(&fs->cache_mutex);
+                 return 0;
+             }
+             break;
+         }
+     }
+     
+     pthread_mutex_unlock(&fs->cache_mutex);
+ 
+     // 2. Se não encontrou completo na cache, pesquisar no disco
+     fs_dentry_t page[DIR_PAGE_ENTRIES];
+     int num = idir->size / sizeof(fs_dentry_t);
+     int iblock = 0;
+     
+     while (num > 0) {
+         unsigned int block_num = idir->blocks[iblock];
+         fs_dentry_t* current_page = NULL;
+         
+         pthread_mutex_lock(&fs->cache_mutex);
+         
+         // Verificar se este bloco específico está em cache
+         int block_cached = 0;
+         for (int i = 0; i < fs->dir_cache_len; i++) {
+             if (fs->dir_cache[i].dir_num == dir && 
+                 fs->dir_cache[i].block_num == block_num) {
+                 current_page = fs->dir_cache[i].entries;
+                 fs->dir_cache[i].last_access = time(NULL);
+                 block_cached = 1;
+                 break;
+             }
+         }
+         
+         if (!block_cached) {
+             // Se o bloco não está em cache, ler do disco
+             pthread_mutex_unlock(&fs->cache_mutex);
+             if (cached_block_read(fs, block_num, (char*)page)) {
+                 dprintf("[fsi_dir_search] error reading block %d\n", block_num);
+                 return -1;
+             }
+             current_page = page;
+             
+             // Adicionar à cache (substituição LRU)
+             pthread_mutex_lock(&fs->cache_mutex);
+             int lru_index = 0;
+             time_t lru_time = fs->dir_cache[0].last_access;
+             
+             for (int i = 1; i < fs->dir_cache_len; i++) {
+                 if (fs->dir_cache[i].last_access < lru_time) {
+                     lru_index = i;
+                     lru_time = fs->dir_cache[i].last_access;
+                 }
+             }
+             
+             // Atualizar cache
+             fs->dir_cache[lru_index].dir_num = dir;
+             fs->dir_cache[lru_index].block_num = block_num;
+             memcpy(fs->dir_cache[lru_index].entries, current_page, BLOCK_SIZE);
+             fs->dir_cache[lru_index].last_access = time(NULL);
+         }
+         
+         // Procurar o arquivo no bloco atual
+         int count = (num < DIR_PAGE_ENTRIES) ? num : DIR_PAGE_ENTRIES;
+         int i = fsi_dentry_match(current_page, count, &key);
+         num -= count;
+         if (i >= 0) {
+             *fileid = current_page[i].inodeid;
+             pthread_mutex_unlock(&fs->cache_mutex);
+             return 0;
+         }
+         
+         pthread_mutex_unlock(&fs->cache_mutex);
+         iblock++;
+     }
+     
+     return -1; // Arquivo não encontrado
+ }
+ 
+ 
+ 
+ // Página de directório alterada por fsi_dir_add_entry; a entrada só vai
+ // para a página na cache quando a transacção é durável (fsi_tx_durable)
+ typedef struct {
+     unsigned int block_num;
+     int new_page;
+     int reused;    // a entrada ocupou uma posição livre
+ } fs_dir_add_t;
+ 
+ // Procura a primeira posição livre (de uma entrada removida) do
+ // directório 'idir'; devolve -1 se não a encontrar
+ static int fsi_dir_free_slot(fs_t* fs, fs_inode_t* idir, unsigned int* pos)
+ {
+     unsigned int num = idir->size / sizeof(fs_dentry_t);
+     fs_dentry_t page[DIR_PAGE_ENTRIES];
+ 
+     for (unsigned int p = 0; p < num; p += DIR_PAGE_ENTRIES) {
+         if (cached_block_read(fs, idir->blocks[p / DIR_PAGE_ENTRIES], (char*)page)) {
+             dprintf("[fsi_dir_free_slot] error reading block %d\n",
+                idir->blocks[p / DIR_PAGE_ENTRIES]);
+             return -1;
+         }
+         for (unsigned int i = 0; i < DIR_PAGE_ENTRIES && p + i < num; i++) {
+             if (page[i].name[0] == '\0') {
+                 *pos = p + i;
+                 return 0;
+             }
+         }
+     }
+     return -1;
+ }
+ 
+ // Acrescenta a entrada 'name' -> 'id' ao directório 'dir' na transacção;
+ // a página alterada fica em 'add' até fsi_dir_add_entry_end. O chamador
+ // detém o trinco de escrita de 'dir'
+ static int fsi_dir_add_entry(fs_t* fs, inodeid_t dir, char* name,
+    inodeid_t id, fs_tx_t* tx, fs_dir_add_t* add)
+ {
+     fs_inode_t* idir = &fs->inode_tab[dir];
+     unsigned int iblock = idir->size / BLOCK_SIZE;
+     fs_jdentry_t jd;
+     memset(&jd.dentry, 0, sizeof(fs_dentry_t));
+     strcpy(jd.dentry.name, name);
+     jd.dentry.inodeid = id;
+ 
+     // reuse the slot of a removed entry: the other entries keep their
+     // positions (the fs_readdir cookies); if no free slot can be read,
+     // the entry is appended
+     unsigned int pos;
+     if (idir->reserved[3] > 0 && fsi_dir_free_slot(fs, idir, &pos) == 0) {
+         add->block_num = idir->blocks[pos / DIR_PAGE_ENTRIES];
+         add->new_page = 0;
+         add->reused = 1;
+         jd.slot = pos % DIR_PAGE_ENTRIES;
+         fsi_inode_write_begin(fs, dir);
+         idir->reserved[3]--;
+         fsi_inode_write_end(fs, dir);
+         fsi_tx_log(tx, FS_JREC_DENTRY, add->block_num, &jd, sizeof(jd));
+         fsi_tx_log_inode(tx, dir, idir);
+         return 0;
+     }
+ 
+     // add a new block to the directory if necessary
+     if (idir->size % BLOCK_SIZE == 0) {
+         unsigned fblock;
+         if (iblock >= INODE_NUM_BLKS) {
+             dprintf("[fsi_dir_add_entry] directory is full.\n");
+             return -1;
+         }
+         if (!fsi_block_alloc(fs,fsi_block_goal(fs,idir,iblock),&fblock)) {
+             dprintf("[fsi_dir_add_entry] no free blocks to augment directory.\n");
+             return -1;
+         }
+         idir->blocks[iblock] = fblock;
+         fsi_tx_log(tx, FS_JREC_BLK_SET, fblock, NULL, 0);
+     }
+ 
+     // add the entry to the directory page
+     unsigned int block_num = idir->blocks[iblock];
+     jd.slot = idir->size % BLOCK_SIZE / sizeof(fs_dentry_t);
+     add->block_num = block_num;
+     add->new_page = (jd.slot == 0);
+     add->reused = 0;
+     if (jd.slot == 0) {
+         jd.slot |= FS_JDENTRY_NEW_PAGE;
+     }
+ 
+     fsi_inode_write_begin(fs, dir);
+     idir->size += sizeof(fs_dentry_t);
+     fsi_inode_write_end(fs, dir);
+     fsi_tx_log(tx, FS_JREC_DENTRY, block_num, &jd, sizeof(jd));
+     fsi_tx_log_inode(tx, dir, idir);
+     return 0;
+ }
+ 
+ // Termina fsi_dir_add_entry depois do commit: se a transacção não foi
+ // registada ('committed'), a entrada e o bloco da página nova são
+ // retirados do directório (ou a posição reutilizada volta a estar livre)
+ static void fsi_dir_add_entry_end(fs_t* fs, inodeid_t dir, fs_dir_add_t* add,
+    int committed)
+ {
+     fs_inode_t* idir = &fs->inode_tab[dir];
+ 
+     if (!committed && add->reused) {
+         fsi_inode_write_begin(fs, dir);
+         idir->reserved[3]++;
+         fsi_inode_write_end(fs, dir);
+     } else if (!committed) {
+         fsi_inode_write_begin(fs, dir);
+         idir->size -= sizeof(fs_dentry_t);
+         if (add->new_page) {
+             idir->blocks[idir->size / BLOCK_SIZE] = 0;
+             fsi_block_free(fs, add->block_num);
+         }
+         fsi_inode_write_end(fs, dir);
+     }
+ }
+ 
+ 
+ // Procura a posição da entrada 'name' no directório 'dir' (o chamador
+ // detém o trinco de 'dir')
+ static int fsi_dir_find_slot(fs_t* fs, inodeid_t dir, char* name,
+    unsigned int* pos, inodeid_t* id)
+ {
+     fs_inode_t* idir = &fs->inode_tab[dir];
+     unsigned int num = idir->size / sizeof(fs_dentry_t);
+     fs_dentry_t page[DIR_PAGE_ENTRIES], key;
+ 
+     fsi_dentry_key(&key, name);
+     for (unsigned int p = 0; p < num; p += DIR_PAGE_ENTRIES) {
+         if (cached_block_read(fs, idir->blocks[p / DIR_PAGE_ENTRIES], (char*)page)) {
+             dprintf("[fsi_dir_find_slot] error reading block %d\n",
+                idir->blocks[p / DIR_PAGE_ENTRIES]);
+             return -1;
+         }
+         int count = (num - p < DIR_PAGE_ENTRIES) ? num - p : DIR_PAGE_ENTRIES;
+         int i = fsi_dentry_match(page, count, &key);
+         if (i >= 0) {
+             *pos = p + i;
+             *id = page[i].inodeid;
+             return 0;
+         }
+     }
+     return -1;
+ }
+ 
+ // Remove a entrada na posição 'pos' do directório 'dir'. As outras
+ // entradas não mudam de posição (as posições são os cookies de
+ // fs_readdir): a entrada fica a zeros, uma posição livre que
+ // fsi_dir_add_entry reutiliza, e o directório só encolhe quando as
+ // posições do fim ficam livres. Os blocos das páginas que deixam de ser
+ // usadas são devolvidos em 'freed' (a função devolve quantos). As páginas
+ // só mudam na cache quando a transacção é durável (fsi_tx_durable); o
+ // inode de 'dir' muda já e é reposto pelo chamador se o commit falhar. O
+ // chamador detém o trinco de escrita de 'dir'
+ static int fsi_dir_remove_entry(fs_t* fs, inodeid_t dir, unsigned int pos,
+    fs_tx_t* tx, unsigned int* freed)
+ {
+     fs_inode_t* idir = &fs->inode_tab[dir];
+     unsigned int old_num = idir->size / sizeof(fs_dentry_t);
+     unsigned int num = old_num;
+     unsigned int holes = idir->reserved[3];
+     fs_dentry_t page[DIR_PAGE_ENTRIES];
+     fs_jdentry_t jd;
+ 
+     // 1. A última entrada leva consigo as posições livres que a precedem
+     //    (lidas antes de alterar o que quer que seja)
+     if (pos + 1 == num) {
+         int loaded = -1;
+         num--;
+         while (num > 0 && holes > 0) {
+             int ib = (num - 1) / DIR_PAGE_ENTRIES;
+             if (ib != loaded) {
+                 if (cached_block_read(fs, idir->blocks[ib], (char*)page)) {
+                     dprintf("[fsi_dir_remove_entry] error reading directory block.\n");
+                     return -1;
+                 }
+                 loaded = ib;
+             }
+             if (page[(num - 1) % DIR_PAGE_ENTRIES].name[0] != '\0') {
+                 break;
+             }
+             num--;
+             holes--;
+         }
+     } else {
+         holes++;
+     }
+ 
+     // 2. Limpar a posição da entrada, se a sua página continua a ser usada
+     unsigned int npages = (num + DIR_PAGE_ENTRIES - 1) / DIR_PAGE_ENTRIES;
+     if (pos / DIR_PAGE_ENTRIES < npages) {
+         jd.slot = pos % DIR_PAGE_ENTRIES;
+         memset(&jd.dentry, 0, sizeof(fs_dentry_t));
+         fsi_tx_log(tx, FS_JREC_DENTRY, idir->blocks[pos / DIR_PAGE_ENTRIES],
+            &jd, sizeof(jd));
+     }
+ 
+     // 3. Libertar as páginas que deixaram de ser usadas
+     int nfreed = 0;
+     fsi_inode_write_begin(fs, dir);
+     for (unsigned int ib = npages; ib * DIR_PAGE_ENTRIES < old_num; ib++) {
+         fsi_tx_log(tx, FS_JREC_BLK_CLR, idir->blocks[ib], NULL, 0);
+         freed[nfreed++] = idir->blocks[ib];
+         idir->blocks[ib] = 0;
+     }
+     idir->size = num * sizeof(fs_dentry_t);
+     idir->reserved[3] = holes;
+     fsi_inode_write_end(fs, dir);
+ 
+     // as páginas deste directório na cache deixaram de ser válidas
+     pthread_mutex_lock(&fs->cache_mutex);
+     for (int i = 0; i < fs->dir_cache_len; i++) {
+         if (fs->dir_cache[i].dir_num == dir) {
+             memset(&fs->dir_cache[i], 0, sizeof(dir_cache_entry_t));
+         }
+     }
+     pthread_mutex_unlock(&fs->cache_mutex);
+ 
+     fsi_tx_log_inode(tx, dir, idir);
+     return nfreed;
+ }
+ 
+ 
+ // Alterações feitas por uma escrita (ou por fs_truncate e fsi_remove),
+ // desfeitas por fsi_write_undo se a transacção falhar
+ typedef struct {
+     fs_inode_t inode;                            // o inode antes da escrita
+     unsigned int taken[2 * INODE_NUM_BLKS + 1];  // blocos reservados pela escrita
+     unsigned int ntaken;
+     unsigned int unref[INODE_NUM_BLKS];  // blocos partilhados que perderam um dono
+     unsigned int nunref;
+     unsigned int ref[INODE_NUM_BLKS];    // blocos que passaram a ser partilhados
+     unsigned int nref;
+ } fs_write_undo_t;
+ 
+ // Desfaz uma alteração cuja transacção não foi registada: repõe as
+ // referências dos blocos partilhados, liberta os blocos reservados e volta
+ // ao inode anterior (mapa de blocos, tamanho e dados inline); os dados já
+ // escritos nos blocos alterados no local não são repostos
+ static void fsi_write_undo(fs_t* fs, inodeid_t id, fs_write_undo_t* undo)
+ {
+     pthread_mutex_lock(&fs->alloc_mutex);
+     for (unsigned int i = 0; i < undo->nref; i++) {
+         fs->blk_refs[undo->ref[i]]--;
+     }
+     for (unsigned int i = 0; i < undo->nunref; i++) {
+         fs->blk_refs[undo->unref[i]]++;
+     }
+     for (unsigned int i = 0; i < undo->ntaken; i++) {
+         unsigned int block_num = undo->taken[i];
+         fsi_refs_load(fs, block_num);
+         if (fs->blk_refs[block_num] > 0) {
+             // outro ficheiro passou a partilhá-lo (deduplicação): fica seu
+             fs->blk_refs[block_num]--;
+             continue;
+         }
+         if (fs->dedup_hash != NULL) {
+             fs->dedup_hash[block_num] = 0;
+         }
+         fsi_block_free(fs, block_num);
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+ 
+     fsi_inode_write_begin(fs, id);
+     fs->inode_tab[id] = undo->inode;
+     fsi_inode_write_end(fs, id);
+ }
+ 
+ // Larga os blocos do ficheiro a partir do bloco 'first' (incluindo os
+ // reservados para lá do fim): os blocos partilhados perdem um dono
+ // (registado em 'undo'), os restantes são libertados na transacção e
+ // devolvidos em 'freed' (para o reclaimer); devolve quantos são
+ static unsigned int fsi_file_release_blocks(fs_t* fs, fs_inode_t* inode,
+    unsigned int first, unsigned int* freed, fs_tx_t* tx, fs_write_undo_t* undo)
+ {
+     unsigned int n = 0;
+ 
+     pthread_mutex_lock(&fs->alloc_mutex);
+     for (unsigned int i = first; i < INODE_NUM_BLKS; i++) {
+         unsigned int block_num = inode->blocks[i];
+         if (block_num == 0) {
+             continue;
+         }
+         fsi_refs_load(fs, block_num);
+         if (fs->blk_refs[block_num] > 0) {
+             fsi_ref_set(fs, block_num, fs->blk_refs[block_num] - 1, tx);
+             undo->unref[undo->nunref++] = block_num;
+         } else {
+             fsi_tx_log(tx, FS_JREC_BLK_CLR, block_num, NULL, 0);
+             freed[n++] = block_num;
+             if (fs->dedup_hash != NULL) {
+                 fs->dedup_hash[block_num] = 0;
+             }
+         }
+         inode->blocks[i] = 0;
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     return n;
+ }
+ 
+ 
+ /*
+  * Online defragmentation (fs_defrag_start)
+  * - a file is fragmented when its data blocks, in the order of the block
+  *   map, are not one contiguous run; the defragmenter copies the blocks
+  *   of such a file into a new contiguous run (the first one that fits,
+  *   which also packs the used space towards the start of the volume)
+  * - the file is write locked while it is moved; readers of other files
+  *   are not blocked
+  * - the new blocks are written to disk before the transaction that
+  *   switches the block map is committed, and the old blocks are freed
+  *   through the reclaimer, so a crash leaves the file in one of the two
+  *   places
+  * - files with shared (copy-on-write) blocks, inline files and
+  *   directories are not moved
+  * - the thread moves at most 'defrag_rate' blocks per second and waits
+  *   FS_DEFRAG_PERIOD seconds after a pass over the inode table that
+  *   found nothing to do
+  */
+ 
+ #define FS_DEFRAG_PERIOD 60
+ 
+ // Número de sequências contíguas dos blocos do ficheiro; 'nblocks'
+ // recebe o número de blocos
+ static unsigned int fsi_file_extents(fs_inode_t* ifile, unsigned int* nblocks)
+ {
+     unsigned int extents = 0, n = 0, prev = 0;
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (ifile->blocks[i] == 0) {
+             continue;
+         }
+         if (n++ == 0 || ifile->blocks[i] != prev + 1) {
+             extents++;
+         }
+         prev = ifile->blocks[i];
+     }
+     *nblocks = n;
+     return extents;
+ }
+ 
+ // Muda os blocos do ficheiro 'id' para uma sequência contígua, se estiver
+ // fragmentado e tiver no máximo 'max' blocos; devolve o número de blocos
+ // mudados (0 se o ficheiro ficou onde estava) ou -1 em caso de erro
+ static int fsi_defrag_file(fs_t* fs, inodeid_t id, unsigned int max)
+ {
+     fs_inode_t* ifile = fsi_inode_lock(fs, id, 1);
+     if (ifile == NULL) {
+         return 0;
+     }
+ 
+     unsigned int n;
+     if (ifile->type != FS_FILE || FS_INODE_IS_INLINE(ifile) ||
+         fsi_file_extents(ifile, &n) <= 1 || n > max) {
+         fsi_inode_unlock(fs, id);
+         return 0;
+     }
+ 
+     // 1. Os blocos partilhados ficam onde estão; os restantes saem do
+     //    índice de deduplicação para não passarem a ser partilhados
+     pthread_mutex_lock(&fs->alloc_mutex);
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (ifile->blocks[i] != 0) {
+             fsi_refs_load(fs, ifile->blocks[i]);
+             if (fs->blk_refs[ifile->blocks[i]] > 0) {
+                 pthread_mutex_unlock(&fs->alloc_mutex);
+                 fsi_inode_unlock(fs, id);
+                 return 0;
+             }
+         }
+     }
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (ifile->blocks[i] != 0 && fs->dedup_hash != NULL) {
+             fs->dedup_hash[ifile->blocks[i]] = 0;
+         }
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+ 
+     // 2. Reservar a nova sequência
+     unsigned int start;
+     if (!fsi_block_alloc_range(fs, n, fsi_block_goal(fs, ifile, 0), &start)) {
+         fsi_inode_unlock(fs, id);
+         return 0;
+     }
+ 
+     // 3. Copiar os blocos (através da cache) e escrevê-los no disco antes
+     //    de o novo mapa ficar no journal
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     unsigned int old[INODE_NUM_BLKS];
+     unsigned int blocks[INODE_NUM_BLKS];
+     char data[BLOCK_SIZE];
+     unsigned int k = 0;
+     memcpy(blocks, ifile->blocks, sizeof(blocks));
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (blocks[i] == 0) {
+             continue;
+         }
+         if (cached_block_read(fs, blocks[i], data)) {
+             dprintf("[fsi_defrag_file] error reading block %d\n", blocks[i]);
+             for (unsigned int b = start; b < start + n; b++) {
+                 fsi_block_free(fs, b);
+             }
+             fsi_inode_unlock(fs, id);
+             return -1;
+         }
+         cached_block_write(fs, start + k, data);
+         fsi_cache_flush_block(fs, start + k);
+         fsi_tx_log(&tx, FS_JREC_BLK_SET, start + k, NULL, 0);
+         fsi_tx_log(&tx, FS_JREC_BLK_CLR, blocks[i], NULL, 0);
+         old[k] = blocks[i];
+         ifile->blocks[i] = start + k++;
+     }
+     fsi_tx_log_inode(&tx, id, ifile);
+ 
+     // 4. Trocar o mapa; se a transacção falhar o ficheiro fica onde estava
+     if (fsi_tx_commit(fs, &tx) < 0) {
+         memcpy(ifile->blocks, blocks, sizeof(blocks));
+         for (unsigned int b = start; b < start + n; b++) {
+             fsi_block_free(fs, b);
+         }
+         fsi_inode_unlock(fs, id);
+         return -1;
+     }
+     fsi_inode_unlock(fs, id);
+     fsi_reclaim_add(fs, old, n);
+ 
+     __sync_fetch_and_add(&fs->defrag_files, 1);
+     __sync_fetch_and_add(&fs->defrag_blocks, n);
+     dprintf("[fsi_defrag_file] file %d moved to blocks %d-%d.\n", id, start, start + n - 1);
+     return n;
+ }
+ 
+ // Examina os inodes a partir de 'defrag_next' e muda os ficheiros
+ // fragmentados até ter mudado 'budget' blocos (um ficheiro maior do que
+ // o orçamento é mudado se for o primeiro); 'pass_done' diz se a tabela
+ // foi percorrida até ao fim; devolve o número de blocos mudados
+ static unsigned int fsi_defrag_some(fs_t* fs, unsigned int budget, int* pass_done)
+ {
+     unsigned int moved = 0;
+     *pass_done = 0;
+     while (moved < budget || (moved == 0 && budget > 0)) {
+         unsigned int id = fs->defrag_next;
+         if (id >= ITAB_SIZE) {
+             fs->defrag_next = 0;
+             *pass_done = 1;
+             break;
+         }
+         int res = fsi_defrag_file(fs, id,
+            (moved == 0) ? INODE_NUM_BLKS : budget - moved);
+         if (res > 0) {
+             moved += res;
+         }
+         fs->defrag_next = id + 1;
+     }
+     return moved;
+ }
+ 
+ // Fio desfragmentador: muda até 'defrag_rate' blocos por segundo
+ static void* fsi_defragger(void* arg)
+ {
+     fs_t* fs = (fs_t*)arg;
+     int pass_done;
+     unsigned int moved;
+     do {
+         moved = fsi_defrag_some(fs, fs->defrag_rate, &pass_done);
+     } while (!fsi_stop_wait(fs, (pass_done && moved == 0) ? FS_DEFRAG_PERIOD : 1));
+     return NULL;
+ }
+ 
+ 
+ /*
+  * Log cleaner (fs_log_start)
+  * - the victim is the segment, other than the one at the head of the
+  *   log, with the fewest blocks in use among those with blocks that can
+  *   be moved and at most FS_LOG_CLEAN_PCT % of their blocks in use
+  * - the blocks of files in the victim are copied to the head of the log
+  *   and switched in the block map as the defragmenter does (new blocks on
+  *   disk before the commit, old ones freed through the reclaimer), so
+  *   the segment becomes free for the head; directory pages, inline files
+  *   and shared blocks are not moved
+  * - the thread only cleans while fewer than FS_LOG_FREE_PCT % of the
+  *   segments are free, moving at most 'log_clean_rate' blocks per second,
+  *   and waits FS_LOG_CLEAN_PERIOD seconds when there is nothing to do
+  */
+ 
+ #define FS_LOG_CLEAN_PCT 75
+ 
+ #define FS_LOG_FREE_PCT 20
+ 
+ #define FS_LOG_CLEAN_PERIOD 5
+ 
+ // Blocos que o cleaner pode mudar para fora do segmento: os blocos não
+ // partilhados dos ficheiros que não são inline
+ static unsigned int fsi_log_movable(fs_t* fs, fs_inode_t* ifile,
+    unsigned int first, unsigned int end, unsigned char* count)
+ {
+     unsigned int n = 0;
+     if (ifile->type != FS_FILE || FS_INODE_IS_INLINE(ifile)) {
+         return 0;
+     }
+     pthread_mutex_lock(&fs->alloc_mutex);
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         unsigned int b = ifile->blocks[i];
+         if (b < first || b >= end) {
+             continue;
+         }
+         fsi_refs_load(fs, b);
+         if (fs->blk_refs[b] == 0) {
+             if (count != NULL) {
+                 count[(b - first) / FS_LOG_SEG_BLOCKS]++;
+             }
+             n++;
+         }
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     return n;
+ }
+ 
+ // Escolhe o segmento a limpar; devolve o segmento + 1, ou 0 se nenhum
+ // vale a pena
+ static unsigned int fsi_log_victim(fs_t* fs)
+ {
+     unsigned int first = fsi_log_first_seg(fs);
+     unsigned int nsegs = fsi_log_num_segs(fs);
+     unsigned char* movable = (unsigned char*)calloc(nsegs, 1);
+     if (movable == NULL) {
+         return 0;
+     }
+ 
+     // 1. Contar os blocos que podem ser mudados de cada segmento
+     for (inodeid_t id = 1; id < ITAB_SIZE; id++) {
+         fs_inode_t* ifile = fsi_inode_lock(fs, id, 0);
+         if (ifile != NULL) {
+             fsi_log_movable(fs, ifile, first * FS_LOG_SEG_BLOCKS,
+                (first + nsegs) * FS_LOG_SEG_BLOCKS, movable);
+             fsi_inode_unlock(fs, id);
+         }
+     }
+ 
+     // 2. O segmento com menos blocos em uso
+     unsigned int victim = 0;
+     unsigned int min_used = FS_LOG_SEG_BLOCKS * FS_LOG_CLEAN_PCT / 100 + 1;
+     for (unsigned int i = 0; i < nsegs; i++) {
+         unsigned int seg = first + i;
+         if (movable[i] == 0 || seg + 1 == fs->log_seg) {
+             continue;
+         }
+         unsigned int used = fsi_log_seg_used(fs, seg);
+         if (used < min_used) {
+             victim = seg + 1;
+             min_used = used;
+         }
+     }
+     free(movable);
+     return victim;
+ }
+ 
+ // Desfaz a mudança dos blocos do ficheiro: liberta os blocos novos e volta
+ // ao mapa 'blocks'
+ static void fsi_log_clean_undo(fs_t* fs, fs_inode_t* ifile, unsigned int* blocks)
+ {
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if (ifile->blocks[i] != blocks[i]) {
+             fsi_block_free(fs, ifile->blocks[i]);
+         }
+     }
+     memcpy(ifile->blocks, blocks, INODE_NUM_BLKS * sizeof(unsigned int));
+ }
+ 
+ // Muda para a cabeça do log os blocos do ficheiro 'id' que estão no
+ // segmento 'seg' (no máximo 'max'); devolve o número de blocos mudados
+ // ou -1 em caso de erro
+ static int fsi_log_clean_file(fs_t* fs, inodeid_t id, unsigned int seg,
+    unsigned int max)
+ {
+     unsigned int first = seg * FS_LOG_SEG_BLOCKS;
+     unsigned int end = first + FS_LOG_SEG_BLOCKS;
+ 
+     fs_inode_t* ifile = fsi_inode_lock(fs, id, 1);
+     if (ifile == NULL) {
+         return 0;
+     }
+     if (fsi_log_movable(fs, ifile, first, end, NULL) == 0) {
+         fsi_inode_unlock(fs, id);
+         return 0;
+     }
+ 
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     unsigned int blocks[INODE_NUM_BLKS];
+     unsigned int old[INODE_NUM_BLKS];
+     unsigned int k = 0;
+     char data[BLOCK_SIZE];
+     memcpy(blocks, ifile->blocks, sizeof(blocks));
+     for (int i = 0; i < INODE_NUM_BLKS && k < max; i++) {
+         unsigned int b = blocks[i];
+         if (b < first || b >= end) {
+             continue;
+         }
+ 
+         // 1. Os blocos partilhados ficam; os outros saem do índice de
+         //    deduplicação
+         pthread_mutex_lock(&fs->alloc_mutex);
+         fsi_refs_load(fs, b);
+         int shared = fs->blk_refs[b] > 0;
+         if (!shared && fs->dedup_hash != NULL) {
+             fs->dedup_hash[b] = 0;
+         }
+         pthread_mutex_unlock(&fs->alloc_mutex);
+         if (shared) {
+             continue;
+         }
+ 
+         // 2. Copiar o bloco para a cabeça do log e escrevê-lo no disco
+         //    antes de o novo mapa ficar no journal
+         unsigned int new_block;
+         if (cached_block_read(fs, b, data) || !fsi_log_alloc(fs, &new_block)) {
+             dprintf("[fsi_log_clean_file] cannot move block %d\n", b);
+             fsi_log_clean_undo(fs, ifile, blocks);
+             fsi_inode_unlock(fs, id);
+             return -1;
+         }
+         cached_block_write(fs, new_block, data);
+         fsi_cache_flush_block(fs, new_block);
+         fsi_tx_log(&tx, FS_JREC_BLK_SET, new_block, NULL, 0);
+         fsi_tx_log(&tx, FS_JREC_BLK_CLR, b, NULL, 0);
+         ifile->blocks[i] = new_block;
+         old[k++] = b;
+     }
+     if (k == 0) {
+         fsi_inode_unlock(fs, id);
+         return 0;
+     }
+     fsi_tx_log_inode(&tx, id, ifile);
+ 
+     // 3. Trocar o mapa; se a transacção falhar o ficheiro fica onde estava
+     if (fsi_tx_commit(fs, &tx) < 0) {
+         fsi_log_clean_undo(fs, ifile, blocks);
+         fsi_inode_unlock(fs, id);
+         return -1;
+     }
+     fsi_inode_unlock(fs, id);
+     fsi_reclaim_add(fs, old, k);
+     return k;
+ }
+ 
+ // Limpa segmentos até ter mudado 'budget' blocos (0: sem limite); sem
+ // 'all' só limpa enquanto houver poucos segmentos livres; devolve o
+ // número de blocos mudados ou -1 em caso de erro
+ static int fsi_log_clean_some(fs_t* fs, unsigned int budget, int all)
+ {
+     unsigned int first = fsi_log_first_seg(fs);
+     unsigned int nsegs = fsi_log_num_segs(fs);
+     unsigned int moved = 0;
+ 
+     while (budget == 0 || moved < budget) {
+         if (!all) {
+             unsigned int free_segs = 0;
+             for (unsigned int seg = first; seg < first + nsegs; seg++) {
+                 free_segs += (fsi_log_seg_used(fs, seg) == 0) ? 1 : 0;
+             }
+             if (free_segs * 100 >= nsegs * FS_LOG_FREE_PCT) {
+                 break;
+             }
+         }
+         unsigned int victim = fsi_log_victim(fs);
+         if (victim == 0) {
+             break;
+         }
+ 
+         // a cabeça do log não passa para o segmento enquanto é limpo
+         fs->log_cleaning = victim;
+         unsigned int seg_moved = 0;
+         for (inodeid_t id = 1; id < ITAB_SIZE; id++) {
+             int res = fsi_log_clean_file(fs, id, victim - 1,
+                (budget == 0) ? INODE_NUM_BLKS : budget - moved - seg_moved);
+             if (res < 0) {
+                 fs->log_cleaning = 0;
+                 return -1;
+             }
+             seg_moved += res;
+             if (budget != 0 && moved + seg_moved >= budget) {
+                 break;
+             }
+         }
+         fs->log_cleaning = 0;
+ 
+         // os blocos antigos são libertados já, para o segmento contar
+         // como livre na próxima escolha
+         pthread_mutex_lock(&fs->alloc_mutex);
+         while (fsi_reclaim_pending(fs, FS_RECLAIM_BATCH) > 0);
+         pthread_mutex_unlock(&fs->alloc_mutex);
+ 
+         if (seg_moved == 0) {
+             break;
+         }
+         if (fsi_log_seg_used(fs, victim - 1) == 0) {
+             __sync_fetch_and_add(&fs->log_cleaned, 1);
+         }
+         __sync_fetch_and_add(&fs->log_moved, seg_moved);
+         moved += seg_moved;
+     }
+     return moved;
+ }
+ 
+ // Fio cleaner: limpa até 'log_clean_rate' blocos por segundo
+ static void* fsi_log_cleaner(void* arg)
+ {
+     fs_t* fs = (fs_t*)arg;
+     int moved;
+     do {
+         moved = fsi_log_clean_some(fs, fs->log_clean_rate, 0);
+     } while (!fsi_stop_wait(fs, (moved <= 0) ? FS_LOG_CLEAN_PERIOD : 1));
+     return NULL;
+ }
+ 
+ 
+ /*
+  * File system interface functions
+  */
+ 
+ 
+ void io_delay_on(int disk_delay);
+ 
+ // Cria a estrutura do sistema de ficheiros sobre o dispositivo 'blocks'
+ // (que é libertado em caso de erro); os metadados não são lidos
+ static fs_t* fsi_new(blocks_t* blocks, int disk_delay)
+ {
+     if (!blocks) {
+         printf("[fs_new] Error creating block device\n");
+         return NULL;
+     }
+     if (block_size(blocks) != BLOCK_SIZE) {
+         printf("[fs_new] Block size of the device is not %d\n", BLOCK_SIZE);
+         block_free(blocks);
+         return NULL;
+     }
+ 
+     io_delay_on(disk_delay);
+     
+     fs_t* fs = (fs_t*)malloc(sizeof(fs_t));
+     if (!fs) {
+         printf("[fs_new] Error allocating filesystem structure\n");
+         block_free(blocks);
+         return NULL;
+     }
+ 
+     // Inicializa o mutex
+     if (pthread_mutex_init(&fs->cache_mutex, NULL) != 0) {
+         printf("[fs_new] Error initializing cache mutex\n");
+         block_free(blocks);
+         free(fs);
+         return NULL;
+     }
+ 
+     // Dispositivo de blocos
+     fs->blocks = blocks;
+     unsigned num_blocks = block_num_blocks(blocks);
+ 
+     // As caches recebem o orçamento por omissão depois do journal
+     fs->block_cache = NULL;
+     fs->dir_cache = NULL;
+     fs->block_cache_len = fs->dir_cache_len = 0;
+     fs->cache_wb_seq = 0;
+ 
+     // Organização do volume: superbloco, bitmap de blocos, bitmap de
+     // inodes, tabela de inodes, journal, tabela de referências
+     fs->bmap_num_blks = OFFSET_TO_BLOCKS((num_blocks + 7) / 8);
+     fs->refc_num_blks = OFFSET_TO_BLOCKS(num_blocks);
+     fs->ibmap_start = BMAP_START + fs->bmap_num_blks;
+     fs->itab_start = fs->ibmap_start + 1;
+     fs->jrnl_start = fs->itab_start + ITAB_NUM_BLKS;
+     fs->refc_start = fs->jrnl_start + JRNL_NUM_BLKS;
+     fs->data_start = fs->refc_start + fs->refc_num_blks;
+     if (fs->data_start >= num_blocks) {
+         printf("[fs_new] Volume too small\n");
+         block_free(fs->blocks);
+         pthread_mutex_destroy(&fs->cache_mutex);
+         free(fs);
+         return NULL;
+     }
+ 
+     fs->ag_count = (num_blocks + FS_AG_BLOCKS - 1) / FS_AG_BLOCKS;
+     fs->ag_dir_next = 0;
+     fs->blk_bmap = (char*)calloc(fs->bmap_num_blks, BLOCK_SIZE);
+     fs->blk_refs = (unsigned char*)calloc(fs->refc_num_blks, BLOCK_SIZE);
+     fs->ckpt_blk_bmap = (char*)calloc(fs->bmap_num_blks, BLOCK_SIZE);
+     fs->ckpt_blk_refs = (unsigned char*)calloc(fs->refc_num_blks, BLOCK_SIZE);
+     fs->refc_loaded = (unsigned char*)calloc(fs->refc_num_blks, 1);
+     fs->ag_free = (unsigned int*)calloc(fs->ag_count, sizeof(unsigned int));
+     if (!fs->blk_bmap || !fs->blk_refs || !fs->ckpt_blk_bmap ||
+         !fs->ckpt_blk_refs || !fs->refc_loaded || !fs->ag_free) {
+         printf("[fs_new] Error allocating block bitmap and reference counts\n");
+         free(fs->blk_bmap);
+         free(fs->blk_refs);
+         free(fs->ckpt_blk_bmap);
+         free(fs->ckpt_blk_refs);
+         free((void*)fs->refc_loaded);
+         free((void*)fs->ag_free);
+         block_free(fs->blocks);
+         pthread_mutex_destroy(&fs->cache_mutex);
+         free(fs);
+         return NULL;
+     }
+ 
+     // Inicializa o journal dos metadados
+     fs->journal = journal_new(fs->blocks, fs->jrnl_start, JRNL_NUM_BLKS,
+        fsi_checkpoint, fsi_tx_durable, fs);
+     if (!fs->journal) {
+         printf("[fs_new] Error creating metadata journal\n");
+         free(fs->blk_bmap);
+         free(fs->blk_refs);
+         free(fs->ckpt_blk_bmap);
+         free(fs->ckpt_blk_refs);
+         free((void*)fs->refc_loaded);
+         free((void*)fs->ag_free);
+         block_free(fs->blocks);
+         pthread_mutex_destroy(&fs->cache_mutex);
+         free(fs);
+         return NULL;
+     }
+ 
+     // Inicializa caches
+     if (fsi_cache_resize(fs, FS_CACHE_BUDGET, FS_CACHE_META_PCT) < 0) {
+         printf("[fs_new] Error allocating the caches\n");
+         free(fs->block_cache);
+         free(fs->dir_cache);
+         journal_free(fs->journal);
+         free(fs->blk_bmap);
+         free(fs->blk_refs);
+         free(fs->ckpt_blk_bmap);
+         free(fs->ckpt_blk_refs);
+         free((void*)fs->refc_loaded);
+         free((void*)fs->ag_free);
+         block_free(fs->blocks);
+         pthread_mutex_destroy(&fs->cache_mutex);
+         free(fs);
+         return NULL;
+     }
+ 
+     // Inicializa os trincos dos inodes e do alocador
+     pthread_mutex_init(&fs->alloc_mutex, NULL);
+     pthread_mutex_init(&fs->load_mutex, NULL);
+     pthread_mutex_init(&fs->warm_mutex, NULL);
+     fs->warm_path = NULL;
+     fs->warm_period = 0;
+     fs->defrag_rate = 0;
+     fs->defrag_next = 0;
+     fs->defrag_files = fs->defrag_blocks = 0;
+     pthread_mutex_init(&fs->log_mutex, NULL);
+     fs->log_mode = 0;
+     fs->log_seg = fs->log_head = fs->log_cleaning = 0;
+     fs->log_clean_rate = 0;
+     fs->log_blocks = fs->log_opened = fs->log_cleaned = fs->log_moved = 0;
+     fs->stopping = 0;
+     pthread_mutex_init(&fs->stop_mutex, NULL);
+     pthread_cond_init(&fs->stop_cond, NULL);
+     for (int i = 0; i < ITAB_SIZE; i++) {
+         pthread_rwlock_init(&fs->inode_lock[i], NULL);
+         fs->inode_seq[i] = 0;
+     }
+     memset((char*)fs->itab_loaded, 0, ITAB_NUM_BLKS);
+ 
+     // Inicializa a fila de blocos a libertar e o fio reclaimer
+     fs->reclaim_q = NULL;
+     fs->dedup_tab = fs->dedup_hash = NULL;
+     fs->dedup_mask = 0;
+     fs->reclaim_len = fs->reclaim_cap = 0;
+     pthread_mutex_init(&fs->reclaim_mutex, NULL);
+     pthread_cond_init(&fs->reclaim_cond, NULL);
+     if (pthread_create(&fs->reclaimer, NULL, fsi_reclaimer, fs) != 0) {
+         printf("[fs_new] Error creating the reclaimer thread\n");
+         exit(-1);
+     }
+     
+     return fs;
  }
  
  
- /*
-  * File system interface functions
-  */
- 
+ fs_t* fs_new(unsigned num_blocks, int disk_delay)
+ {
+     return fsi_new(block_new(num_blocks, BLOCK_SIZE), disk_delay);
+ }
  
- void io_delay_on(int disk_delay);
  
- fs_t* fs_new(unsigned num_blocks, int disk_delay)
+ fs_t* fs_open(char* image, unsigned num_blocks, int disk_delay)
  {
-     io_delay_on(disk_delay);
-     
-     fs_t* fs = (fs_t*)malloc(sizeof(fs_t));
-     if (!fs) {
-         printf("[fs_new] Error allocating filesystem structure\n");
+     if (image == NULL) {
+         printf("[fs_open] malformed arguments.\n");
          return NULL;
      }
+     return fsi_new(block_open(image, num_blocks, BLOCK_SIZE), disk_delay);
+ }
  
-     // Inicializa o mutex
-     if (pthread_mutex_init(&fs->cache_mutex, NULL) != 0) {
-         printf("[fs_new] Error initializing cache mutex\n");
-         free(fs);
-         return NULL;
-     }
  
-     // Inicializa o dispositivo de blocos
-     fs->blocks = block_new(num_blocks, BLOCK_SIZE);
-     if (!fs->blocks) {
-         printf("[fs_new] Error creating block device\n");
-         pthread_mutex_destroy(&fs->cache_mutex);
-         free(fs);
+ fs_t* fs_open_tiered(char* image, unsigned num_blocks, unsigned ram_blocks,
+    int disk_delay)
+ {
+     if (image == NULL || ram_blocks == 0) {
+         printf("[fs_open_tiered] malformed arguments.\n");
          return NULL;
      }
+     return fsi_new(block_open_tiered(image, num_blocks, BLOCK_SIZE, ram_blocks),
+        disk_delay);
+ }
  
-     // Inicializa caches
-     memset(fs->block_cache, 0, sizeof(fs->block_cache));
-     memset(fs->inode_cache, 0, sizeof(fs->inode_cache));
-     memset(fs->dir_cache, 0, sizeof(fs->dir_cache));
  
-     // Carrega metadados
-     fsi_load_fsdata(fs);
-     
-     return fs;
+ int fs_mount(fs_t* fs)
+ {
+    if (fs == NULL) {
+       printf("[fs] argument is null.\n");
+       return -1;
+    }
+ 
+    // validate the superblock against the layout of this device
+    char block[BLOCK_SIZE];
+    fs_super_t* sb = (fs_super_t*)block;
+    if (block_read(fs->blocks,SUPER_BLK,block) < 0) {
+       printf("[fs_mount] error reading the superblock.\n");
+       return -1;
+    }
+    if (sb->magic != FS_MAGIC || sb->version != FS_VERSION) {
+       printf("[fs_mount] the volume is not formatted.\n");
+       return -1;
+    }
+    if (sb->block_size != BLOCK_SIZE ||
+        sb->num_blocks != block_num_blocks(fs->blocks) ||
+        sb->itab_num_blks != ITAB_NUM_BLKS ||
+        sb->jrnl_num_blks != JRNL_NUM_BLKS ||
+        sb->data_start != fs->data_start) {
+       printf("[fs_mount] the layout of the volume is not supported.\n");
+       return -1;
+    }
+ 
+    // load the bitmaps (the tables are read on demand) and replay the
+    // transactions committed after the last checkpoint; a first pass finds
+    // the directory pages freed later in the journal
+    fsi_load_fsdata(fs);
+    fs_replay_t rp;
+    rp.fs = fs;
+    rp.rec = 0;
+    rp.last_clr = (unsigned int*)calloc(block_num_blocks(fs->blocks),sizeof(unsigned int));
+    if (rp.last_clr == NULL) {
+       printf("[fs_mount] error allocating the journal replay state.\n");
+       return -1;
+    }
+    int replayed = journal_replay(fs->journal,fsi_tx_scan,&rp);
+    if (replayed > 0) {
+       rp.rec = 0;
+       replayed = journal_replay(fs->journal,fsi_tx_apply,&rp);
+    }
+    free(rp.last_clr);
+    if (replayed < 0) {
+       printf("[fs_mount] the journal is corrupted.\n");
+       return -1;
+    }
+    if (replayed > 0) {
+       journal_checkpoint(fs->journal);
+    }
+    fsi_count_free(fs);
+    return 0;
  }
  
  
@@ -479,68 +3189,134 @@
        return -1;
     }
  
-    // erase all blocks
+    // invalidate the old superblock; only the metadata blocks are
+    // written, the contents of the data blocks are undefined until they
+    // are allocated (allocation always initializes the whole block)
     char null_block[BLOCK_SIZE];
     memset(null_block,0,sizeof(null_block));
-    for (int i = 0; i < block_num_blocks(fs->blocks); i++) {
-       block_write(fs->blocks,i,null_block);
+    if (block_write(fs->blocks,SUPER_BLK,null_block) < 0 ||
+        block_sync(fs->blocks) < 0) {
+       printf("[fs_format] error writing the superblock.\n");
+       return -1;
     }
  
-    // reserve file system meta data blocks
-    BMAP_SET(fs->blk_bmap,0);
-    BMAP_SET(fs->blk_bmap,1);
-    for (int i = 0; i < ITAB_NUM_BLKS; i++) {
-       BMAP_SET(fs->blk_bmap,i+2);
+    // forget the cached blocks of the previous file system
+    pthread_mutex_lock(&fs->cache_mutex);
+    memset(fs->block_cache,0,fs->block_cache_len*sizeof(block_cache_entry_t));
+    memset(fs->dir_cache,0,fs->dir_cache_len*sizeof(dir_cache_entry_t));
+    pthread_mutex_unlock(&fs->cache_mutex);
+ 
+    // reserve file system meta data blocks (superblock, bitmaps, inode
+    // table, journal and reference counts)
+    memset(fs->blk_bmap,0,fs->bmap_num_blks*BLOCK_SIZE);
+    for (int i = 0; i < fs->data_start; i++) {
+       BMAP_SET(fs->blk_bmap,i);
+    }
+    memset(fs->blk_refs,0,fs->refc_num_blks*BLOCK_SIZE);
+    memset((char*)fs->refc_loaded,1,fs->refc_num_blks);
+    if (fs->dedup_tab != NULL) {
+       memset(fs->dedup_tab,0,(fs->dedup_mask+1)*sizeof(unsigned int));
+       memset(fs->dedup_hash,0,block_num_blocks(fs->blocks)*sizeof(unsigned int));
     }
+    pthread_mutex_lock(&fs->reclaim_mutex);
+    fs->reclaim_len = 0;
+    pthread_mutex_unlock(&fs->reclaim_mutex);
  
     // reserve inodes 0 (will never be used) and 1 (the root)
+    memset(fs->inode_bmap,0,sizeof(fs->inode_bmap));
+    memset(fs->inode_tab,0,sizeof(fs->inode_tab));
+    memset((char*)fs->itab_loaded,1,ITAB_NUM_BLKS);
     BMAP_SET(fs->inode_bmap,0);
     BMAP_SET(fs->inode_bmap,1);
     fsi_inode_init(&fs->inode_tab[1],FS_DIR);
- 
-    // save the file system metadata
+    memset(fs->inode_type,0,sizeof(fs->inode_type));
+    memset(fs->inode_flags,0,sizeof(fs->inode_flags));
+    memset(fs->inode_size,0,sizeof(fs->inode_size));
+    fsi_inode_hot_sync(fs,1);
+    fsi_count_free(fs);
+ 
+    // save the file system metadata and start with an empty journal
+    memcpy(fs->ckpt_blk_bmap,fs->blk_bmap,fs->bmap_num_blks*BLOCK_SIZE);
+    memcpy(fs->ckpt_blk_refs,fs->blk_refs,fs->refc_num_blks*BLOCK_SIZE);
+    memcpy(fs->ckpt_inode_bmap,fs->inode_bmap,BLOCK_SIZE);
+    memcpy(fs->ckpt_inode_tab,fs->inode_tab,sizeof(fs->inode_tab));
     fsi_store_fsdata(fs);
+    if (journal_format(fs->journal) < 0) {
+       printf("[fs_format] error formatting the journal.\n");
+       return -1;
+    }
+ 
+    // the superblock is written last, once the rest is on disk: an
+    // interrupted format is not mounted
+    if (block_sync(fs->blocks) < 0) {
+       printf("[fs_format] error writing the file system metadata.\n");
+       return -1;
+    }
+    fs_super_t* sb = (fs_super_t*)null_block;
+    sb->magic = FS_MAGIC;
+    sb->version = FS_VERSION;
+    sb->block_size = BLOCK_SIZE;
+    sb->num_blocks = block_num_blocks(fs->blocks);
+    sb->itab_num_blks = ITAB_NUM_BLKS;
+    sb->jrnl_num_blks = JRNL_NUM_BLKS;
+    sb->data_start = fs->data_start;
+    if (block_write(fs->blocks,SUPER_BLK,null_block) < 0 ||
+        block_sync(fs->blocks) < 0) {
+       printf("[fs_format] error writing the superblock.\n");
+       return -1;
+    }
     return 0;
  }
  
- /* Funções auxiliares para fs_get_attrs */
- // Encontra um inode na cache
- static inode_cache_entry_t* find_inode_in_cache(fs_t* fs, inodeid_t inode_num) {
-     for (int i = 0; i < INODE_CACHE_SIZE; i++) {
-         if (fs->inode_cache[i].inode_num == inode_num) {
-             return &fs->inode_cache[i];
-         }
-     }
-     return NULL;
+ 
+ int fs_sync(fs_t* fs)
+ {
+    if (fs == NULL) {
+       printf("[fs] argument is null.\n");
+       return -1;
+    }
+ 
+    // checkpoint writes the dirty cached blocks and the in-place metadata
+    if (journal_checkpoint(fs->journal) < 0 || block_sync(fs->blocks) < 0) {
+       printf("[fs_sync] error writing the file system.\n");
+       return -1;
+    }
+    return 0;
  }
  
- // Adiciona um inode à cache usando política LRU
- static void add_inode_to_cache(fs_t* fs, inodeid_t inode_num, fs_inode_t* inode, int dirty) {
-     // Encontrar entrada LRU
-     int lru_index = 0;
-     time_t lru_time = fs->inode_cache[0].last_access;
-     
-     for (int i = 1; i < INODE_CACHE_SIZE; i++) {
-         if (fs->inode_cache[i].last_access < lru_time) {
-             lru_index = i;
-             lru_time = fs->inode_cache[i].last_access;
-         }
+ int fs_stop(fs_t* fs)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_stop] malformed arguments.\n");
+         return -1;
      }
-     
-     // Se a entrada LRU estiver dirty, escrever de volta
-     if (fs->inode_cache[lru_index].dirty) {
-         fs->inode_tab[fs->inode_cache[lru_index].inode_num] = fs->inode_cache[lru_index].inode;
-         // Nota: Não chamamos fsi_store_fsdata() aqui para evitar escrita desnecessária
+ 
+     pthread_mutex_lock(&fs->stop_mutex);
+     if (fs->stopping) {
+         pthread_mutex_unlock(&fs->stop_mutex);
+         return 0;
      }
-     
-     // Adicionar novo inode à cache
-     fs->inode_cache[lru_index].inode_num = inode_num;
-     fs->inode_cache[lru_index].inode = *inode;
-     fs->inode_cache[lru_index].dirty = dirty;
-     fs->inode_cache[lru_index].last_access = time(NULL);
+     fs->stopping = 1;
+     pthread_cond_broadcast(&fs->stop_cond);
+     pthread_mutex_unlock(&fs->stop_mutex);
+     pthread_mutex_lock(&fs->reclaim_mutex);
+     pthread_cond_broadcast(&fs->reclaim_cond);
+     pthread_mutex_unlock(&fs->reclaim_mutex);
+ 
+     // esperar pelos fios que foram criados
+     pthread_join(fs->reclaimer, NULL);
+     if (fs->warm_path != NULL) {
+         pthread_join(fs->warmer, NULL);
+     }
+     if (fs->defrag_rate > 0) {
+         pthread_join(fs->defragger, NULL);
+     }
+     if (fs->log_mode && fs->log_clean_rate > 0) {
+         pthread_join(fs->log_cleaner, NULL);
+     }
+     return 0;
  }
  
- 
  int fs_get_attrs(fs_t* fs, inodeid_t file, fs_file_attrs_t* attrs)
  {
      if (fs == NULL || file >= ITAB_SIZE || attrs == NULL) {
@@ -548,48 +3324,42 @@
          return -1;
      }
  
-     pthread_mutex_lock(&fs->cache_mutex);
-     
-     // 1. Tentar obter da cache de inodes
-     inode_cache_entry_t* cached_inode = find_inode_in_cache(fs, file);
-     fs_inode_t* inode = NULL;
-     
-     if (cached_inode) {
-         // Encontrado na cache - atualizar LRU
-         cached_inode->last_access = time(NULL);
-         inode = &cached_inode->inode;
-     } else {
-         // Não está na cache - verificar bitmap e obter da tabela principal
-         if (!BMAP_ISSET(fs->inode_bmap, file)) {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_get_attrs] inode is not being used.\n");
-             return -1;
-         }
-         inode = &fs->inode_tab[file];
-         
-         // Adicionar à cache (não dirty pois só estamos lendo)
-         add_inode_to_cache(fs, file, inode, 0);
+     // 1. Ler os atributos sem trincos (seqlock)
+     int used;
+     fs_itype_t type;
+     unsigned int size;
+     fsi_inode_read_attrs(fs, file, &used, &type, &size);
+ 
+     if (!used) {
+         dprintf("[fs_get_attrs] inode is not being used.\n");
+         return -1;
      }
      
      // 2. Preencher a estrutura de atributos
      attrs->inodeid = file;
-     attrs->type = inode->type;
-     attrs->size = inode->size;
+     attrs->type = type;
+     attrs->size = size;
      
-     switch (inode->type) {
-         case FS_DIR:
-             attrs->num_entries = inode->size / sizeof(fs_dentry_t);
+     switch (type) {
+         case FS_DIR: {
+             // as posições livres do directório não são entradas
+             fs_inode_t* idir = fsi_inode_lock(fs, file, 0);
+             if (idir == NULL) {
+                 dprintf("[fs_get_attrs] inode is not being used.\n");
+                 return -1;
+             }
+             attrs->num_entries = idir->size / sizeof(fs_dentry_t) - idir->reserved[3];
+             fsi_inode_unlock(fs, file);
              break;
+         }
          case FS_FILE:
              attrs->num_entries = -1;
              break;
          default:
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_get_attrs] fatal error - invalid inode.\n");
-             exit(-1);
+             dprintf("[fs_get_attrs] invalid inode.\n");
+             return -1;
      }
      
-     pthread_mutex_unlock(&fs->cache_mutex);
      return 0;
  }
  
@@ -620,17 +3390,20 @@
       i++;
       if(i==1) dir=1;  //Root directory
       
-      if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+      fs_inode_t* idir = fsi_inode_lock(fs,dir,0);
+      if (idir == NULL) {
           dprintf("[fs_lookup] inode is not being used.\n");
           return -1;
       }
-      fs_inode_t* idir = &fs->inode_tab[dir];
       if (idir->type != FS_DIR) {
+         fsi_inode_unlock(fs,dir);
          dprintf("[fs_lookup] inode is not a directory.\n");
          return -1;
       }
       inodeid_t fid;
-      if (fsi_dir_search(fs,dir,token,&fid) < 0) {
+      int res = fsi_dir_search(fs,dir,token,&fid);
+      fsi_inode_unlock(fs,dir);
+      if (res < 0) {
          dprintf("[fs_lookup] file does not exist.\n");
          return 0;
       }
@@ -650,40 +3423,37 @@
          return -1;
      }
  
-     // Verificar cache de inodes primeiro
-     pthread_mutex_lock(&fs->cache_mutex);
-     fs_inode_t* ifile = NULL;
-     inode_cache_entry_t* cached_inode = find_inode_in_cache(fs, file);
-     
-     if (cached_inode) {
-         ifile = &cached_inode->inode;
-         cached_inode->last_access = time(NULL); // Atualiza LRU
-     } else {
-         // Se não estiver na cache, buscar da tabela de inodes
-         if (!BMAP_ISSET(fs->inode_bmap, file)) {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_read] inode is not being used.\n");
-             return -1;
-         }
-         ifile = &fs->inode_tab[file];
-         
-         // Adicionar inode à cache
-         add_inode_to_cache(fs, file, ifile, 0);
+     // Obter o inode (trinco de leitura: leituras concorrentes do mesmo
+     // ficheiro decorrem em paralelo)
+     fs_inode_t* ifile = fsi_inode_lock(fs, file, 0);
+     if (ifile == NULL) {
+         dprintf("[fs_read] inode is not being used.\n");
+         return -1;
      }
-     pthread_mutex_unlock(&fs->cache_mutex);
  
      if (ifile->type != FS_FILE) {
+         fsi_inode_unlock(fs, file);
          dprintf("[fs_read] inode is not a file.\n");
          return -1;
      }
  
      if (offset >= ifile->size) {
+         fsi_inode_unlock(fs, file);
          *nread = 0;
          return 0;
      }
      
      // Calcular quantidade máxima que pode ser lida
      int max = MIN(count, ifile->size - offset);
+     
+     // Ficheiro pequeno: os dados estão no próprio inode
+     if (FS_INODE_IS_INLINE(ifile)) {
+         memcpy(buffer, &ifile->idata[offset], max);
+         fsi_inode_unlock(fs, file);
+         *nread = max;
+         return 0;
+     }
+     
      int pos = 0;
      int iblock = offset / BLOCK_SIZE;
      int blks_used = OFFSET_TO_BLOCKS(ifile->size);
@@ -694,45 +3464,38 @@
              block_num = ifile->blocks[iblock];
          } else {
              // Lidar com blocos indiretos (se implementado)
-             pthread_mutex_unlock(&fs->cache_mutex);
+             fsi_inode_unlock(fs, file);
              dprintf("[fs_read] indirect blocks not supported.\n");
              return -1;
          }
  
+         int start = (pos == 0) ? (offset % BLOCK_SIZE) : 0;
+         int num = MIN(BLOCK_SIZE - start, max - pos);
+ 
+         // Buraco: o bloco nunca foi escrito e é lido como zeros, sem I/O
+         if (block_num == 0) {
+             memset(&buffer[pos], 0, num);
+             pos += num;
+             iblock++;
+             continue;
+         }
+ 
+         // Obter o bloco (da cache ou do disco)
          char block_data[BLOCK_SIZE];
-         
-         // Tentar obter da cache de blocos
-         pthread_mutex_lock(&fs->cache_mutex);
-         block_cache_entry_t* cached_block = find_block_in_cache(fs, block_num);
-         
-         if (cached_block) {
-             memcpy(block_data, cached_block->data, BLOCK_SIZE);
-             cached_block->last_access = time(NULL); // Atualiza LRU
-             pthread_mutex_unlock(&fs->cache_mutex);
-         } else {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             
-             // Se não estiver na cache, ler do disco
-             if (block_read(fs->blocks, block_num, block_data)) {
-                 dprintf("[fs_read] error reading block %d\n", block_num);
-                 return -1;
-             }
-             
-             // Adicionar à cache (apenas leitura, não dirty)
-             pthread_mutex_lock(&fs->cache_mutex);
-             add_block_to_cache(fs, block_num, block_data, 0);
-             pthread_mutex_unlock(&fs->cache_mutex);
+         if (cached_block_read(fs, block_num, block_data)) {
+             fsi_inode_unlock(fs, file);
+             dprintf("[fs_read] error reading block %d\n", block_num);
+             return -1;
          }
  
          // Copiar dados para o buffer do usuário
-         int start = (pos == 0) ? (offset % BLOCK_SIZE) : 0;
-         int num = MIN(BLOCK_SIZE - start, max - pos);
          memcpy(&buffer[pos], &block_data[start], num);
          
          pos += num;
          iblock++;
      }
      
+     fsi_inode_unlock(fs, file);
      *nread = pos;
      return 0;
  }
@@ -745,145 +3508,230 @@
          dprintf("[fs_write] malformed arguments.\n");
          return -1;
      }
+     // o intervalo é validado antes de qualquer acesso aos dados (inline
+     // ou em blocos): 'offset' vem do cliente e a soma pode dar a volta
+     if (offset + count < offset || offset + count > INODE_NUM_BLKS * BLOCK_SIZE) {
+         dprintf("[fs_write] no free block entries in inode.\n");
+         return -1;
+     }
  
-     // 1. Verificar e obter o inode (usando cache)
-     pthread_mutex_lock(&fs->cache_mutex);
-     fs_inode_t* ifile = NULL;
-     inode_cache_entry_t* cached_inode = find_inode_in_cache(fs, file);
-     
-     if (cached_inode) {
-         ifile = &cached_inode->inode;
-         cached_inode->last_access = time(NULL); // Atualiza LRU
-     } else {
-         if (!BMAP_ISSET(fs->inode_bmap, file)) {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_write] inode is not being used.\n");
-             return -1;
-         }
-         ifile = &fs->inode_tab[file];
-         add_inode_to_cache(fs, file, ifile, 0); // Adiciona à cache
+     // 1. Obter o inode (trinco de escrita)
+     fs_inode_t* ifile = fsi_inode_lock(fs, file, 1);
+     if (ifile == NULL) {
+         dprintf("[fs_write] inode is not being used.\n");
+         return -1;
      }
      
      if (ifile->type != FS_FILE) {
-         pthread_mutex_unlock(&fs->cache_mutex);
+         fsi_inode_unlock(fs, file);
          dprintf("[fs_write] inode is not a file.\n");
          return -1;
      }
  
-     if (offset > ifile->size) {
-         offset = ifile->size;
+     // Uma escrita para lá do fim deixa um buraco entre o fim antigo e
+     // 'offset', que é lido como zeros
+     if (count == 0) {
+         fsi_inode_unlock(fs, file);
+         return 0;
+     }
+ 
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     fs_write_undo_t undo;
+     undo.inode = *ifile;
+     undo.ntaken = undo.nunref = undo.nref = 0;
+ 
+     // 1.1 Ficheiro pequeno: os dados ficam no próprio inode enquanto couberem
+     if (FS_INODE_IS_INLINE(ifile)) {
+         if (offset + count <= FS_INLINE_SIZE) {
+             memcpy(&ifile->idata[offset], buffer, count);
+             if (offset + count > ifile->size) {
+                 fsi_inode_write_begin(fs, file);
+                 ifile->size = offset + count;
+                 fsi_inode_write_end(fs, file);
+             }
+             fsi_tx_log_inode(&tx, file, ifile);
+             int res = fsi_tx_commit(fs, &tx);
+             if (res < 0) {
+                 fsi_write_undo(fs, file, &undo);
+             }
+             fsi_inode_unlock(fs, file);
+             return res;
+         }
+         // 1.2 Os dados inline passam para um bloco (desfeito por
+         //     fsi_write_undo se a escrita falhar)
+         if (fsi_inline_spill(fs, ifile, &tx) < 0) {
+             fsi_inode_unlock(fs, file);
+             return -1;
+         }
+         if (ifile->blocks[0] != 0) {
+             undo.taken[undo.ntaken++] = ifile->blocks[0];
+         }
      }
  
-     // 2. Calcular blocos necessários
+     // 2. Calcular os blocos tocados pela escrita; os blocos entre o fim
+     //    antigo e 'offset' que não são tocados ficam por alocar (buracos)
      int blks_used = OFFSET_TO_BLOCKS(ifile->size);
-     int blks_req = MAX(OFFSET_TO_BLOCKS(offset + count), blks_used) - blks_used;
+     int first = offset / BLOCK_SIZE;
+     int last = OFFSET_TO_BLOCKS(offset + count);
      
-     dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, breq=%d\n",
-         count, offset, ifile->size, blks_used, blks_req);
+     dprintf("[fs_write] count=%d, offset=%d, fsize=%d, bused=%d, blocks=[%d,%d[\n",
+         count, offset, ifile->size, blks_used, first, last);
      
-     // 3. Alocar novos blocos se necessário
-     if (blks_req > 0) {
-         if (blks_req > INODE_NUM_BLKS - blks_used) {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_write] no free block entries in inode.\n");
-             return -1;
+     // 3. Alocar os blocos tocados que ainda não existem (os já reservados
+     //    por fs_fallocate são aproveitados)
+     unsigned int fresh = 0;
+     for (int i = first; i < last; i++) {
+         unsigned int block_num;
+         
+         if (ifile->blocks[i] != 0) {
+             continue;
          }
- 
-         dprintf("[fs_write] required %d blocks, used %d\n", blks_req, blks_used);
- 
-         // Alocar e reservar novos blocos
-         for (int i = blks_used; i < blks_used + blks_req; i++) {
-             unsigned int block_num;
-             
-             if (!fsi_bmap_find_free(fs->blk_bmap, block_num_blocks(fs->blocks), &block_num)) {
-                 pthread_mutex_unlock(&fs->cache_mutex);
-                 dprintf("[fs_write] there are no free blocks.\n");
-                 return -1;
-             }
-             
-             BMAP_SET(fs->blk_bmap, block_num);
-             ifile->blocks[i] = block_num;
-             dprintf("[fs_write] block %d allocated.\n", block_num);
-             
-             // Adicionar novo bloco à cache (vazio)
-             char empty_block[BLOCK_SIZE] = {0};
-             add_block_to_cache(fs, block_num, empty_block, 1); // Já marca como dirty
+         if (!fsi_data_block_alloc(fs, ifile, i, &block_num)) {
+             // Devolver os blocos reservados por esta escrita
+             fsi_write_undo(fs, file, &undo);
+             fsi_inode_unlock(fs, file);
+             dprintf("[fs_write] there are no free blocks.\n");
+             return -1;
          }
          
-         // Marcar inode como modificado
-         if (cached_inode) {
-             cached_inode->dirty = 1;
-         } else {
-             // Se não estava na cache, atualizar na tabela principal
-             fs->inode_tab[file] = *ifile;
+         ifile->blocks[i] = block_num;
+         undo.taken[undo.ntaken++] = block_num;
+         fresh |= 1u << i;
+         fsi_tx_log(&tx, FS_JREC_BLK_SET, block_num, NULL, 0);
+         dprintf("[fs_write] block %d allocated.\n", block_num);
+     }
+     
+     // Os blocos pré-reservados que ficam entre o fim antigo e a escrita
+     // passam a estar dentro do ficheiro: não foram inicializados no disco
+     char empty_block[BLOCK_SIZE] = {0};
+     for (int i = blks_used; i < first; i++) {
+         if (ifile->blocks[i] != 0) {
+             cached_block_write(fs, ifile->blocks[i], empty_block);
          }
      }
      
-     pthread_mutex_unlock(&fs->cache_mutex);
- 
      // 4. Escrever os dados nos blocos (usando cache)
      int num = 0;
-     int iblock = offset / BLOCK_SIZE;
+     int iblock = first;
+     int cowed = 0;
+     unsigned int copied = 0;
+     unsigned int freed[2 * INODE_NUM_BLKS];
+     unsigned int nfreed = 0;
      
      while (num < count) {
          unsigned int block_num = ifile->blocks[iblock];
          char block_data[BLOCK_SIZE];
+         int start = (num == 0) ? (offset % BLOCK_SIZE) : 0;
+         int to_write = MIN(BLOCK_SIZE - start, count - num);
          
-         // 4.1 Obter o bloco (da cache ou disco)
-         pthread_mutex_lock(&fs->cache_mutex);
-         block_cache_entry_t* cached_block = find_block_in_cache(fs, block_num);
+         // 4.1 Copy-on-write: o bloco é partilhado com outro ficheiro (o
+         //     conteúdo antigo continua em 'block_num')
+         int cow = fsi_block_unshare(fs, ifile, iblock, &tx);
+         if (cow < 0) {
+             fsi_write_undo(fs, file, &undo);
+             fsi_inode_unlock(fs, file);
+             dprintf("[fs_write] there are no free blocks.\n");
+             return -1;
+         }
+         if (cow) {
+             undo.unref[undo.nunref++] = block_num;
+             undo.taken[undo.ntaken++] = ifile->blocks[iblock];
+             copied |= 1u << iblock;
+         }
          
-         if (cached_block) {
-             memcpy(block_data, cached_block->data, BLOCK_SIZE);
-         } else {
-             // Se não está na cache, ler do disco
-             pthread_mutex_unlock(&fs->cache_mutex);
-             if (block_read(fs->blocks, block_num, block_data)) {
-                 dprintf("[fs_write] error reading block %d\n", block_num);
+         // 4.1.1 Escrita em log: um bloco que já tinha dados do ficheiro
+         //       é reescrito na cabeça do log (o antigo é libertado depois
+         //       do commit)
+         if (cow == 0 && fs->log_mode && iblock < blks_used &&
+             !(fresh & (1u << iblock))) {
+             cow = fsi_log_redirect(fs, ifile, iblock, &tx, &freed[nfreed]);
+             if (cow < 0) {
+                 fsi_write_undo(fs, file, &undo);
+                 fsi_inode_unlock(fs, file);
+                 dprintf("[fs_write] there are no free blocks.\n");
                  return -1;
              }
-             pthread_mutex_lock(&fs->cache_mutex);
+             undo.taken[undo.ntaken++] = ifile->blocks[iblock];
+             copied |= 1u << iblock;
+             nfreed++;
          }
+         cowed |= cow;
          
-         // 4.2 Modificar o bloco
-         int start = (num == 0) ? (offset % BLOCK_SIZE) : 0;
-         int to_write = MIN(BLOCK_SIZE - start, count - num);
+         // 4.2 Obter o conteúdo antigo do bloco, só quando é preciso; o
+         //     bloco é escrito na cache a partir de 'from'
+         unsigned int from = 0;
+         if (start == 0 && to_write == BLOCK_SIZE) {
+             // escrito por inteiro: o conteúdo antigo não interessa
+         } else if ((fresh & (1u << iblock)) || iblock >= blks_used) {
+             // bloco novo ou para lá do fim antigo: começa vazio
+             memset(block_data, 0, BLOCK_SIZE);
+         } else if (!cow && iblock == ifile->size / BLOCK_SIZE &&
+                    start >= ifile->size % BLOCK_SIZE) {
+             // acréscimo ao último bloco: depois do fim só há zeros e os
+             // bytes anteriores só são lidos do disco se vierem a ser precisos
+             from = ifile->size % BLOCK_SIZE;
+             memset(&block_data[from], 0, BLOCK_SIZE - from);
+         } else if (cached_block_read(fs, block_num, block_data)) {
+             fsi_write_undo(fs, file, &undo);
+             fsi_inode_unlock(fs, file);
+             dprintf("[fs_write] error reading block %d\n", block_num);
+             return -1;
+         }
          
+         // 4.3 Modificar o bloco
          memcpy(&block_data[start], &buffer[num], to_write);
          num += to_write;
-         iblock++;
          
-         // 4.3 Atualizar cache (marcar como dirty)
-         if (cached_block) {
-             memcpy(cached_block->data, block_data, BLOCK_SIZE);
-             cached_block->dirty = 1;
-             cached_block->last_access = time(NULL);
+         // 4.4 Atualizar cache (marcar como dirty); um bloco completo
+         //     igual a outro já existente passa a partilhá-lo
+         if (from == 0) {
+             if (fsi_block_write_dedup(fs, ifile, iblock, block_data, &tx, &freed[nfreed])) {
+                 undo.ref[undo.nref++] = ifile->blocks[iblock];
+                 nfreed++;
+             }
          } else {
-             add_block_to_cache(fs, block_num, block_data, 1);
+             cached_block_write_from(fs, ifile->blocks[iblock], block_data, from);
          }
-         
-         pthread_mutex_unlock(&fs->cache_mutex);
+         iblock++;
      }
  
      // 5. Atualizar tamanho do arquivo se necessário
      if (offset + count > ifile->size) {
-         pthread_mutex_lock(&fs->cache_mutex);
-         
+         fsi_inode_write_begin(fs, file);
          ifile->size = offset + count;
-         
-         // Marcar inode como modificado
-         if (cached_inode) {
-             cached_inode->dirty = 1;
-         } else {
-             fs->inode_tab[file] = *ifile;
-             // Adicionar à cache agora que foi modificado
-             add_inode_to_cache(fs, file, ifile, 1);
+         fsi_inode_write_end(fs, file);
+         fsi_tx_log_inode(&tx, file, ifile);
+     } else if (cowed || fresh || nfreed) {
+         // O mapa de blocos mudou (copy-on-write, um buraco preenchido ou
+         // blocos deduplicados)
+         fsi_tx_log_inode(&tx, file, ifile);
+     }
+ 
+     // 6. Modo ordenado: os blocos que passam a fazer parte do ficheiro vão
+     //    para o disco antes de o mapa que aponta para eles ficar no
+     //    journal (senão, depois de uma falha, o ficheiro mostraria o que
+     //    estava antes nesses blocos)
+     unsigned int ordered = fresh | copied;
+     for (int i = blks_used; i < last; i++) {
+         ordered |= 1u << i;
+     }
+     for (int i = 0; i < INODE_NUM_BLKS; i++) {
+         if ((ordered & (1u << i)) && ifile->blocks[i] != 0) {
+             fsi_cache_flush_block(fs, ifile->blocks[i]);
          }
-         
-         pthread_mutex_unlock(&fs->cache_mutex);
+     }
+ 
+     // 7. Registar a extensão do ficheiro no journal
+     if (fsi_tx_commit(fs, &tx) < 0) {
+         fsi_write_undo(fs, file, &undo);
+         fsi_inode_unlock(fs, file);
+         return -1;
      }
  
      dprintf("[fs_write] written %d bytes, file size %d.\n", count, ifile->size);
+     fsi_inode_unlock(fs, file);
+     fsi_reclaim_add(fs, freed, nfreed);
      return 0;
  }
  
@@ -900,55 +3748,66 @@
        return -1;
     }
  
-    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+    fs_inode_t* idir = fsi_inode_lock(fs,dir,1);
+    if (idir == NULL) {
        dprintf("[fs_create] inode is not being used.\n");
        return -1;
     }
  
-    fs_inode_t* idir = &fs->inode_tab[dir];
     if (idir->type != FS_DIR) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_create] inode is not a directory.\n");
        return -1;
     }
  
     if (fsi_dir_search(fs,dir,file,fileid) == 0) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_create] file already exists.\n");
        return -1;
     }
     
-    // check if there are free inodes
+    // reserve a free inode
     unsigned finode;
-    if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
+    if (!fsi_inode_alloc(fs,dir,&finode)) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_create] there are no free inodes.\n");
        return -1;
     }
  
-    // add a new block to the directory if necessary
-    if (idir->size % BLOCK_SIZE == 0) {
-       unsigned fblock;
-       if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-          dprintf("[fs_create] no free blocks to augment directory.\n");
-          return -1;
-       }
-       BMAP_SET(fs->blk_bmap,fblock);
-       idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-    }
- 
-    // add the entry to the directory
-    fs_dentry_t page[DIR_PAGE_ENTRIES];
-    block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-    fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-    strcpy(entry->name,file);
-    entry->inodeid = finode;
-    block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-    idir->size += sizeof(fs_dentry_t);
- 
-    // reserve and init the new file inode
-    BMAP_SET(fs->inode_bmap,finode);
+    // init the new file inode
+    fs_tx_t tx;
+    fsi_tx_init(&tx);
+    pthread_rwlock_wrlock(&fs->inode_lock[finode]);
+    fsi_itab_load(fs,finode);
+    fsi_inode_write_begin(fs,finode);
     fsi_inode_init(&fs->inode_tab[finode],FS_FILE);
+    // os blocos do ficheiro ficam no grupo do directório
+    fs->inode_tab[finode].reserved[2] = fsi_dir_group(idir);
+    fsi_inode_write_end(fs,finode);
  
-    // save the file system metadata
-    fsi_store_fsdata(fs);
+    // add the entry to the directory
+    fs_dir_add_t add;
+    if (fsi_dir_add_entry(fs,dir,file,finode,&tx,&add) < 0) {
+       fsi_inode_release(fs,finode);
+       fsi_inode_unlock(fs,finode);
+       fsi_inode_unlock(fs,dir);
+       return -1;
+    }
+    fsi_tx_log(&tx,FS_JREC_INO_SET,finode,NULL,0);
+    fsi_tx_log_inode(&tx,finode,&fs->inode_tab[finode]);
+ 
+    // save the file system metadata; the directory page is only cached
+    // once the entry is in the journal
+    int res = fsi_tx_commit(fs,&tx);
+    fsi_dir_add_entry_end(fs,dir,&add,res == 0);
+    if (res < 0) {
+       fsi_inode_release(fs,finode);
+    }
+    fsi_inode_unlock(fs,finode);
+    fsi_inode_unlock(fs,dir);
+    if (res < 0) {
+       return -1;
+    }
  
     *fileid = finode;
     return 0;
@@ -967,121 +3826,123 @@
        return -1;
     }
  
-    if (!BMAP_ISSET(fs->inode_bmap,dir)) {
+    fs_inode_t* idir = fsi_inode_lock(fs,dir,1);
+    if (idir == NULL) {
        dprintf("[fs_mkdir] inode is not being used.\n");
        return -1;
     }
  
-    fs_inode_t* idir = &fs->inode_tab[dir];
     if (idir->type != FS_DIR) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_mkdir] inode is not a directory.\n");
        return -1;
     }
  
     if (fsi_dir_search(fs,dir,newdir,newdirid) == 0) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_mkdir] directory already exists.\n");
        return -1;
     }
     
-       // check if there are free inodes
+       // reserve a free inode
     unsigned finode;
-    if (!fsi_bmap_find_free(fs->inode_bmap,ITAB_SIZE,&finode)) {
+    if (!fsi_inode_alloc(fs,dir,&finode)) {
+       fsi_inode_unlock(fs,dir);
        dprintf("[fs_mkdir] there are no free inodes.\n");
        return -1;
     }
  
-       // add a new block to the directory if necessary
-    if (idir->size % BLOCK_SIZE == 0) {
-       unsigned fblock;
-       if (!fsi_bmap_find_free(fs->blk_bmap,block_num_blocks(fs->blocks),&fblock)) {
-          dprintf("[fs_mkdir] no free blocks to augment directory.\n");
-          return -1;
-       }
-       BMAP_SET(fs->blk_bmap,fblock);
-       idir->blocks[idir->size / BLOCK_SIZE] = fblock;
-    }
- 
-       // add the entry to the directory
-    fs_dentry_t page[DIR_PAGE_ENTRIES];
-    block_read(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-    fs_dentry_t* entry = &page[idir->size % BLOCK_SIZE / sizeof(fs_dentry_t)];
-    strcpy(entry->name,newdir);
-    entry->inodeid = finode;
-    block_write(fs->blocks,idir->blocks[idir->size/BLOCK_SIZE],(char*)page);
-    idir->size += sizeof(fs_dentry_t);
- 
-       // reserve and init the new file inode
-    BMAP_SET(fs->inode_bmap,finode);
+       // init the new directory inode
+    fs_tx_t tx;
+    fsi_tx_init(&tx);
+    pthread_rwlock_wrlock(&fs->inode_lock[finode]);
+    fsi_itab_load(fs,finode);
+    fsi_inode_write_begin(fs,finode);
     fsi_inode_init(&fs->inode_tab[finode],FS_DIR);
+    // os directórios espalham-se pelos grupos com espaço livre
+    fs->inode_tab[finode].reserved[2] = fsi_ag_pick_dir(fs) + 1;
+    fsi_inode_write_end(fs,finode);
  
-       // save the file system metadata
-    fsi_store_fsdata(fs);
+       // add the entry to the directory
+    fs_dir_add_t add;
+    if (fsi_dir_add_entry(fs,dir,newdir,finode,&tx,&add) < 0) {
+       fsi_inode_release(fs,finode);
+       fsi_inode_unlock(fs,finode);
+       fsi_inode_unlock(fs,dir);
+       return -1;
+    }
+    fsi_tx_log(&tx,FS_JREC_INO_SET,finode,NULL,0);
+    fsi_tx_log_inode(&tx,finode,&fs->inode_tab[finode]);
+ 
+       // save the file system metadata; the directory page is only cached
+       // once the entry is in the journal
+    int res = fsi_tx_commit(fs,&tx);
+    fsi_dir_add_entry_end(fs,dir,&add,res == 0);
+    if (res < 0) {
+       fsi_inode_release(fs,finode);
+    }
+    fsi_inode_unlock(fs,finode);
+    fsi_inode_unlock(fs,dir);
+    if (res < 0) {
+       return -1;
+    }
  
     *newdirid = finode;
     return 0;
  }
  
  
- int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
-    int* numentries)
+ int fs_readdir(fs_t* fs, inodeid_t dir, unsigned* cookie,
+    fs_file_name_t* entries, int maxentries, int* numentries)
  {
-     if (fs == NULL || dir >= ITAB_SIZE || entries == NULL ||
+     if (fs == NULL || dir >= ITAB_SIZE || cookie == NULL || entries == NULL ||
          numentries == NULL || maxentries < 0) {
          dprintf("[fs_readdir] malformed arguments.\n");
          return -1;
      }
  
-     pthread_mutex_lock(&fs->cache_mutex);
-     
-     // 1. Verificar cache de inodes primeiro
-     fs_inode_t* idir = NULL;
-     inode_cache_entry_t* cached_inode = find_inode_in_cache(fs, dir);
-     
-     if (cached_inode) {
-         idir = &cached_inode->inode;
-         cached_inode->last_access = time(NULL); // Atualiza LRU
-     } else {
-         if (!BMAP_ISSET(fs->inode_bmap, dir)) {
-             pthread_mutex_unlock(&fs->cache_mutex);
-             dprintf("[fs_readdir] inode is not being used.\n");
-             return -1;
-         }
-         idir = &fs->inode_tab[dir];
-         add_inode_to_cache(fs, dir, idir, 0); // Adiciona à cache
+     // 1. Obter o inode do diretório (trinco de leitura)
+     fs_inode_t* idir = fsi_inode_lock(fs, dir, 0);
+     if (idir == NULL) {
+         dprintf("[fs_readdir] inode is not being used.\n");
+         return -1;
      }
  
      if (idir->type != FS_DIR) {
-         pthread_mutex_unlock(&fs->cache_mutex);
+         fsi_inode_unlock(fs, dir);
          dprintf("[fs_readdir] inode is not a directory.\n");
          return -1;
      }
  
-     // 2. Preencher as entradas com o conteúdo do diretório
-     int num = MIN(idir->size / sizeof(fs_dentry_t), maxentries);
-     int iblock = 0, ientry = 0;
+     // 2. Preencher as entradas a partir da posição 'cookie' (a página e a
+     //    entrada são calculadas directamente, sem reler as anteriores)
+     unsigned int total = idir->size / sizeof(fs_dentry_t);
+     unsigned int pos = MIN(*cookie, total);
+     int iblock = pos / DIR_PAGE_ENTRIES, ientry = 0;
+     int slot = pos % DIR_PAGE_ENTRIES;
      
-     while (num > 0) {
+     while (pos < total && ientry < maxentries) {
          unsigned int block_num = idir->blocks[iblock];
          fs_dentry_t page[DIR_PAGE_ENTRIES];
          int use_cache = 0;
          
          // 3. Verificar se o bloco do diretório está em cache
-         dir_cache_entry_t* cached_dir_block = NULL;
-         for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+         pthread_mutex_lock(&fs->cache_mutex);
+         for (int i = 0; i < fs->dir_cache_len; i++) {
              if (fs->dir_cache[i].dir_num == dir && 
                  fs->dir_cache[i].block_num == block_num) {
-                 cached_dir_block = &fs->dir_cache[i];
-                 cached_dir_block->last_access = time(NULL);
-                 memcpy(page, cached_dir_block->entries, sizeof(page));
+                 fs->dir_cache[i].last_access = time(NULL);
+                 memcpy(page, fs->dir_cache[i].entries, sizeof(page));
                  use_cache = 1;
                  break;
              }
          }
+         pthread_mutex_unlock(&fs->cache_mutex);
          
          if (!use_cache) {
              // Se não está em cache, ler do disco
-             pthread_mutex_unlock(&fs->cache_mutex);
-             if (block_read(fs->blocks, block_num, (char*)page)) {
+             if (cached_block_read(fs, block_num, (char*)page)) {
+                 fsi_inode_unlock(fs, dir);
                  dprintf("[fs_readdir] error reading block %d\n", block_num);
                  return -1;
              }
@@ -1091,7 +3952,7 @@
              int lru_index = 0;
              time_t lru_time = fs->dir_cache[0].last_access;
              
-             for (int i = 1; i < DIR_CACHE_SIZE; i++) {
+             for (int i = 1; i < fs->dir_cache_len; i++) {
                  if (fs->dir_cache[i].last_access < lru_time) {
                      lru_index = i;
                      lru_time = fs->dir_cache[i].last_access;
@@ -1103,33 +3964,39 @@
              fs->dir_cache[lru_index].block_num = block_num;
              memcpy(fs->dir_cache[lru_index].entries, page, sizeof(page));
              fs->dir_cache[lru_index].last_access = time(NULL);
+             pthread_mutex_unlock(&fs->cache_mutex);
          }
          
-         // 4. Processar as entradas do bloco atual
-         for (int i = 0; i < DIR_PAGE_ENTRIES && num > 0; i++, num--) {
+         // 4. Processar as entradas do bloco atual (as posições livres,
+         //    de entradas removidas, são saltadas)
+         for (int i = slot; i < DIR_PAGE_ENTRIES && pos < total &&
+              ientry < maxentries; i++, pos++) {
+             if (page[i].name[0] == '\0') {
+                 continue;
+             }
              strcpy(entries[ientry].name, page[i].name);
+             entries[ientry].inodeid = page[i].inodeid;
              
-             // Verificar cache de inodes para o tipo
-             inode_cache_entry_t* entry_inode = find_inode_in_cache(fs, page[i].inodeid);
-             if (entry_inode) {
-                 entries[ientry].type = entry_inode->inode.type;
-                 entry_inode->last_access = time(NULL);
-             } else {
-                 // Se não está em cache, verificar tabela principal
-                 if (page[i].inodeid < ITAB_SIZE && BMAP_ISSET(fs->inode_bmap, page[i].inodeid)) {
-                     entries[ientry].type = fs->inode_tab[page[i].inodeid].type;
-                 } else {
-                     entries[ientry].type = FS_UNKNOWN;
-                 }
+             // Atributos lidos com o seqlock: não é preciso o trinco do inode
+             int used = 0;
+             if (page[i].inodeid < ITAB_SIZE) {
+                 fsi_inode_read_attrs(fs, page[i].inodeid, &used,
+                    &entries[ientry].type, &entries[ientry].size);
+             }
+             if (!used) {
+                 entries[ientry].type = FS_UNKNOWN;
+                 entries[ientry].size = 0;
              }
              
              ientry++;
          }
          
+         slot = 0;
          iblock++;
      }
      
-     pthread_mutex_unlock(&fs->cache_mutex);
+     fsi_inode_unlock(fs, dir);
+     *cookie = (pos >= total) ? FS_READDIR_END : pos;
      *numentries = ientry;
      return 0;
  }
@@ -1163,15 +4030,20 @@
          return -1;
      }
  
-     char target_dir[FS_MAX_FNAME_SZ];
+     char target_dir[MAX_PATH_NAME_SIZE];
      char target_name[FS_MAX_FNAME_SZ];
+     if (last_slash - tgtpath >= MAX_PATH_NAME_SIZE ||
+         strlen(last_slash + 1) >= FS_MAX_FNAME_SZ) {
+         dprintf("[fs_copy] invalid target path.\n");
+         return -1;
+     }
      strncpy(target_dir, tgtpath, last_slash - tgtpath);
      target_dir[last_slash - tgtpath] = '\0';
      strcpy(target_name, last_slash + 1);
  
-     // 3. Localizar o diretório de destino
-     inodeid_t dir_inode;
-     if (fs_lookup(fs, target_dir, &dir_inode) <= 0) {
+     // 3. Localizar o diretório de destino (a raiz se o caminho for "/nome")
+     inodeid_t dir_inode = 1;
+     if (target_dir[0] != '\0' && fs_lookup(fs, target_dir, &dir_inode) <= 0) {
          dprintf("[fs_copy] target directory not found.\n");
          return -1;
      }
@@ -1183,101 +4055,697 @@
          return -1;
      }
  
-     pthread_mutex_lock(&fs->cache_mutex);
- 
-     // 5. Obter inodes (usando cache)
+     // 5. Obter os inodes (por ordem crescente do número, para evitar deadlocks)
      fs_inode_t* src_ifile = NULL;
      fs_inode_t* new_ifile = NULL;
-     
-     // Obter inode de origem (da cache ou tabela principal)
-     inode_cache_entry_t* cached_src = find_inode_in_cache(fs, src_inode);
-     if (cached_src) {
-         src_ifile = &cached_src->inode;
-         cached_src->last_access = time(NULL);
-     } else {
-         src_ifile = &fs->inode_tab[src_inode];
-         add_inode_to_cache(fs, src_inode, src_ifile, 0);
+     if (src_inode < new_inode) {
+         src_ifile = fsi_inode_lock(fs, src_inode, 0);
+         new_ifile = fsi_inode_lock(fs, new_inode, 1);
+     } else if (src_inode > new_inode) {
+         new_ifile = fsi_inode_lock(fs, new_inode, 1);
+         src_ifile = fsi_inode_lock(fs, src_inode, 0);
      }
- 
-     // Obter inode de destino (da cache ou tabela principal)
-     inode_cache_entry_t* cached_new = find_inode_in_cache(fs, new_inode);
-     if (cached_new) {
-         new_ifile = &cached_new->inode;
-         cached_new->last_access = time(NULL);
-     } else {
-         new_ifile = &fs->inode_tab[new_inode];
-         add_inode_to_cache(fs, new_inode, new_ifile, 1); // Marcar como dirty
+     if (src_ifile == NULL || new_ifile == NULL) {
+         if (src_ifile) fsi_inode_unlock(fs, src_inode);
+         if (new_ifile) fsi_inode_unlock(fs, new_inode);
+         fs_unlink(fs, dir_inode, target_name);
+         dprintf("[fs_copy] source file was removed.\n");
+         return -1;
      }
  
-     // 6. Copiar os blocos (usando cache)
-     int blks_used = OFFSET_TO_BLOCKS(src_ifile->size);
+     // 6. Partilhar os blocos da origem (copy-on-write); os dados inline
+     //    são simplesmente copiados com o inode. As referências e os
+     //    blocos ganhos ficam em 'undo', para o caso de a cópia falhar
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     fs_write_undo_t undo;
+     undo.inode = *new_ifile;
+     undo.ntaken = undo.nunref = undo.nref = 0;
+     int res = 0;
+     new_ifile->reserved[1] = src_ifile->reserved[1];
+     memcpy(new_ifile->idata, src_ifile->idata, FS_INLINE_SIZE);
+     int blks_used = FS_INODE_IS_INLINE(src_ifile) ? 0 : OFFSET_TO_BLOCKS(src_ifile->size);
      for (int i = 0; i < blks_used; i++) {
          unsigned int src_block = src_ifile->blocks[i];
          unsigned int new_block;
+ 
+         // Os buracos da origem continuam buracos na cópia
+         if (src_block == 0) {
+             continue;
+         }
+ 
+         pthread_mutex_lock(&fs->alloc_mutex);
+         fsi_refs_load(fs, src_block);
+         if (fs->blk_refs[src_block] < REFC_MAX) {
+             fsi_ref_set(fs, src_block, fs->blk_refs[src_block] + 1, &tx);
+             pthread_mutex_unlock(&fs->alloc_mutex);
+             undo.ref[undo.nref++] = src_block;
+             new_ifile->blocks[i] = src_block;
+             continue;
+         }
          
-         // Alocar novo bloco
-         if (!fsi_bmap_find_free(fs->blk_bmap, block_num_blocks(fs->blocks), &new_block)) {
-             pthread_mutex_unlock(&fs->cache_mutex);
+         // Contador de referências saturado: alocar novo bloco e copiar
+         int found = fsi_data_block_alloc(fs, new_ifile, i, &new_block);
+         pthread_mutex_unlock(&fs->alloc_mutex);
+         if (!found) {
              dprintf("[fs_copy] no free blocks available.\n");
-             return -1;
+             res = -1;
+             break;
          }
-         BMAP_SET(fs->blk_bmap, new_block);
+         undo.taken[undo.ntaken++] = new_block;
          new_ifile->blocks[i] = new_block;
+         fsi_tx_log(&tx, FS_JREC_BLK_SET, new_block, NULL, 0);
  
-         // Copiar dados do bloco
+         // Copiar dados do bloco (via cache)
          char block_data[BLOCK_SIZE];
-         
-         // Tentar obter bloco de origem da cache
-         block_cache_entry_t* cached_block = find_block_in_cache(fs, src_block);
-         if (cached_block) {
-             memcpy(block_data, cached_block->data, BLOCK_SIZE);
-             cached_block->last_access = time(NULL);
-         } else {
-             // Se não está na cache, ler do disco
-             pthread_mutex_unlock(&fs->cache_mutex);
-             if (block_read(fs->blocks, src_block, block_data)) {
-                 dprintf("[fs_copy] error reading source block %d\n", src_block);
+         if (cached_block_read(fs, src_block, block_data)) {
+             dprintf("[fs_copy] error reading source block %d\n", src_block);
+             res = -1;
+             break;
+         }
+         cached_block_write(fs, new_block, block_data);
+     }
+ 
+     if (res == 0) {
+         // 7. Atualizar metadados do novo arquivo
+         fsi_inode_write_begin(fs, new_inode);
+         new_ifile->size = src_ifile->size;
+         new_ifile->type = FS_FILE;
+         fsi_inode_write_end(fs, new_inode);
+ 
+         // 8. Registar os metadados do novo ficheiro no journal, depois de
+         //    os blocos copiados estarem no disco
+         for (unsigned int i = 0; i < undo.ntaken; i++) {
+             fsi_cache_flush_block(fs, undo.taken[i]);
+         }
+         fsi_tx_log_inode(&tx, new_inode, new_ifile);
+         res = fsi_tx_commit(fs, &tx);
+     }
+ 
+     // 9. Se a cópia falhou, as referências e os blocos voltam ao que
+     //    eram e o ficheiro criado é removido
+     if (res < 0) {
+         fsi_write_undo(fs, new_inode, &undo);
+     }
+     fsi_inode_unlock(fs, src_inode);
+     fsi_inode_unlock(fs, new_inode);
+     if (res < 0) {
+         fs_unlink(fs, dir_inode, target_name);
+     }
+     return res;
+ }
+ 
+ // Remove a entrada 'name' (do tipo 'type') do directório 'dir' e liberta
+ // o seu inode; os blocos são libertados pelo reclaimer
+ static int fsi_remove(fs_t* fs, inodeid_t dir, char* name, fs_itype_t type,
+    char* fn)
+ {
+     if (fs == NULL || dir >= ITAB_SIZE || name == NULL) {
+         dprintf("[%s] malformed arguments.\n", fn);
+         return -1;
+     }
+ 
+     // 1. Obter o directório e a entrada (trinco de escrita)
+     fs_inode_t* idir = fsi_inode_lock(fs, dir, 1);
+     if (idir == NULL) {
+         dprintf("[%s] inode is not being used.\n", fn);
+         return -1;
+     }
+     if (idir->type != FS_DIR) {
+         fsi_inode_unlock(fs, dir);
+         dprintf("[%s] inode is not a directory.\n", fn);
+         return -1;
+     }
+ 
+     unsigned int pos;
+     inodeid_t id;
+     if (fsi_dir_find_slot(fs, dir, name, &pos, &id) < 0) {
+         fsi_inode_unlock(fs, dir);
+         dprintf("[%s] file does not exist.\n", fn);
+         return -1;
+     }
+ 
+     // 2. Obter o inode a remover (o directório é trancado primeiro)
+     fs_inode_t* inode = fsi_inode_lock(fs, id, 1);
+     if (inode == NULL) {
+         fsi_inode_unlock(fs, dir);
+         dprintf("[%s] inode is not being used.\n", fn);
+         return -1;
+     }
+     if (inode->type != type) {
+         fsi_inode_unlock(fs, id);
+         fsi_inode_unlock(fs, dir);
+         dprintf("[%s] %s.\n", fn, type == FS_DIR ? "not a directory" : "is a directory");
+         return -1;
+     }
+     if (type == FS_DIR && inode->size > 0) {
+         fsi_inode_unlock(fs, id);
+         fsi_inode_unlock(fs, dir);
+         dprintf("[%s] directory is not empty.\n", fn);
+         return -1;
+     }
+ 
+     // 3. Retirar a entrada do directório e largar os blocos do inode
+     //    (desfeito se a transacção falhar)
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     fs_inode_t saved_dir = *idir;
+     fs_write_undo_t undo;
+     undo.inode = *inode;
+     undo.ntaken = undo.nunref = undo.nref = 0;
+     unsigned int freed[2 * INODE_NUM_BLKS];
+     int nfreed = fsi_dir_remove_entry(fs, dir, pos, &tx, freed);
+     if (nfreed < 0) {
+         fsi_inode_unlock(fs, id);
+         fsi_inode_unlock(fs, dir);
+         return -1;
+     }
+     nfreed += fsi_file_release_blocks(fs, inode, 0, &freed[nfreed], &tx, &undo);
+     fsi_tx_log(&tx, FS_JREC_INO_CLR, id, NULL, 0);
+ 
+     // 4. O inode e os blocos só podem ser reutilizados depois de a
+     //    transacção que os liberta estar no journal
+     int res = fsi_tx_commit(fs, &tx);
+     if (res == 0) {
+         fsi_inode_release(fs, id);
+     } else {
+         fsi_write_undo(fs, id, &undo);
+         fsi_inode_write_begin(fs, dir);
+         *idir = saved_dir;
+         fsi_inode_write_end(fs, dir);
+     }
+     fsi_inode_unlock(fs, id);
+     fsi_inode_unlock(fs, dir);
+ 
+     if (res == 0) {
+         fsi_reclaim_add(fs, freed, nfreed);
+     }
+     return res;
+ }
+ 
+ 
+ int fs_unlink(fs_t* fs, inodeid_t dir, char* file)
+ {
+     return fsi_remove(fs, dir, file, FS_FILE, "fs_unlink");
+ }
+ 
+ 
+ int fs_rmdir(fs_t* fs, inodeid_t dir, char* subdir)
+ {
+     return fsi_remove(fs, dir, subdir, FS_DIR, "fs_rmdir");
+ }
+ 
+ 
+ int fs_truncate(fs_t* fs, inodeid_t file, unsigned size)
+ {
+     if (fs == NULL || file >= ITAB_SIZE) {
+         dprintf("[fs_truncate] malformed arguments.\n");
+         return -1;
+     }
+     if (size > INODE_NUM_BLKS * BLOCK_SIZE) {
+         dprintf("[fs_truncate] no free block entries in inode.\n");
+         return -1;
+     }
+ 
+     fs_inode_t* ifile = fsi_inode_lock(fs, file, 1);
+     if (ifile == NULL) {
+         dprintf("[fs_truncate] inode is not being used.\n");
+         return -1;
+     }
+     if (ifile->type != FS_FILE) {
+         fsi_inode_unlock(fs, file);
+         dprintf("[fs_truncate] inode is not a file.\n");
+         return -1;
+     }
+     if (size == ifile->size) {
+         fsi_inode_unlock(fs, file);
+         return 0;
+     }
+ 
+     // o inode e as referências dos blocos mudam já e são repostos por
+     // fsi_write_undo se a transacção falhar
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     fs_write_undo_t undo;
+     undo.inode = *ifile;
+     undo.ntaken = undo.nunref = undo.nref = 0;
+     unsigned int freed[INODE_NUM_BLKS];
+     unsigned int nfreed = 0;
+     if (size > ifile->size) {
+         // Aumentar: o novo intervalo é um buraco; os blocos reservados por
+         // fs_fallocate que passam a estar dentro do ficheiro são limpos
+         if (FS_INODE_IS_INLINE(ifile) && size > FS_INLINE_SIZE &&
+             fsi_inline_spill(fs, ifile, &tx) < 0) {
+             fsi_inode_unlock(fs, file);
+             return -1;
+         }
+         if (undo.inode.blocks[0] == 0 && ifile->blocks[0] != 0) {
+             undo.taken[undo.ntaken++] = ifile->blocks[0];
+         }
+         if (!FS_INODE_IS_INLINE(ifile)) {
+             char empty_block[BLOCK_SIZE] = {0};
+             for (unsigned int i = OFFSET_TO_BLOCKS(ifile->size); i < OFFSET_TO_BLOCKS(size); i++) {
+                 if (ifile->blocks[i] != 0) {
+                     cached_block_write(fs, ifile->blocks[i], empty_block);
+                 }
+             }
+         }
+     } else if (FS_INODE_IS_INLINE(ifile)) {
+         memset(&ifile->idata[size], 0, FS_INLINE_SIZE - size);
+     } else {
+         // Diminuir: limpar o resto do novo último bloco (um crescimento
+         // posterior tem de ler zeros) e largar os blocos para lá do novo fim
+         int iblock = size / BLOCK_SIZE;
+         if (size % BLOCK_SIZE != 0 && ifile->blocks[iblock] != 0) {
+             char block_data[BLOCK_SIZE];
+             int cow = 0;
+             if (cached_block_read(fs, ifile->blocks[iblock], block_data) ||
+                 (cow = fsi_block_unshare(fs, ifile, iblock, &tx)) < 0) {
+                 fsi_inode_unlock(fs, file);
+                 dprintf("[fs_truncate] error clearing the last block.\n");
                  return -1;
              }
-             pthread_mutex_lock(&fs->cache_mutex);
-             
-             // Adicionar bloco de origem à cache
-             add_block_to_cache(fs, src_block, block_data, 0);
+             memset(&block_data[size % BLOCK_SIZE], 0, BLOCK_SIZE - size % BLOCK_SIZE);
+             cached_block_write(fs, ifile->blocks[iblock], block_data);
+             if (cow) {
+                 // a cópia tem de estar no disco antes do novo mapa
+                 fsi_cache_flush_block(fs, ifile->blocks[iblock]);
+                 undo.unref[undo.nunref++] = undo.inode.blocks[iblock];
+                 undo.taken[undo.ntaken++] = ifile->blocks[iblock];
+             }
          }
+         nfreed = fsi_file_release_blocks(fs, ifile, OFFSET_TO_BLOCKS(size), freed,
+            &tx, &undo);
+     }
+ 
+     fsi_inode_write_begin(fs, file);
+     ifile->size = size;
+     fsi_inode_write_end(fs, file);
+     fsi_tx_log_inode(&tx, file, ifile);
  
-         // Adicionar novo bloco à cache (já marcando como dirty)
-         add_block_to_cache(fs, new_block, block_data, 1);
+     int res = fsi_tx_commit(fs, &tx);
+     if (res < 0) {
+         fsi_write_undo(fs, file, &undo);
      }
+     fsi_inode_unlock(fs, file);
+     if (res == 0) {
+         fsi_reclaim_add(fs, freed, nfreed);
+     }
+     return res;
+ }
  
-     // 7. Atualizar metadados do novo arquivo
-     new_ifile->size = src_ifile->size;
-     new_ifile->type = FS_FILE;
  
-     // Se o inode de destino não estava na cache, atualizar tabela principal
-     if (!cached_new) {
-         fs->inode_tab[new_inode] = *new_ifile;
+ int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned len)
+ {
+     if (fs == NULL || file >= ITAB_SIZE || len == 0 || offset + len < offset) {
+         dprintf("[fs_fallocate] malformed arguments.\n");
+         return -1;
      }
  
-     // 8. Atualizar metadados no disco (apenas se necessário)
-     if (cached_new && cached_new->dirty) {
-         pthread_mutex_unlock(&fs->cache_mutex);
-         fsi_store_fsdata(fs);
-         pthread_mutex_lock(&fs->cache_mutex);
+     unsigned int first = offset / BLOCK_SIZE;
+     unsigned int last = OFFSET_TO_BLOCKS(offset + len);
+     if (last > INODE_NUM_BLKS) {
+         dprintf("[fs_fallocate] no free block entries in inode.\n");
+         return -1;
+     }
+ 
+     fs_inode_t* ifile = fsi_inode_lock(fs, file, 1);
+     if (ifile == NULL) {
+         dprintf("[fs_fallocate] inode is not being used.\n");
+         return -1;
+     }
+     if (ifile->type != FS_FILE) {
+         fsi_inode_unlock(fs, file);
+         dprintf("[fs_fallocate] inode is not a file.\n");
+         return -1;
+     }
+ 
+     fs_tx_t tx;
+     fsi_tx_init(&tx);
+     int spilled = 0;
+ 
+     // 1. Ficheiro inline: só é preciso reservar blocos se o intervalo não
+     //    couber no inode
+     if (FS_INODE_IS_INLINE(ifile)) {
+         if (offset + len <= FS_INLINE_SIZE) {
+             fsi_inode_unlock(fs, file);
+             return 0;
+         }
+         if (fsi_inline_spill(fs, ifile, &tx) < 0) {
+             fsi_inode_unlock(fs, file);
+             return -1;
+         }
+         spilled = 1;
+     }
+ 
+     // 2. Contar as entradas do intervalo que ainda não têm bloco; a
+     //    sequência começa, se possível, a seguir ao bloco anterior (ou no
+     //    grupo do ficheiro)
+     unsigned int missing = 0;
+     unsigned int goal = 0;
+     for (unsigned int i = first; i < last; i++) {
+         if (ifile->blocks[i] == 0) {
+             if (missing++ == 0) {
+                 goal = fsi_block_goal(fs, ifile, i);
+             }
+         }
+     }
+ 
+     // 3. Reservar blocos contíguos; se não houver uma sequência livre
+     //    suficiente, reservar um a um
+     unsigned int newblks[INODE_NUM_BLKS];
+     unsigned int n = 0;
+     unsigned int start;
+     if (fsi_block_alloc_range(fs, missing, goal, &start)) {
+         for (n = 0; n < missing; n++) {
+             newblks[n] = start + n;
+         }
+     } else {
+         while (n < missing && fsi_block_alloc(fs, n ? newblks[n - 1] + 1 : goal, &newblks[n])) {
+             n++;
+         }
+         if (n < missing) {
+             while (n > 0) {
+                 fsi_block_free(fs, newblks[--n]);
+             }
+         }
+     }
+ 
+     int res = 0;
+     if (n < missing) {
+         dprintf("[fs_fallocate] there are no free blocks.\n");
+         res = -1;
+     } else {
+         // Os blocos para lá do fim não são inicializados: o tamanho do
+         // ficheiro não muda e fs_write limpa cada bloco quando o ficheiro
+         // cresce até ele; os que preenchem buracos passam a ser lidos e
+         // são limpos já
+         char empty_block[BLOCK_SIZE] = {0};
+         unsigned int blks_used = OFFSET_TO_BLOCKS(ifile->size);
+         n = 0;
+         for (unsigned int i = first; i < last; i++) {
+             if (ifile->blocks[i] == 0) {
+                 ifile->blocks[i] = newblks[n++];
+                 fsi_tx_log(&tx, FS_JREC_BLK_SET, ifile->blocks[i], NULL, 0);
+                 if (i < blks_used) {
+                     cached_block_write(fs, ifile->blocks[i], empty_block);
+                 }
+             }
+         }
+     }
+ 
+     // 4. Registar a reserva (e a passagem dos dados inline para um bloco)
+     if (spilled || (res == 0 && missing > 0)) {
+         fsi_tx_log_inode(&tx, file, ifile);
+         if (fsi_tx_commit(fs, &tx) < 0) {
+             res = -1;
+         }
+     }
+     fsi_inode_unlock(fs, file);
+     return res;
+ }
+ 
+ 
+ int fs_statfs(fs_t* fs, fs_statfs_t* stats)
+ {
+     if (fs == NULL || stats == NULL) {
+         dprintf("[fs_statfs] malformed arguments.\n");
+         return -1;
+     }
+ 
+     // Os contadores são mantidos pelo alocador: não é preciso ler os bitmaps
+     stats->block_size = BLOCK_SIZE;
+     stats->total_blocks = block_num_blocks(fs->blocks);
+     stats->free_blocks = fs->free_blocks;
+     stats->total_inodes = ITAB_SIZE;
+     stats->free_inodes = fs->free_inodes;
+     return 0;
+ }
+ 
+ int fs_cache_resize(fs_t* fs, unsigned budget, unsigned meta_pct)
+ {
+     if (fs == NULL || meta_pct > 100 || budget < FS_CACHE_MIN_BUDGET) {
+         dprintf("[fs_cache_resize] malformed arguments.\n");
+         return -1;
+     }
+ 
+     pthread_mutex_lock(&fs->cache_mutex);
+     int res = fsi_cache_resize(fs, budget, meta_pct);
+     pthread_mutex_unlock(&fs->cache_mutex);
+     if (res < 0) {
+         dprintf("[fs_cache_resize] not enough memory for the caches.\n");
+     }
+     return res;
+ }
+ 
+ int fs_cache_shrink(fs_t* fs)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_cache_shrink] malformed arguments.\n");
+         return -1;
+     }
+     return fsi_cache_shrink(fs);
+ }
+ 
+ int fs_cache_info(fs_t* fs, fs_cache_info_t* info)
+ {
+     if (fs == NULL || info == NULL) {
+         dprintf("[fs_cache_info] malformed arguments.\n");
+         return -1;
      }
  
+     pthread_mutex_lock(&fs->cache_mutex);
+     info->budget = fs->cache_budget;
+     info->meta_pct = fs->cache_meta_pct;
+     info->data_blocks = fs->block_cache_len;
+     info->dir_pages = fs->dir_cache_len;
      pthread_mutex_unlock(&fs->cache_mutex);
      return 0;
  }
  
+ int fs_warmup_start(fs_t* fs, char* list, unsigned period)
+ {
+     if (fs == NULL || list == NULL || fs->warm_path != NULL) {
+         dprintf("[fs_warmup_start] malformed arguments.\n");
+         return -1;
+     }
+ 
+     fs->warm_path = strdup(list);
+     if (fs->warm_path == NULL) {
+         dprintf("[fs_warmup_start] not enough memory.\n");
+         return -1;
+     }
+     fs->warm_period = period;
+     if (pthread_create(&fs->warmer, NULL, fsi_warmer, fs) != 0) {
+         dprintf("[fs_warmup_start] error creating the warm-up thread.\n");
+         free(fs->warm_path);
+         fs->warm_path = NULL;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ int fs_warmup_save(fs_t* fs)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_warmup_save] malformed arguments.\n");
+         return -1;
+     }
+     if (fs->warm_path == NULL) {
+         return 0;
+     }
+ 
+     pthread_mutex_lock(&fs->warm_mutex);
+     int res = fsi_warmup_store(fs);
+     pthread_mutex_unlock(&fs->warm_mutex);
+     if (res < 0) {
+         dprintf("[fs_warmup_save] error writing %s.\n", fs->warm_path);
+     }
+     return res;
+ }
+ 
+ int fs_dedup_enable(fs_t* fs)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_dedup_enable] malformed arguments.\n");
+         return -1;
+     }
+ 
+     // o índice tem uma entrada por bloco do volume (arredondado a uma
+     // potência de 2)
+     unsigned int num_blocks = block_num_blocks(fs->blocks);
+     unsigned int size = 1;
+     while (size < num_blocks) {
+         size *= 2;
+     }
+ 
+     pthread_mutex_lock(&fs->alloc_mutex);
+     if (fs->dedup_tab == NULL) {
+         unsigned int* tab = (unsigned int*)calloc(size, sizeof(unsigned int));
+         unsigned int* hash = (unsigned int*)calloc(num_blocks, sizeof(unsigned int));
+         if (tab == NULL || hash == NULL) {
+             pthread_mutex_unlock(&fs->alloc_mutex);
+             free(tab);
+             free(hash);
+             dprintf("[fs_dedup_enable] not enough memory for the index.\n");
+             return -1;
+         }
+         fs->dedup_hash = hash;
+         fs->dedup_mask = size - 1;
+         fs->dedup_tab = tab;
+     }
+     pthread_mutex_unlock(&fs->alloc_mutex);
+     return 0;
+ }
+ 
+ int fs_defrag_start(fs_t* fs, unsigned rate)
+ {
+     if (fs == NULL || rate == 0 || fs->defrag_rate != 0) {
+         dprintf("[fs_defrag_start] malformed arguments.\n");
+         return -1;
+     }
+ 
+     fs->defrag_rate = rate;
+     if (pthread_create(&fs->defragger, NULL, fsi_defragger, fs) != 0) {
+         dprintf("[fs_defrag_start] error creating the defragmenter thread.\n");
+         fs->defrag_rate = 0;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ int fs_defrag_run(fs_t* fs, unsigned budget)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_defrag_run] malformed arguments.\n");
+         return -1;
+     }
+ 
+     // uma passagem completa pela tabela de inodes
+     unsigned int moved = 0;
+     for (inodeid_t id = 0; id < ITAB_SIZE && (budget == 0 || moved < budget); id++) {
+         int res = fsi_defrag_file(fs, id, budget == 0 ? INODE_NUM_BLKS : budget - moved);
+         if (res < 0) {
+             return -1;
+         }
+         moved += res;
+     }
+     return moved;
+ }
+ 
+ int fs_defrag_info(fs_t* fs, fs_defrag_info_t* info)
+ {
+     if (fs == NULL || info == NULL) {
+         dprintf("[fs_defrag_info] malformed arguments.\n");
+         return -1;
+     }
+ 
+     memset(info, 0, sizeof(fs_defrag_info_t));
+     for (inodeid_t id = 0; id < ITAB_SIZE; id++) {
+         fs_inode_t* ifile = fsi_inode_lock(fs, id, 0);
+         if (ifile == NULL) {
+             continue;
+         }
+         unsigned int n;
+         unsigned int extents = fsi_file_extents(ifile, &n);
+         if (ifile->type == FS_FILE && n > 0) {
+             info->files++;
+             info->fragmented += (extents > 1) ? 1 : 0;
+             info->extents += extents;
+             info->blocks += n;
+         }
+         fsi_inode_unlock(fs, id);
+     }
+     info->moved_files = fs->defrag_files;
+     info->moved_blocks = fs->defrag_blocks;
+     return 0;
+ }
+ 
+ int fs_log_start(fs_t* fs, unsigned clean_rate)
+ {
+     if (fs == NULL || fs->log_mode) {
+         dprintf("[fs_log_start] malformed arguments.\n");
+         return -1;
+     }
+ 
+     fs->log_mode = 1;
+     fs->log_clean_rate = clean_rate;
+     if (clean_rate > 0 &&
+         pthread_create(&fs->log_cleaner, NULL, fsi_log_cleaner, fs) != 0) {
+         dprintf("[fs_log_start] error creating the cleaner thread.\n");
+         fs->log_mode = 0;
+         fs->log_clean_rate = 0;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ int fs_log_clean(fs_t* fs, unsigned budget)
+ {
+     if (fs == NULL) {
+         dprintf("[fs_log_clean] malformed arguments.\n");
+         return -1;
+     }
+     return fsi_log_clean_some(fs, budget, 1);
+ }
+ 
+ int fs_log_info(fs_t* fs, fs_log_info_t* info)
+ {
+     if (fs == NULL || info == NULL) {
+         dprintf("[fs_log_info] malformed arguments.\n");
+         return -1;
+     }
+ 
+     memset(info, 0, sizeof(fs_log_info_t));
+     unsigned int first = fsi_log_first_seg(fs);
+     info->seg_blocks = FS_LOG_SEG_BLOCKS;
+     info->segments = fsi_log_num_segs(fs);
+     for (unsigned int seg = first; seg < first + info->segments; seg++) {
+         info->free_segments += (fsi_log_seg_used(fs, seg) == 0) ? 1 : 0;
+     }
+     pthread_mutex_lock(&fs->log_mutex);
+     info->head = (fs->log_seg != 0) ? fs->log_head : 0;
+     info->log_blocks = fs->log_blocks;
+     info->opened = fs->log_opened;
+     pthread_mutex_unlock(&fs->log_mutex);
+     info->cleaned = fs->log_cleaned;
+     info->moved_blocks = fs->log_moved;
+     return 0;
+ }
+ 
  void fs_dump(fs_t* fs)
  {
     printf("Free block bitmap:\n");
-    fsi_dump_bmap(fs->blk_bmap,BLOCK_SIZE);
+    fsi_dump_bmap(fs->blk_bmap,(block_num_blocks(fs->blocks)+7)/8);
     printf("\n");
     
     printf("Free inode table bitmap:\n");
     fsi_dump_bmap(fs->inode_bmap,BLOCK_SIZE);
     printf("\n");
+ 
+    // only the dense attribute arrays are read, not the whole inodes
+    printf("Inodes in use:\n");
+    for (inodeid_t id = 1; id < ITAB_SIZE; id++) {
+       if (BMAP_ISSET(fs->inode_bmap,id)) {
+          fsi_itab_load(fs,id);
+          printf("%3u %s %6u%s\n", id, fs->inode_type[id] == FS_DIR ? "dir " : "file",
+             fs->inode_size[id], (fs->inode_flags[id] & FS_IFLAG_INLINE) ? " inline" : "");
+       }
+    }
+ 
+    fs_defrag_info_t info;
+    fs_defrag_info(fs,&info);
+    printf("Fragmentation: %u of %u files fragmented, %u extents for %u blocks,"
+       " %u blocks moved\n", info.fragmented, info.files, info.extents,
+       info.blocks, info.moved_blocks);
+ 
+    fs_log_info_t log;
+    if (fs->log_mode && fs_log_info(fs,&log) == 0) {
+       printf("Log: head %u, %u of %u segments free, %u blocks written,"
+          " %u segments cleaned, %u blocks moved\n", log.head,
+          log.free_segments, log.segments, log.log_blocks, log.cleaned,
+          log.moved_blocks);
+    }
  }
  
  
@@ -40,19 +40,69 @@ typedef struct {
 } fs_file_attrs_t;
 
 
-// identify the name and the type of a file
+// fs_readdir cookie returned after the last entry of a directory
+#define FS_READDIR_END ((unsigned)-1)
+
+
+// identify the name, the type, the inode and the size of a file
 typedef struct {
    char name[FS_MAX_FNAME_SZ];
    fs_itype_t type;
+   inodeid_t inodeid;
+   unsigned size;
 } fs_file_name_t;
 
 
+// capacity and usage of the file system
+typedef struct {
+   unsigned block_size;    // size of a block in bytes
+   unsigned total_blocks;  // number of blocks of the volume
+   unsigned free_blocks;   // number of free blocks
+   unsigned total_inodes;  // number of inodes
+   unsigned free_inodes;   // number of free inodes
+} fs_statfs_t;
+
+
+// size of the caches of a file system
+typedef struct {
+   unsigned budget;        // bytes that the caches may use
+   unsigned meta_pct;      // share of the budget for directory pages (%)
+   unsigned data_blocks;   // number of entries of the block cache
+   unsigned dir_pages;     // number of entries of the directory cache
+} fs_cache_info_t;
+
+
+// fragmentation of the files and work done by the defragmenter
+typedef struct {
+   unsigned files;         // files with data blocks
+   unsigned fragmented;    // files whose blocks are not one contiguous run
+   unsigned extents;       // runs of contiguous blocks of all the files
+   unsigned blocks;        // data blocks of all the files
+   unsigned moved_files;   // files moved by the defragmenter
+   unsigned moved_blocks;  // blocks moved by the defragmenter
+} fs_defrag_info_t;
+
+
+// segments of the log and work done by the log-structured write mode
+typedef struct {
+   unsigned seg_blocks;    // blocks of each segment
+   unsigned segments;      // segments used by the log
+   unsigned free_segments; // segments without blocks in use
+   unsigned head;          // next block of the head of the log (0: none)
+   unsigned log_blocks;    // data blocks written to the log
+   unsigned opened;        // segments the head of the log moved to
+   unsigned cleaned;       // segments freed by the cleaner
+   unsigned moved_blocks;  // blocks moved by the cleaner
+} fs_log_info_t;
+
+
 // file system structure (the implementation is hidden)
 typedef struct fs_ fs_t;
 
 
 /*
- * fs_new: allocates storage - blocks - and memory for the fs structure
+ * fs_new: allocates storage - blocks - and memory for the fs structure;
+ * the storage is kept in memory and must be formatted with fs_format
  * - num_blocks - number of blocks
  *   returns: the fs structure
  */
@@ -60,13 +110,67 @@ fs_t* fs_new(unsigned num_blocks, int disk_delay);
 
 
 /*
- * fs_format: formats the file system
+ * fs_open: allocates the fs structure over an image file, which is
+ * created if it does not exist; the volume must then be mounted with
+ * fs_mount or formatted with fs_format
+ * - image - name of the image file
+ * - num_blocks - number of blocks if the image has to be created
+ *   returns: the fs structure, NULL if the image cannot be opened
+ */
+fs_t* fs_open(char* image, unsigned num_blocks, int disk_delay);
+
+
+/*
+ * fs_open_tiered: same as fs_open, but the most used blocks of the image
+ * are kept in memory (see block_open_tiered), so that the volume can be
+ * larger than the memory
+ * - image - name of the image file
+ * - num_blocks - number of blocks if the image has to be created
+ * - ram_blocks - number of blocks kept in memory
+ *   returns: the fs structure, NULL if the image cannot be opened
+ */
+fs_t* fs_open_tiered(char* image, unsigned num_blocks, unsigned ram_blocks,
+   int disk_delay);
+
+
+/*
+ * fs_mount: mounts the file system already stored in the volume; only
+ * the superblock and the bitmaps are read, the inode table is loaded
+ * on demand
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 if the volume has no valid file system
+ */
+int fs_mount(fs_t* fs);
+
+
+/*
+ * fs_format: formats the file system (mkfs); only the metadata blocks
+ * are written, so the time taken does not depend on the data capacity
  * - fs: reference to file system
  *   returns: 0 if successful, -1 otherwise
  */
 int fs_format(fs_t* fs);
 
 
+/*
+ * fs_sync: writes every cached change to the volume (e.g. before the
+ * server is stopped)
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_sync(fs_t* fs);
+
+
+/*
+ * fs_stop: stops the background threads of the file system (block
+ * reclaimer, cache warm-up, defragmenter and log cleaner) and waits for
+ * them to end; the file system can still be used (e.g. by fs_sync)
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_stop(fs_t* fs);
+
+
 /*
  * fs_lookup: gets the inode id of an object (file/directory)
  * - fs: reference to file system
@@ -102,7 +206,9 @@ int fs_read(fs_t* fs, inodeid_t file, unsigned offset, unsigned count,
 
 
 /*
- * fs_write: write data to file
+ * fs_write: write data to file; writing past the end of the file leaves
+ * a hole (read as zeros, without data blocks) between the old end and
+ * 'offset', and only the blocks touched by the write are allocated
  * - fs: reference to file system
  * - file: node id of the file
  * - offset: starting position for writing
@@ -137,25 +243,200 @@ int fs_mkdir(fs_t* fs, inodeid_t dir, char* newdir, inodeid_t* newdirid);
 
 
 /*
- * fs_readdir: read the contents of a directory
+ * fs_readdir: read the contents of a directory, starting at a given
+ * position so that large directories can be listed page by page
  * - fs: reference to file system
  * - dir: the directory
- * - entries: where to write the entries of the directory [out]
+ * - cookie: position of the first entry to read (0 for the first
+ *   entry); set to the position of the next entry, or to FS_READDIR_END
+ *   if there are no more entries; removing other entries does not move
+ *   an entry, so a listing can go on while the directory changes [in/out]
+ * - entries: where to write the entries of the directory (name, type,
+ *   inode and size of each file) [out]
  * - maxentries: maximum number of entries to write in 'entries'
  * - numentries: number of entries written [out]
  *   returns: 0 if successful, -1 otherwise
  */
-int fs_readdir(fs_t* fs, inodeid_t dir, fs_file_name_t* entries, int maxentries,
-   int* numentries);
+int fs_readdir(fs_t* fs, inodeid_t dir, unsigned* cookie,
+   fs_file_name_t* entries, int maxentries, int* numentries);
 
 /*
- * fs_copy: copies file 'srcfile' to a new file 
+ * fs_copy: copies file 'srcfile' to a new file; the copy shares the data
+ * blocks of the original, which are only duplicated when one of the
+ * files is written (copy-on-write)
  * - srcpath - pathname of the original file
  * - tgtpath - pathname of the targer file
- *   returns: 0 if successful, -1 otherwise
+ *   returns: 0 if successful, -1 otherwise (the target file is not
+ *   left behind)
  */
 int fs_copy(fs_t* fs, char* srcpath, char *tgtpath);
 
+/*
+ * fs_unlink: removes a file from a directory; the blocks of the file are
+ * freed in the background
+ * - fs: reference to file system
+ * - dir: the directory of the file
+ * - file: the name of the file
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_unlink(fs_t* fs, inodeid_t dir, char* file);
+
+/*
+ * fs_rmdir: removes an empty subdirectory from a directory
+ * - fs: reference to file system
+ * - dir: the directory of the subdirectory
+ * - subdir: the name of the subdirectory
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_rmdir(fs_t* fs, inodeid_t dir, char* subdir);
+
+/*
+ * fs_truncate: changes the size of a file; when shortening, the blocks
+ * past the new end are freed in the background, when growing, the new
+ * range is a hole
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - size: the new size
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_truncate(fs_t* fs, inodeid_t file, unsigned size);
+
+/*
+ * fs_fallocate: reserves the blocks of a range of a file before it is
+ * written, as one contiguous run of blocks when there is one; the blocks
+ * are not zeroed and the file size does not change
+ * - fs: reference to file system
+ * - file: node id of the file
+ * - offset: start of the range
+ * - len: size of the range
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_fallocate(fs_t* fs, inodeid_t file, unsigned offset, unsigned len);
+
+/*
+ * fs_statfs: gets the capacity and usage of the file system (read from
+ * counters kept up to date by the allocator, without scanning bitmaps)
+ * - fs: reference to file system
+ * - stats: the file system statistics [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_statfs(fs_t* fs, fs_statfs_t* stats);
+
+/*
+ * fs_cache_resize: changes the memory used by the block and directory
+ * caches while the file system is in use; when the caches shrink the
+ * most recently used entries are kept and the dirty ones that no longer
+ * fit are written to disk
+ * - fs: reference to file system
+ * - budget: bytes that the caches may use
+ * - meta_pct: share of the budget for directory pages (0 to 100), the
+ *   rest is used for data blocks
+ *   returns: 0 if successful, -1 otherwise (the caches keep their size)
+ */
+int fs_cache_resize(fs_t* fs, unsigned budget, unsigned meta_pct);
+
+/*
+ * fs_cache_shrink: releases half of the memory of the caches (used when
+ * memory is short)
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 if the caches are already at their
+ *   minimum size
+ */
+int fs_cache_shrink(fs_t* fs);
+
+/*
+ * fs_cache_info: gets the budget and the size of the caches
+ * - fs: reference to file system
+ * - info: the cache budget and number of entries [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_cache_info(fs_t* fs, fs_cache_info_t* info);
+
+/*
+ * fs_warmup_start: starts a background thread that reads into the caches
+ * the inodes and blocks listed in the warm-up file 'list' (saved by a
+ * previous run, most important first) and then saves there the hottest
+ * cached blocks every 'period' seconds
+ * - fs: reference to file system (already mounted or formatted)
+ * - list: pathname of the warm-up file (it may not exist yet)
+ * - period: seconds between saves, 0 to only save with fs_warmup_save
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_warmup_start(fs_t* fs, char* list, unsigned period);
+
+/*
+ * fs_warmup_save: saves the warm-up list now (e.g. before shutting down)
+ * - fs: reference to file system
+ *   returns: 0 if successful or if there is no warm-up list, -1 otherwise
+ */
+int fs_warmup_save(fs_t* fs);
+
+/*
+ * fs_dedup_enable: turns on the deduplication of the blocks written from
+ * then on: a block with the same contents as a block already written is
+ * shared (copy-on-write) instead of using a new block
+ * - fs: reference to file system
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_dedup_enable(fs_t* fs);
+
+/*
+ * fs_defrag_start: starts a background thread that moves the blocks of
+ * each fragmented file into one contiguous run while the file system is
+ * in use
+ * - fs: reference to file system (already mounted or formatted)
+ * - rate: maximum number of blocks moved per second
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_defrag_start(fs_t* fs, unsigned rate);
+
+/*
+ * fs_defrag_run: makes one defragmentation pass over all the files now
+ * - fs: reference to file system
+ * - budget: maximum number of blocks to move, 0 for no limit
+ *   returns: the number of blocks moved, -1 if there was an error
+ */
+int fs_defrag_run(fs_t* fs, unsigned budget);
+
+/*
+ * fs_defrag_info: gets the fragmentation of the files and the work done
+ * by the defragmenter
+ * - fs: reference to file system
+ * - info: the fragmentation statistics [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_defrag_info(fs_t* fs, fs_defrag_info_t* info);
+
+/*
+ * fs_log_start: turns on the log-structured write mode: from then on the
+ * data blocks written to the files (new blocks and overwrites) are
+ * appended to the segment at the head of the log instead of being
+ * written in place, and a background cleaner frees the segments that
+ * have few blocks in use
+ * - fs: reference to file system (already mounted or formatted)
+ * - clean_rate: maximum number of blocks moved per second by the
+ *   cleaner, 0 to only clean with fs_log_clean
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_log_start(fs_t* fs, unsigned clean_rate);
+
+/*
+ * fs_log_clean: frees now the segments with few blocks in use, by moving
+ * their blocks to the head of the log
+ * - fs: reference to file system
+ * - budget: maximum number of blocks to move, 0 for no limit
+ *   returns: the number of blocks moved, -1 if there was an error
+ */
+int fs_log_clean(fs_t* fs, unsigned budget);
+
+/*
+ * fs_log_info: gets the state of the log and the work done by the cleaner
+ * - fs: reference to file system
+ * - info: the log statistics [out]
+ *   returns: 0 if successful, -1 otherwise
+ */
+int fs_log_info(fs_t* fs, fs_log_info_t* info);
+
 /*
  * fd_dump: dump the contents of a file system
  */
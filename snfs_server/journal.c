@@ -0,0 +1,380 @@
+/*
+ * Journal Layer
+ *
+ * journal.c
+ *
+ * Circular write-ahead journal. The first block of the journal area
+ * holds the journal header (the sequence number of the oldest log
+ * block still needed); the remaining blocks form a circular log.
+ * Each log block carries its own sequence number so that replay stops
+ * at the first block that was not written after the last checkpoint.
+ * Transactions never span log blocks.
+ *
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+
+#define JRNL_MAGIC 0x4c4a4e53      // "SNJL"
+
+// percentage of the log that can be used before a checkpoint is forced
+#define JRNL_CKPT_PCT 75
+
+// fraction of the log that a single group commit may use
+#define JRNL_BATCH_DIV 4
+
+
+// journal header (first block of the journal area)
+typedef struct {
+   unsigned magic;
+   unsigned tail;      // sequence number of the oldest live log block
+} jrnl_super_t;
+
+
+// header of each log block
+typedef struct {
+   unsigned magic;
+   unsigned seq;       // sequence number of this log block
+   unsigned used;      // bytes used in the block (header included)
+} jrnl_blk_hdr_t;
+
+
+// a committer waiting for its batch to be written (kept on its stack)
+typedef struct jrnl_waiter {
+   int res;                   // result of the batch write
+   struct jrnl_waiter* next;
+} jrnl_waiter_t;
+
+
+// internal implementation of 'journal_t'
+struct journal_ {
+   blocks_t* bks;
+   unsigned start;          // journal header block
+   unsigned num_log;        // number of log blocks
+   unsigned bsize;
+   unsigned head;           // sequence number of the next log block
+   unsigned tail;           // sequence number of the oldest live block
+   journal_checkpoint_t checkpoint;
+   journal_apply_t durable;
+   void* arg;
+
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   char* buf[2];            // pending batch and batch being written
+   int cur;                 // index of the pending batch in 'buf'
+   unsigned cap_blocks;     // maximum blocks per batch
+   unsigned pending_blocks; // blocks used by the pending batch
+   unsigned open_batch;     // id of the pending batch
+   unsigned durable_batch;  // number of batches already written
+   int writing;             // a batch is being written
+   jrnl_waiter_t* waiters;  // committers of the pending batch
+   int need_ckpt;           // a batch write failed: checkpoint before the next
+};
+
+
+#define JRNL_LOG_BLOCK(j,seq) ((j)->start + 1 + (seq) % (j)->num_log)
+
+
+static int jrnl_write_super(journal_t* j)
+{
+   char block[j->bsize];
+   memset(block, 0, j->bsize);
+   jrnl_super_t* sb = (jrnl_super_t*)block;
+   sb->magic = JRNL_MAGIC;
+   sb->tail = j->tail;
+   return block_write(j->bks, j->start, block);
+}
+
+
+// chamado apenas por quem detem o papel de escritor ('writing'); a
+// copia no local tem de estar no disco antes de o cabecalho largar os
+// registos do log, e o novo cabecalho antes de o log ser reutilizado
+static int jrnl_do_checkpoint(journal_t* j)
+{
+   j->checkpoint(j->arg);
+   if (block_sync(j->bks) < 0) {
+      return -1;
+   }
+   j->tail = j->head;
+   if (jrnl_write_super(j) < 0 || block_sync(j->bks) < 0) {
+      return -1;
+   }
+   j->need_ckpt = 0;
+   return 0;
+}
+
+
+// chama 'apply' para cada transaccao do bloco do log 'block'; devolve
+// quantas foram
+static int jrnl_apply_block(char* block, journal_apply_t apply, void* arg)
+{
+   jrnl_blk_hdr_t* hdr = (jrnl_blk_hdr_t*)block;
+   unsigned off = sizeof(jrnl_blk_hdr_t);
+   int count = 0;
+   while (off + sizeof(unsigned) <= hdr->used) {
+      unsigned len;
+      memcpy(&len, &block[off], sizeof(len));
+      off += sizeof(len);
+      if (len == 0 || off + len > hdr->used) {
+         break;
+      }
+      apply(arg, &block[off], len);
+      off += len;
+      count++;
+   }
+   return count;
+}
+
+
+// escreve 'n' blocos do lote 'buf' no log (sem o mutex); depois de um
+// lote falhado, o log so volta a ser usado depois de um checkpoint
+static int jrnl_write_batch(journal_t* j, char* buf, unsigned n)
+{
+   if (j->need_ckpt ||
+       (j->head - j->tail) + n > j->num_log * JRNL_CKPT_PCT / 100) {
+      if (jrnl_do_checkpoint(j) < 0) {
+         return -1;
+      }
+   }
+
+   for (unsigned i = 0; i < n; i++) {
+      char* blk = &buf[i * j->bsize];
+      jrnl_blk_hdr_t* hdr = (jrnl_blk_hdr_t*)blk;
+      hdr->magic = JRNL_MAGIC;
+      hdr->seq = j->head + i;
+      if (block_write(j->bks, JRNL_LOG_BLOCK(j, j->head + i), blk) < 0) {
+         // os numeros de sequencia do lote nao sao reutilizados, para que
+         // a parte ja escrita nunca seja lida como um lote valido
+         j->head += n;
+         j->need_ckpt = 1;
+         return -1;
+      }
+   }
+   // o commit so termina quando o lote esta no disco
+   if (block_sync(j->bks) < 0) {
+      j->head += n;
+      j->need_ckpt = 1;
+      return -1;
+   }
+   j->head += n;
+
+   // o lote e duravel: as transaccoes passam para a copia que o proximo
+   // checkpoint vai escrever (ainda com o papel de escritor)
+   if (j->durable != NULL) {
+      for (unsigned i = 0; i < n; i++) {
+         jrnl_apply_block(&buf[i * j->bsize], j->durable, j->arg);
+      }
+   }
+   return 0;
+}
+
+
+journal_t* journal_new(blocks_t* bks, unsigned start, unsigned num_blocks,
+   journal_checkpoint_t checkpoint, journal_apply_t durable, void* arg)
+{
+   if (bks == NULL || checkpoint == NULL || num_blocks < 2 ||
+       start + num_blocks > block_num_blocks(bks)) {
+      return NULL;
+   }
+
+   journal_t* j = (journal_t*)malloc(sizeof(journal_t));
+   if (j == NULL) {
+      return NULL;
+   }
+   memset(j, 0, sizeof(journal_t));
+   j->bks = bks;
+   j->start = start;
+   j->num_log = num_blocks - 1;
+   j->bsize = block_size(bks);
+   j->head = j->tail = 1;
+   j->checkpoint = checkpoint;
+   j->durable = durable;
+   j->arg = arg;
+   j->cap_blocks = j->num_log / JRNL_BATCH_DIV;
+   if (j->cap_blocks == 0) {
+      j->cap_blocks = 1;
+   }
+
+   j->buf[0] = (char*)malloc(j->cap_blocks * j->bsize);
+   j->buf[1] = (char*)malloc(j->cap_blocks * j->bsize);
+   if (j->buf[0] == NULL || j->buf[1] == NULL) {
+      free(j->buf[0]);
+      free(j->buf[1]);
+      free(j);
+      return NULL;
+   }
+
+   pthread_mutex_init(&j->mutex, NULL);
+   pthread_cond_init(&j->cond, NULL);
+   return j;
+}
+
+
+void journal_free(journal_t* j)
+{
+   if (j == NULL) {
+      return;
+   }
+   pthread_cond_destroy(&j->cond);
+   pthread_mutex_destroy(&j->mutex);
+   free(j->buf[0]);
+   free(j->buf[1]);
+   free(j);
+}
+
+
+int journal_format(journal_t* j)
+{
+   char block[j->bsize];
+   memset(block, 0, j->bsize);
+   for (unsigned i = 0; i < j->num_log; i++) {
+      if (block_write(j->bks, j->start + 1 + i, block) < 0) {
+         return -1;
+      }
+   }
+
+   pthread_mutex_lock(&j->mutex);
+   j->head = j->tail = 1;
+   int res = jrnl_write_super(j);
+   pthread_mutex_unlock(&j->mutex);
+   return res;
+}
+
+
+int journal_replay(journal_t* j, journal_apply_t apply, void* arg)
+{
+   char block[j->bsize];
+
+   if (block_read(j->bks, j->start, block) < 0) {
+      return -1;
+   }
+   jrnl_super_t* sb = (jrnl_super_t*)block;
+   if (sb->magic != JRNL_MAGIC) {
+      return -1;
+   }
+
+   unsigned seq = sb->tail;
+   int count = 0;
+   for (unsigned i = 0; i < j->num_log; i++, seq++) {
+      if (block_read(j->bks, JRNL_LOG_BLOCK(j, seq), block) < 0) {
+         return -1;
+      }
+      jrnl_blk_hdr_t* hdr = (jrnl_blk_hdr_t*)block;
+      if (hdr->magic != JRNL_MAGIC || hdr->seq != seq ||
+          hdr->used > j->bsize) {
+         break;
+      }
+      count += jrnl_apply_block(block, apply, arg);
+   }
+
+   pthread_mutex_lock(&j->mutex);
+   j->tail = sb->tail;
+   j->head = seq;
+   pthread_mutex_unlock(&j->mutex);
+   return count;
+}
+
+
+int journal_commit(journal_t* j, char* tx, unsigned len)
+{
+   if (j == NULL || tx == NULL || len == 0 || len > journal_max_tx(j)) {
+      return -1;
+   }
+
+   pthread_mutex_lock(&j->mutex);
+
+   // 1. Acrescentar a transaccao ao lote pendente
+   unsigned need = sizeof(unsigned) + len;
+   for (;;) {
+      if (j->pending_blocks > 0) {
+         char* last = &j->buf[j->cur][(j->pending_blocks - 1) * j->bsize];
+         if (((jrnl_blk_hdr_t*)last)->used + need <= j->bsize) {
+            break;
+         }
+      }
+      if (j->pending_blocks < j->cap_blocks) {
+         char* blk = &j->buf[j->cur][j->pending_blocks * j->bsize];
+         memset(blk, 0, j->bsize);
+         ((jrnl_blk_hdr_t*)blk)->used = sizeof(jrnl_blk_hdr_t);
+         j->pending_blocks++;
+         break;
+      }
+      // lote cheio: esperar que o lote actual seja escrito
+      pthread_cond_wait(&j->cond, &j->mutex);
+   }
+
+   char* blk = &j->buf[j->cur][(j->pending_blocks - 1) * j->bsize];
+   jrnl_blk_hdr_t* hdr = (jrnl_blk_hdr_t*)blk;
+   memcpy(&blk[hdr->used], &len, sizeof(len));
+   memcpy(&blk[hdr->used + sizeof(len)], tx, len);
+   hdr->used += need;
+   unsigned my_batch = j->open_batch;
+   jrnl_waiter_t me = { 0, j->waiters };
+   j->waiters = &me;
+
+   // 2. Group commit: o primeiro a chegar escreve o lote de todos
+   while (j->durable_batch <= my_batch) {
+      if (j->writing) {
+         pthread_cond_wait(&j->cond, &j->mutex);
+         continue;
+      }
+
+      char* wbuf = j->buf[j->cur];
+      unsigned n = j->pending_blocks;
+      unsigned batch = j->open_batch++;
+      jrnl_waiter_t* waiters = j->waiters;
+      j->waiters = NULL;
+      j->cur ^= 1;
+      j->pending_blocks = 0;
+      j->writing = 1;
+      pthread_mutex_unlock(&j->mutex);
+
+      int res = jrnl_write_batch(j, wbuf, n);
+
+      pthread_mutex_lock(&j->mutex);
+      // o resultado so e devolvido aos que estavam neste lote
+      for (jrnl_waiter_t* w = waiters; w != NULL; w = w->next) {
+         w->res = res;
+      }
+      j->durable_batch = batch + 1;
+      j->writing = 0;
+      pthread_cond_broadcast(&j->cond);
+   }
+
+   pthread_mutex_unlock(&j->mutex);
+   return me.res;
+}
+
+
+int journal_checkpoint(journal_t* j)
+{
+   if (j == NULL) {
+      return -1;
+   }
+
+   pthread_mutex_lock(&j->mutex);
+   while (j->writing) {
+      pthread_cond_wait(&j->cond, &j->mutex);
+   }
+   j->writing = 1;
+   pthread_mutex_unlock(&j->mutex);
+
+   int res = jrnl_do_checkpoint(j);
+
+   pthread_mutex_lock(&j->mutex);
+   j->writing = 0;
+   pthread_cond_broadcast(&j->cond);
+   pthread_mutex_unlock(&j->mutex);
+   return res;
+}
+
+
+unsigned journal_max_tx(journal_t* j)
+{
+   return j->bsize - sizeof(jrnl_blk_hdr_t) - sizeof(unsigned);
+}
@@ -0,0 +1,108 @@
+/*
+ * Journal Layer
+ *
+ * journal.h
+ *
+ * Interface to a circular write-ahead journal kept in a contiguous
+ * region of blocks. Transactions are opaque byte strings produced by
+ * the file system layer; concurrent commits are grouped into a single
+ * sequential journal write (group commit).
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "block.h"
+
+
+/*
+ * journal_t: the journal instance (the implementation is hidden)
+ */
+typedef struct journal_ journal_t;
+
+
+/*
+ * journal_apply_t: called during replay for every committed transaction
+ * - arg: the argument given to journal_replay
+ * - tx: the transaction bytes
+ * - len: the size of the transaction
+ */
+typedef void (*journal_apply_t)(void* arg, char* tx, unsigned len);
+
+
+/*
+ * journal_checkpoint_t: called when the journal needs space; must write
+ * the in-place copy of every change already committed to the journal
+ * (every transaction already passed to the 'durable' function)
+ * - arg: the argument given to journal_new
+ */
+typedef void (*journal_checkpoint_t)(void* arg);
+
+
+/*
+ * journal_new: create a journal over blocks [start, start+num_blocks)
+ * - bks: the blocks instance
+ * - start: first block of the journal area (journal header)
+ * - num_blocks: number of blocks of the journal area (header included)
+ * - checkpoint: function used to checkpoint the in-place metadata
+ * - durable: function called (may be NULL) for every transaction once
+ *   it is durable, before journal_commit returns and before any later
+ *   checkpoint; it is never called concurrently with 'checkpoint'
+ * - arg: argument passed to 'checkpoint' and 'durable'
+ *   returns: the journal instance or NULL if error
+ */
+journal_t* journal_new(blocks_t* bks, unsigned start, unsigned num_blocks,
+   journal_checkpoint_t checkpoint, journal_apply_t durable, void* arg);
+
+
+/*
+ * journal_free: release the journal instance
+ */
+void journal_free(journal_t* j);
+
+
+/*
+ * journal_format: writes an empty journal to the journal area
+ *   returns: 0 if sucessful, -1 if not
+ */
+int journal_format(journal_t* j);
+
+
+/*
+ * journal_replay: applies every committed transaction not yet
+ * checkpointed, oldest first
+ * - apply: function called for each transaction
+ * - arg: argument passed to 'apply'
+ *   returns: number of transactions replayed, -1 if the journal area
+ *   does not contain a valid journal
+ */
+int journal_replay(journal_t* j, journal_apply_t apply, void* arg);
+
+
+/*
+ * journal_commit: appends a transaction to the journal and waits until
+ * it is durable; transactions committed concurrently share a single
+ * journal write
+ * - tx: the transaction bytes
+ * - len: size of the transaction (at most journal_max_tx bytes)
+ *   returns: 0 if sucessful, -1 if not
+ */
+int journal_commit(journal_t* j, char* tx, unsigned len);
+
+
+/*
+ * journal_checkpoint: checkpoints the in-place metadata and empties
+ * the journal
+ *   returns: 0 if sucessful, -1 if not
+ */
+int journal_checkpoint(journal_t* j);
+
+
+/*
+ * journal_max_tx: maximum size of a single transaction
+ */
+unsigned journal_max_tx(journal_t* j);
+
+
+#endif
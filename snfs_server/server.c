@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <signal.h>
 #include <sthread.h>
 #ifdef USE_PTHREADS
 #include <pthread.h>
@@ -54,13 +55,14 @@ typedef struct _req* req_t;
  * service handlers are implemented in snfs.c
  */
 
-#define NUM_REQ_HANDLERS 8
+#define NUM_REQ_HANDLERS 15
 #define NUM_TC 5		// max number of active threads
 #define RING_SIZE 10
 
 
 static sthread_mon_t mon = NULL;
 static int available_reqs; // buffer requests not yet consumed 
+static volatile sig_atomic_t stop_server = 0; // SIGINT/SIGTERM received
 req_t ring[RING_SIZE];
 int sockfd;
 
@@ -75,7 +77,14 @@ struct {
   {REQ_CREATE, snfs_create},
   {REQ_MKDIR, snfs_mkdir},
   {REQ_READDIR, snfs_readdir},
-  {REQ_COPY, snfs_copy}
+  {REQ_COPY, snfs_copy},
+  {REQ_STATFS, snfs_statfs},
+  {REQ_READDIRPLUS, snfs_readdirplus},
+  {REQ_UNLINK, snfs_unlink},
+  {REQ_RMDIR, snfs_rmdir},
+  {REQ_TRUNCATE, snfs_truncate},
+  {REQ_FALLOCATE, snfs_fallocate},
+  {REQ_CACHE, snfs_cache}
 };
 
 /*
@@ -108,13 +117,25 @@ int my_recvfrom(snfs_msg_req_t* req, struct sockaddr_un* cliaddr, socklen_t* cli
 	do {
 		errno = 0;
 		reqsz = recvfrom(sockfd, (void*)req, sizeof(*req), MSG_DONTWAIT, (struct sockaddr *)cliaddr, clilen);
-		if(errno == EAGAIN)
+		if(errno == EAGAIN) {
+			if (stop_server) {
+				// write the cached changes before terminating
+				snfs_shutdown();
+				printf("[snfs_srv] server stopped.\n");
+				exit(0);
+			}
 			sthread_yield();
+		}
 	} while(errno == EAGAIN);
 	
 	return reqsz;
 }
 
+void srv_stop(int sig)
+{
+	stop_server = 1;
+}
+
 void srv_init_socket(struct sockaddr_un* servaddr)
 {	
    	// creates socket datagram domain unix
@@ -270,6 +291,8 @@ int main(int argc, char **argv)
 	
 	//initialize filesystem
 	snfs_init(argc, argv);
+	signal(SIGINT, srv_stop);
+	signal(SIGTERM, srv_stop);
 
 	
       	// initialize SNFS layer
@@ -25,16 +25,225 @@
 
 #define DEFAULT_DISK_DELAY 10000
 
-static fs_t* FS;
+#define SNFS_MAX_VOLUMES 8
+
+// seconds between saves of the cache warm-up list of a volume image
+#define SNFS_WARMUP_PERIOD 30
+
+
+// a volume served by this server; volume 0 is the default volume, the
+// one used by paths without a volume name
+typedef struct {
+  char name[MAX_FILE_NAME_SIZE];
+  fs_t* fs;
+} snfs_volume_t;
+
+static snfs_volume_t Volumes[SNFS_MAX_VOLUMES];
+static int NumVolumes;
+
+// blocks per second moved by the defragmenter of each volume (0: off)
+static unsigned DefragRate;
+
+// blocks of each volume image kept in memory (0: the image is only used
+// through the block caches of the file system)
+static unsigned RamBlocks;
+
+// volumes written as a log, and blocks per second moved by their cleaner
+static int LogMode;
+static unsigned LogCleanRate;
+
+
+// adds the volume 'name'; without an image the volume is kept in memory
+// and always formatted, otherwise the image is formatted if 'mkfs' is set
+// and mounted if not
+static void snfs_add_volume(char* name, char* image, int mkfs, int disk_delay)
+{
+  if (NumVolumes == SNFS_MAX_VOLUMES || strlen(name) >= MAX_FILE_NAME_SIZE) {
+    printf("[snfs] cannot add volume '%s'.\n", name);
+    exit(-1);
+  }
+  for (int i = 0; i < NumVolumes; i++) {
+    if (strcmp(Volumes[i].name, name) == 0) {
+      printf("[snfs] duplicate volume '%s'.\n", name);
+      exit(-1);
+    }
+  }
+
+  fs_t* fs;
+  if (image == NULL) {
+    fs = fs_new(NUM_BLOCKS, disk_delay);
+    fs_format(fs);
+  } else {
+    fs = RamBlocks ? fs_open_tiered(image, NUM_BLOCKS, RamBlocks, disk_delay) :
+                     fs_open(image, NUM_BLOCKS, disk_delay);
+    if (fs == NULL) {
+      printf("[snfs] cannot open image '%s'.\n", image);
+      exit(-1);
+    }
+    if (mkfs) {
+      if (fs_format(fs) < 0) {
+        printf("[snfs] cannot format image '%s'.\n", image);
+        exit(-1);
+      }
+    } else if (fs_mount(fs) < 0) {
+      printf("[snfs] no file system in image '%s' (use -mkfs).\n", image);
+      exit(-1);
+    }
+
+    // the hot blocks of the previous run are kept in "image.warm"
+    char warm[strlen(image) + 6];
+    sprintf(warm, "%s.warm", image);
+    if (mkfs) {
+      remove(warm);
+    }
+    fs_warmup_start(fs, warm, SNFS_WARMUP_PERIOD);
+  }
+
+  strcpy(Volumes[NumVolumes].name, name);
+  Volumes[NumVolumes++].fs = fs;
+}
+
+
+// returns the volume of 'pathname' ("name:/path", or "/path" for the
+// default volume) and the path inside the volume, or -1; the volume name
+// is only taken from a prefix that ends right before the first '/', so
+// "/dir/a:b" is a path of the default volume
+static int snfs_path_volume(char* pathname, char** path)
+{
+  char* sep = strchr(pathname, SNFS_VOLUME_SEP);
+  if (sep == NULL || strchr(pathname, '/') != sep + 1) {
+    *path = pathname;
+    return 0;
+  }
+  for (int i = 1; i < NumVolumes; i++) {
+    if (strlen(Volumes[i].name) == sep - pathname &&
+        strncmp(Volumes[i].name, pathname, sep - pathname) == 0) {
+      *path = sep + 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+// returns the volume of a file handle and the inode it refers to, or -1
+static int snfs_fhandle_volume(snfs_fhandle_t fhandle, inodeid_t* inode)
+{
+  unsigned vol = SNFS_FHANDLE_VOLUME(fhandle);
+  if (vol >= NumVolumes) {
+    return -1;
+  }
+  *inode = SNFS_FHANDLE_INODE(fhandle);
+  return vol;
+}
 
 
 void snfs_init(int argc, char **argv)
 {
   int disk_delay = DEFAULT_DISK_DELAY;
-  if (argc == 2)
-    sscanf(argv[1], "%d", &disk_delay);
-  FS = fs_new(NUM_BLOCKS, disk_delay);
-  fs_format(FS);
+  char* image = NULL;
+  int mkfs = 0;
+  char* volumes[SNFS_MAX_VOLUMES];
+  int num_volumes = 0;
+  char* cache = NULL;
+  int dedup = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-mkfs") == 0)
+      mkfs = 1;
+    else if (strcmp(argv[i], "-dedup") == 0)
+      dedup = 1;
+    else if (strcmp(argv[i], "-image") == 0 && i + 1 < argc)
+      image = argv[++i];
+    else if (strcmp(argv[i], "-volume") == 0 && i + 1 < argc) {
+      if (num_volumes == SNFS_MAX_VOLUMES - 1) {
+        printf("[snfs] too many volumes (at most %d).\n", SNFS_MAX_VOLUMES);
+        exit(-1);
+      }
+      volumes[num_volumes++] = argv[++i];
+    }
+    else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+      cache = argv[++i];
+    else if (strcmp(argv[i], "-defrag") == 0 && i + 1 < argc)
+      sscanf(argv[++i], "%u", &DefragRate);
+    else if (strcmp(argv[i], "-ram") == 0 && i + 1 < argc)
+      sscanf(argv[++i], "%u", &RamBlocks);
+    else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc) {
+      LogMode = 1;
+      sscanf(argv[++i], "%u", &LogCleanRate);
+    }
+    else if (sscanf(argv[i], "%d", &disk_delay) != 1) {
+      printf("[snfs] unknown option '%s'.\n", argv[i]);
+      exit(-1);
+    }
+  }
+
+  snfs_add_volume("", image, mkfs, disk_delay);
+
+  // other volumes: "-volume name" (in memory) or "-volume name:image"
+  for (int i = 0; i < num_volumes; i++) {
+    char* sep = strchr(volumes[i], SNFS_VOLUME_SEP);
+    if (sep != NULL) {
+      *sep = '\0';
+    }
+    snfs_add_volume(volumes[i], sep ? sep + 1 : NULL, mkfs, disk_delay);
+  }
+
+  // cache budget of each volume: "-cache bytes" or "-cache bytes:meta_pct"
+  if (cache != NULL) {
+    fs_cache_info_t info;
+    fs_cache_info(Volumes[0].fs, &info);
+    sscanf(cache, "%u:%u", &info.budget, &info.meta_pct);
+    for (int i = 0; i < NumVolumes; i++) {
+      if (fs_cache_resize(Volumes[i].fs, info.budget, info.meta_pct) < 0) {
+        printf("[snfs] invalid cache budget '%s'.\n", cache);
+        exit(-1);
+      }
+    }
+  }
+
+  // deduplication of the data blocks of every volume
+  for (int i = 0; dedup && i < NumVolumes; i++) {
+    if (fs_dedup_enable(Volumes[i].fs) < 0) {
+      printf("[snfs] cannot enable deduplication.\n");
+      exit(-1);
+    }
+  }
+
+  // background defragmentation of every volume: "-defrag blocks_per_second"
+  for (int i = 0; DefragRate > 0 && i < NumVolumes; i++) {
+    if (fs_defrag_start(Volumes[i].fs, DefragRate) < 0) {
+      printf("[snfs] cannot start the defragmenter.\n");
+      exit(-1);
+    }
+  }
+
+  // log-structured writes on every volume: "-log cleaner_blocks_per_second"
+  for (int i = 0; LogMode && i < NumVolumes; i++) {
+    if (fs_log_start(Volumes[i].fs, LogCleanRate) < 0) {
+      printf("[snfs] cannot start the log-structured write mode.\n");
+      exit(-1);
+    }
+  }
+}
+
+
+void snfs_shutdown()
+{
+  for (int i = 0; i < NumVolumes; i++) {
+    fs_defrag_info_t info;
+    if (DefragRate > 0 && fs_defrag_info(Volumes[i].fs, &info) == 0) {
+      printf("[snfs] volume '%s': %u of %u files fragmented, %u blocks moved.\n",
+         Volumes[i].name, info.fragmented, info.files, info.moved_blocks);
+    }
+    fs_log_info_t log;
+    if (LogMode && fs_log_info(Volumes[i].fs, &log) == 0) {
+      printf("[snfs] volume '%s': %u blocks written to the log, %u segments cleaned.\n",
+         Volumes[i].name, log.log_blocks, log.cleaned);
+    }
+    fs_stop(Volumes[i].fs);
+    fs_warmup_save(Volumes[i].fs);
+    fs_sync(Volumes[i].fs);
+  }
 }
 
 
@@ -67,7 +276,8 @@ void snfs_lookup(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   char* file = req->body.lookup.pname;
+   char* file;
+   int vol = snfs_path_volume(req->body.lookup.pname, &file);
 
    // prepare response
    *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.lookup);
@@ -77,11 +287,11 @@ void snfs_lookup(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
 
    inodeid_t fileid;
-   if (fs_lookup(FS,file,&fileid) == 1) {
+   if (vol >= 0 && fs_lookup(Volumes[vol].fs,file,&fileid) == 1) {
       fs_file_attrs_t attrs;
-      if (fs_get_attrs(FS,fileid,&attrs) == 0) {
+      if (fs_get_attrs(Volumes[vol].fs,fileid,&attrs) == 0) {
          res->status = RES_OK;
-         res->body.lookup.file = fileid;
+         res->body.lookup.file = SNFS_FHANDLE(vol, fileid);
          res->body.lookup.fsize = attrs.size;
       }
    }   
@@ -92,7 +302,8 @@ void snfs_read(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   inodeid_t file = (inodeid_t)req->body.read.fhandle;
+   inodeid_t file;
+   int vol = snfs_fhandle_volume(req->body.read.fhandle, &file);
    unsigned offset = req->body.read.offset;
    unsigned count = req->body.read.count;
    
@@ -104,7 +315,7 @@ void snfs_read(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    char* data = res->body.read.data;
    int* nread = (int*)&res->body.read.nread;
-   if (count <= MAX_READ_DATA && !fs_read(FS,file,offset,count,data,nread)){
+   if (vol >= 0 && count <= MAX_READ_DATA && !fs_read(Volumes[vol].fs,file,offset,count,data,nread)){
       res->status = RES_OK;
    }
 }
@@ -114,7 +325,8 @@ void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   inodeid_t file = (inodeid_t)req->body.write.fhandle;
+   inodeid_t file;
+   int vol = snfs_fhandle_volume(req->body.write.fhandle, &file);
    unsigned offset = req->body.write.offset;
    unsigned count = req->body.write.count;
    char* data = req->body.write.data;
@@ -125,9 +337,9 @@ void snfs_write(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    res->status = RES_ERROR;
 
    // handle request
-   if (count <= MAX_WRITE_DATA && !fs_write(FS,file,offset,count,data)){
+   if (vol >= 0 && count <= MAX_WRITE_DATA && !fs_write(Volumes[vol].fs,file,offset,count,data)){
       fs_file_attrs_t attrs;
-      if (fs_get_attrs(FS,file,&attrs) == 0) {
+      if (fs_get_attrs(Volumes[vol].fs,file,&attrs) == 0) {
          res->status = RES_OK;
          res->body.write.fsize = attrs.size;
       }
@@ -139,7 +351,8 @@ void snfs_create(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   inodeid_t dir = (inodeid_t)req->body.create.dir;
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.create.dir, &dir);
    char* name = req->body.create.name;
 
    // format the response
@@ -150,9 +363,9 @@ void snfs_create(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    name[MAX_FILE_NAME_SIZE-1] = '\0';
    inodeid_t fileid;
-   if (!fs_create(FS,dir,name,&fileid)) {
+   if (vol >= 0 && !fs_create(Volumes[vol].fs,dir,name,&fileid)) {
       res->status = RES_OK;
-      res->body.create.file = (snfs_fhandle_t)fileid;
+      res->body.create.file = SNFS_FHANDLE(vol, fileid);
    }
 }
 
@@ -161,7 +374,8 @@ void snfs_mkdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   inodeid_t dir = (inodeid_t)req->body.mkdir.dir;
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.mkdir.dir, &dir);
    char* f = req->body.mkdir.file;
 
    // format the response
@@ -172,9 +386,9 @@ void snfs_mkdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    f[MAX_FILE_NAME_SIZE-1] = '\0';
    inodeid_t dirid;
-   if (fs_mkdir(FS,dir,f,&dirid)==0) {
+   if (vol >= 0 && fs_mkdir(Volumes[vol].fs,dir,f,&dirid)==0) {
       res->status = RES_OK;
-      res->body.mkdir.newdirid = (snfs_fhandle_t) dirid;
+      res->body.mkdir.newdirid = SNFS_FHANDLE(vol, dirid);
    }
 }
 
@@ -183,8 +397,13 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    int* ressz)
 {
    // get input arguments
-   inodeid_t dir = (inodeid_t)req->body.readdir.dir;
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.readdir.dir, &dir);
    unsigned maxentries = req->body.readdir.cmax;
+   unsigned cookie = req->body.readdir.cookie;
+   if (maxentries > MAX_READDIR_ENTRIES) {
+      maxentries = MAX_READDIR_ENTRIES;
+   }
    
    // format the response
    *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.readdir);
@@ -194,9 +413,11 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    // handle request
    fs_file_name_t entries[MAX_READDIR_ENTRIES];
    int numentries;
-   if (!fs_readdir(FS,dir,entries,maxentries,&numentries)) {
+   if (vol >= 0 && !fs_readdir(Volumes[vol].fs,dir,&cookie,entries,maxentries,&numentries)) {
       res->status = RES_OK;
       res->body.readdir.count = numentries;
+      res->body.readdir.cookie = 
+         (cookie == FS_READDIR_END) ? READDIR_COOKIE_END : cookie;
       for (int i = 0; i < numentries; i++) {
          snfs_dir_entry_t* entry = &res->body.readdir.list[i]; 
          strncpy(entry->name,entries[i].name,MAX_FILE_NAME_SIZE);
@@ -217,12 +438,62 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 }
 
 
-void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+void snfs_readdirplus(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
    int* ressz)
 {
    // get input arguments
-   char* srcpath = req->body.copy.srcpathname;
-   char* tgtpath = req->body.copy.tgtpathname;
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.readdirplus.dir, &dir);
+   unsigned maxentries = req->body.readdirplus.cmax;
+   unsigned cookie = req->body.readdirplus.cookie;
+   if (maxentries > MAX_READDIRPLUS_ENTRIES) {
+      maxentries = MAX_READDIRPLUS_ENTRIES;
+   }
+   
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.readdirplus);
+   res->type = REQ_READDIRPLUS;
+   res->status = RES_ERROR;
+
+   // handle request: fs_readdir already gives the inode and the size of
+   // each entry, so the client does not need a lookup per file
+   fs_file_name_t entries[MAX_READDIRPLUS_ENTRIES];
+   int numentries;
+   if (vol >= 0 && !fs_readdir(Volumes[vol].fs,dir,&cookie,entries,maxentries,&numentries)) {
+      res->status = RES_OK;
+      res->body.readdirplus.count = numentries;
+      res->body.readdirplus.cookie = 
+         (cookie == FS_READDIR_END) ? READDIR_COOKIE_END : cookie;
+      for (int i = 0; i < numentries; i++) {
+         snfs_dir_entry_plus_t* entry = &res->body.readdirplus.list[i]; 
+         strncpy(entry->name,entries[i].name,MAX_FILE_NAME_SIZE);
+         entry->len = strlen(entry->name);
+         entry->file = SNFS_FHANDLE(vol, entries[i].inodeid);
+         entry->fsize = entries[i].size;
+         switch (entries[i].type) {
+            case FS_DIR:
+               entry->type = SNFS_DIR;
+               break;
+            case FS_FILE:
+               entry->type = SNFS_FILE;
+               break;
+            default:
+               printf("[snfs] severe error unknown file type.\n");
+               exit(-1);
+         }
+      }
+   }
+}
+
+
+void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments (both files must be in the same volume)
+   char* srcpath;
+   char* tgtpath;
+   int vol = snfs_path_volume(req->body.copy.srcpathname, &srcpath);
+   int tgtvol = snfs_path_volume(req->body.copy.tgtpathname, &tgtpath);
 
    // prepare response
    *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.copy);
@@ -230,7 +501,143 @@ void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
    res->status = RES_ERROR;
   
    // handle request
-   if (fs_copy(FS,srcpath,tgtpath) == 0) {
+   if (vol >= 0 && vol == tgtvol && fs_copy(Volumes[vol].fs,srcpath,tgtpath) == 0) {
      res->status = RES_OK;
    }
 }
+
+
+void snfs_statfs(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t file;
+   int vol = snfs_fhandle_volume(req->body.statfs.file, &file);
+
+   // prepare response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.statfs);
+   res->type = REQ_STATFS;
+   res->status = RES_ERROR;
+
+   // handle request
+   fs_statfs_t stats;
+   if (vol >= 0 && fs_statfs(Volumes[vol].fs,&stats) == 0) {
+      res->status = RES_OK;
+      res->body.statfs.stats.bsize = stats.block_size;
+      res->body.statfs.stats.blocks = stats.total_blocks;
+      res->body.statfs.stats.bfree = stats.free_blocks;
+      res->body.statfs.stats.files = stats.total_inodes;
+      res->body.statfs.stats.ffree = stats.free_inodes;
+   }
+}
+
+
+void snfs_unlink(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.unlink.dir, &dir);
+   char* name = req->body.unlink.name;
+
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.unlink);
+   res->type = REQ_UNLINK;
+   res->status = RES_ERROR;
+
+   // handle request
+   name[MAX_FILE_NAME_SIZE-1] = '\0';
+   if (vol >= 0 && fs_unlink(Volumes[vol].fs,dir,name) == 0) {
+      res->status = RES_OK;
+   }
+}
+
+
+void snfs_rmdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t dir;
+   int vol = snfs_fhandle_volume(req->body.rmdir.dir, &dir);
+   char* name = req->body.rmdir.name;
+
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.rmdir);
+   res->type = REQ_RMDIR;
+   res->status = RES_ERROR;
+
+   // handle request
+   name[MAX_FILE_NAME_SIZE-1] = '\0';
+   if (vol >= 0 && fs_rmdir(Volumes[vol].fs,dir,name) == 0) {
+      res->status = RES_OK;
+   }
+}
+
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t fileid;
+   int vol = snfs_fhandle_volume(req->body.truncate.fhandle, &fileid);
+   unsigned size = req->body.truncate.size;
+
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.truncate);
+   res->type = REQ_TRUNCATE;
+   res->status = RES_ERROR;
+
+   // handle request
+   if (vol >= 0 && fs_truncate(Volumes[vol].fs,fileid,size) == 0) {
+      res->status = RES_OK;
+   }
+}
+
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t fileid;
+   int vol = snfs_fhandle_volume(req->body.fallocate.fhandle, &fileid);
+   unsigned offset = req->body.fallocate.offset;
+   unsigned len = req->body.fallocate.len;
+
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.fallocate);
+   res->type = REQ_FALLOCATE;
+   res->status = RES_ERROR;
+
+   // handle request
+   if (vol >= 0 && fs_fallocate(Volumes[vol].fs,fileid,offset,len) == 0) {
+      res->status = RES_OK;
+   }
+}
+
+
+void snfs_cache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz)
+{
+   // get input arguments
+   inodeid_t file;
+   int vol = snfs_fhandle_volume(req->body.cache.file, &file);
+   unsigned budget = req->body.cache.budget;
+   unsigned meta_pct = req->body.cache.meta_pct;
+
+   // format the response
+   *ressz = sizeof(*res) - sizeof(res->body) + sizeof(res->body.cache);
+   res->type = REQ_CACHE;
+   res->status = RES_ERROR;
+
+   // handle request (budget 0 only reports the current size)
+   fs_cache_info_t info;
+   if (vol >= 0 &&
+       (budget == 0 || fs_cache_resize(Volumes[vol].fs,budget,meta_pct) == 0) &&
+       fs_cache_info(Volumes[vol].fs,&info) == 0) {
+      res->status = RES_OK;
+      res->body.cache.cache.budget = info.budget;
+      res->body.cache.cache.meta_pct = info.meta_pct;
+      res->body.cache.cache.blocks = info.data_blocks;
+      res->body.cache.cache.dirpages = info.dir_pages;
+   }
+}
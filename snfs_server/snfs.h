@@ -27,12 +27,25 @@ typedef void (*snfs_handler_t)(snfs_msg_req_t *req, int reqsz,
 
 
 /*
- * snfs_init: performs internal SNFS initialization; currently
- * argc and argv are not being used.
+ * snfs_init: performs internal SNFS initialization; the arguments are
+ * [disk_delay] [-image file] [-volume name[:file]]... [-mkfs]
+ * [-cache bytes[:meta_pct]] [-dedup]: -image gives the default volume
+ * and each -volume adds a named volume; a volume without an image is
+ * kept in memory and formatted; an existing image is mounted unless
+ * -mkfs is given; -cache sets the cache budget of every volume and
+ * -dedup shares identical data blocks. The caches of a volume image are
+ * warmed up from "file.warm", saved periodically.
  */
 void snfs_init(int argc, char **argv);
 
 
+/*
+ * snfs_shutdown: writes every pending change and the warm-up lists of
+ * the volumes.
+ */
+void snfs_shutdown();
+
+
 /*
  * SNFS Handlers
  *
@@ -73,4 +86,32 @@ void snfs_readdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res,
 void snfs_copy(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
 	       int* ressz);
 
+
+void snfs_statfs(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_readdirplus(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_unlink(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_rmdir(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_truncate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_fallocate(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
+
+void snfs_cache(snfs_msg_req_t *req, int reqsz, snfs_msg_res_t *res, 
+   int* ressz);
+
 #endif